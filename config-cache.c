@@ -0,0 +1,427 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <security/pam_ext.h>
+
+#include "config-cache.h"
+
+/*
+ * The cache is a header identifying the config file it was compiled from,
+ * followed by the entries sorted by name with only the last entry for
+ * each name kept, followed by a pool of the NUL-terminated names that the
+ * entries point into.  Limits are stored already parsed, along with the
+ * position of the entry in the config file, so that the last of a user's
+ * own, group and wildcard entries can still be picked out.  Lookups are
+ * binary searches over the mapped file.
+ *
+ * The cache is only ever read by the host that wrote it, so everything is
+ * in native byte order; the magic and version reject anything else.
+ */
+#define CACHE_MAGIC "TLCACHE"
+#define CACHE_VERSION 4
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t pool_size;
+};
+
+struct cache_entry {
+	uint32_t user;
+	uint32_t line;
+	struct config_limits limits;
+};
+
+struct config_cache {
+	char *data;
+	size_t size;
+	bool mapped;
+	uint32_t count;
+	const struct cache_entry *entries;
+	const char *pool;
+	uint64_t pool_size;
+};
+
+
+static void fill_key(struct cache_header *header, const struct stat *st)
+{
+	header->dev = st->st_dev;
+	header->ino = st->st_ino;
+	header->size = st->st_size;
+	header->mtime_sec = st->st_mtim.tv_sec;
+	header->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+
+/* returns the cache if data is a well-formed image, taking ownership */
+static struct config_cache *open_image(char *data, size_t size, bool mapped)
+{
+	const struct cache_header *header = (const struct cache_header *)data;
+	struct config_cache *cache;
+
+	if (size < sizeof(*header)
+	    || memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))
+	    || header->version != CACHE_VERSION
+	    || header->pool_size == 0
+	    || header->pool_size > UINT32_MAX
+	    || size != sizeof(*header)
+	               + header->count * sizeof(struct cache_entry)
+	               + header->pool_size)
+		return NULL;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->data = data;
+	cache->size = size;
+	cache->mapped = mapped;
+	cache->count = header->count;
+	cache->entries = (const struct cache_entry *)(data + sizeof(*header));
+	cache->pool = (const char *)(cache->entries + header->count);
+	cache->pool_size = header->pool_size;
+
+	/* so that every string in the pool is terminated */
+	if (cache->pool[cache->pool_size - 1] != '\0') {
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+
+struct config_cache *load_config_cache(const pam_handle_t *handle,
+                                       const char *cachepath,
+                                       const struct stat *config_stat)
+{
+	struct cache_header key, *header;
+	struct config_cache *cache;
+	struct stat statbuf;
+	char *data;
+	int fd;
+
+	fd = open(cachepath, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	/* only trust a cache written by whoever could write the config */
+	if (fstat(fd, &statbuf) < 0 || statbuf.st_uid != config_stat->st_uid
+	    || statbuf.st_size < sizeof(*header))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	header = (struct cache_header *)data;
+	fill_key(&key, config_stat);
+	if (header->dev != key.dev || header->ino != key.ino
+	    || header->size != key.size || header->mtime_sec != key.mtime_sec
+	    || header->mtime_nsec != key.mtime_nsec)
+	{
+		munmap(data, statbuf.st_size);
+		return NULL;
+	}
+
+	cache = open_image(data, statbuf.st_size, true);
+	if (!cache) {
+		pam_syslog(handle, LOG_WARNING,
+		           "Ignoring invalid config cache '%s'", cachepath);
+		munmap(data, statbuf.st_size);
+	}
+	return cache;
+}
+
+
+struct sort_entry {
+	const char *user;
+	struct config_limits limits;
+	size_t line;
+};
+
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct sort_entry *x = a, *y = b;
+	int retval = strcmp(x->user, y->user);
+
+	if (retval)
+		return retval;
+	return (x->line > y->line) - (x->line < y->line);
+}
+
+
+/* atomically replace cachepath with the image; failure is not fatal,
+   the next caller will just try again */
+static void write_cache_file(const pam_handle_t *handle,
+                             const char *cachepath,
+                             const struct stat *config_stat,
+                             const char *data, size_t size)
+{
+	char *tmppath;
+	size_t done = 0;
+	int fd;
+
+	tmppath = malloc(strlen(cachepath) + sizeof(".XXXXXX"));
+	if (!tmppath)
+		return;
+	sprintf(tmppath, "%s.XXXXXX", cachepath);
+
+	fd = mkstemp(tmppath);
+	if (fd < 0) {
+		pam_syslog(handle, LOG_WARNING,
+		           "Could not write config cache '%s': %s",
+		           cachepath, strerror(errno));
+		free(tmppath);
+		return;
+	}
+
+	while (done < size) {
+		ssize_t bytes = write(fd, data + done, size - done);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		done += bytes;
+	}
+
+	if (done != size || fchmod(fd, config_stat->st_mode & 0666) < 0) {
+		pam_syslog(handle, LOG_WARNING,
+		           "Could not write config cache '%s': %s",
+		           cachepath, strerror(errno));
+		close(fd);
+		unlink(tmppath);
+	} else if (close(fd) < 0 || rename(tmppath, cachepath) < 0) {
+		pam_syslog(handle, LOG_WARNING,
+		           "Could not write config cache '%s': %s",
+		           cachepath, strerror(errno));
+		unlink(tmppath);
+	}
+	free(tmppath);
+}
+
+
+struct config_cache *build_config_cache(const pam_handle_t *handle,
+                                        const char *cachepath,
+                                        const struct stat *config_stat,
+                                        const struct config_entry *user_table)
+{
+	struct cache_header *header;
+	struct cache_entry *entries;
+	struct sort_entry *sorted;
+	struct config_cache *cache;
+	size_t count = 0, kept = 0, pool_size = 0, size, i;
+	char *data, *pool;
+
+	while (user_table[count].user)
+		count++;
+
+	sorted = malloc((count ? count : 1) * sizeof(*sorted));
+	if (!sorted)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		sorted[i].user = user_table[i].user;
+		sorted[i].limits = user_table[i].limits;
+		sorted[i].line = i;
+	}
+	qsort(sorted, count, sizeof(*sorted), compare_entries);
+
+	/* the last match wins, so of each run of entries for the same user
+	   keep only the final one */
+	for (i = 0; i < count; i++) {
+		if (i + 1 < count && !strcmp(sorted[i].user, sorted[i+1].user))
+			continue;
+		sorted[kept++] = sorted[i];
+		pool_size += strlen(sorted[i].user) + 1;
+	}
+
+	/* an empty pool would be indistinguishable from a broken one */
+	if (!pool_size)
+		pool_size = 1;
+
+	if (pool_size > UINT32_MAX || count > UINT32_MAX) {
+		free(sorted);
+		return NULL;
+	}
+
+	size = sizeof(*header) + kept * sizeof(*entries) + pool_size;
+	data = calloc(1, size);
+	if (!data) {
+		free(sorted);
+		return NULL;
+	}
+
+	header = (struct cache_header *)data;
+	memcpy(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header->version = CACHE_VERSION;
+	header->count = kept;
+	header->pool_size = pool_size;
+	fill_key(header, config_stat);
+
+	entries = (struct cache_entry *)(data + sizeof(*header));
+	pool = (char *)(entries + kept);
+	pool_size = 0;
+	for (i = 0; i < kept; i++) {
+		entries[i].user = pool_size;
+		strcpy(pool + pool_size, sorted[i].user);
+		pool_size += strlen(sorted[i].user) + 1;
+
+		/* field by field, so that the padding after window_days
+		   stays as calloc() left it rather than carrying whatever
+		   was on the heap into the file */
+		entries[i].line = sorted[i].line;
+		entries[i].limits.day = sorted[i].limits.day;
+		entries[i].limits.week = sorted[i].limits.week;
+		entries[i].limits.window = sorted[i].limits.window;
+		entries[i].limits.window_days = sorted[i].limits.window_days;
+	}
+	free(sorted);
+
+	write_cache_file(handle, cachepath, config_stat, data, size);
+
+	cache = open_image(data, size, false);
+	if (!cache)
+		free(data);
+	return cache;
+}
+
+
+/* returns the index of the first entry not sorting before name, or
+   cache->count on a malformed entry */
+static size_t lower_bound(const struct config_cache *cache, const char *name)
+{
+	size_t low = 0, high = cache->count;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		const struct cache_entry *entry = &cache->entries[mid];
+
+		if (entry->user >= cache->pool_size)
+			return cache->count;
+
+		if (strcmp(cache->pool + entry->user, name) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+
+static const struct cache_entry *lookup_name(const struct config_cache *cache,
+                                             const char *name)
+{
+	size_t i = lower_bound(cache, name);
+
+	if (i < cache->count && !strcmp(cache->pool + cache->entries[i].user,
+	                                name))
+		return &cache->entries[i];
+	return NULL;
+}
+
+
+/* whether the config has any group entries; these all sort together, just
+   after the "@" that is never itself a valid name */
+static bool has_group_entries(const struct config_cache *cache)
+{
+	const char prefix[] = { CONFIG_GROUP_PREFIX, '\0' };
+	size_t i = lower_bound(cache, prefix);
+
+	return i < cache->count
+	       && cache->pool[cache->entries[i].user] == CONFIG_GROUP_PREFIX;
+}
+
+
+/* of the entries for the user's name, "*" and any of the user's groups,
+   whichever came last in the config file */
+bool config_cache_lookup(const pam_handle_t *handle,
+                         const struct config_cache *cache,
+                         struct config_user *user,
+                         struct config_limits *limits)
+{
+	const struct cache_entry *best, *entry;
+	char * const *groups;
+	int ngroups, i;
+
+	best = lookup_name(cache, user->name);
+	entry = lookup_name(cache, CONFIG_WILDCARD);
+	if (entry && (!best || entry->line > best->line))
+		best = entry;
+
+	/* only worth looking up the groups if the config names any */
+	if (has_group_entries(cache)) {
+		ngroups = config_user_groups(handle, user, &groups);
+		for (i = 0; i < ngroups; i++) {
+			size_t len = strlen(groups[i]);
+			char *group = malloc(len + 2);
+
+			if (!group)
+				break;
+			group[0] = CONFIG_GROUP_PREFIX;
+			memcpy(group + 1, groups[i], len + 1);
+			entry = lookup_name(cache, group);
+			free(group);
+			if (entry && (!best || entry->line > best->line))
+				best = entry;
+		}
+	}
+
+	if (!best)
+		return false;
+	*limits = best->limits;
+	return true;
+}
+
+
+void free_config_cache(struct config_cache *cache)
+{
+	if (!cache)
+		return;
+	if (cache->mapped)
+		munmap(cache->data, cache->size);
+	else
+		free(cache->data);
+	free(cache);
+}
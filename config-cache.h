@@ -0,0 +1,52 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONFIG_CACHE_H
+#define CONFIG_CACHE_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include <security/pam_modules.h>
+
+#include "config-file.h"
+
+struct config_cache;
+
+/* returns the cache for the config file described by config_stat, or NULL
+   if there is no cache or it is out of date */
+struct config_cache *load_config_cache(const pam_handle_t *handle,
+                                       const char *cachepath,
+                                       const struct stat *config_stat);
+
+/* compiles a table as returned by parse_config_file() and writes it out to
+   cachepath; the returned cache is usable even if writing it failed */
+struct config_cache *build_config_cache(const pam_handle_t *handle,
+                                        const char *cachepath,
+                                        const struct stat *config_stat,
+                                        const struct config_entry *user_table);
+
+/* finds the limits of the last entry matching user */
+bool config_cache_lookup(const pam_handle_t *handle,
+                         const struct config_cache *cache,
+                         struct config_user *user,
+                         struct config_limits *limits);
+
+void free_config_cache(struct config_cache *cache);
+
+#endif
@@ -0,0 +1,809 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <security/pam_ext.h>
+
+#include "config-file.h"
+
+
+/* the longest line accepted, newline included */
+#define MAX_LINE_LENGTH 1023
+
+
+/* what identifies a version of a config file without reading it; a file
+   rewritten in place within a single timestamp tick and at the same size
+   is missed, which renaming a new file into place avoids */
+struct config_key {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+};
+
+/* A parsed config file, never changed once it is shared.  The cache holds
+   a reference to the current snapshot of each path, and each lookup one
+   to the snapshot it is using, so that a snapshot replaced because the
+   file changed is freed when the last lookup using it is done. */
+struct config_snapshot {
+	char *path;
+	struct config_key key;
+	struct config_entry *table;
+	/* the group and "*" entries in file order, followed by the last of
+	   each name's own entries sorted by name */
+	const struct config_entry **index;
+	size_t fallbacks;
+	size_t named;
+	unsigned int refs;
+	/* in the cache, while it is the current snapshot of path */
+	struct config_snapshot *next;
+};
+
+static pthread_mutex_t config_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct config_snapshot *config_snapshots;
+
+
+/* the table and the file contents it points into are one allocation */
+void free_config_file(struct config_entry *user_table)
+{
+	free(user_table);
+}
+
+
+void init_config_user(struct config_user *user, const char *name)
+{
+	user->name = name;
+	user->groups_loaded = false;
+	user->groups = NULL;
+	user->ngroups = 0;
+}
+
+
+void free_config_user(struct config_user *user)
+{
+	int i;
+
+	for (i = 0; i < user->ngroups; i++)
+		free(user->groups[i]);
+	free(user->groups);
+	init_config_user(user, user->name);
+}
+
+
+/* the buffer size that the getpw*_r() and getgr*_r() functions want */
+static size_t nss_buffer_size(int name)
+{
+	long size = sysconf(name);
+
+	return size > 0 ? size : 16384;
+}
+
+
+/* One getgrouplist() for the user's gids, then a lookup of each of those
+   to get its name; that's bounded by the user's groups, however many
+   group entries the config has. */
+static int load_user_groups(const pam_handle_t *handle,
+                            struct config_user *user)
+{
+	struct passwd pwd, *pw;
+	int ngids = 32, i;
+	gid_t *gids = NULL;
+	char *buf;
+	size_t size;
+
+	size = nss_buffer_size(_SC_GETPW_R_SIZE_MAX);
+	buf = malloc(size);
+	if (!buf)
+		return -1;
+
+	/* users that aren't in the passwd database have no groups */
+	if (getpwnam_r(user->name, &pwd, buf, size, &pw) != 0 || !pw) {
+		free(buf);
+		return 0;
+	}
+
+	for (;;) {
+		gid_t *newgids = reallocarray(gids, ngids, sizeof(*gids));
+		int count = ngids;
+
+		if (!newgids)
+			goto fail;
+		gids = newgids;
+		if (getgrouplist(user->name, pw->pw_gid, gids, &count) >= 0) {
+			ngids = count;
+			break;
+		}
+		/* count now holds how many there are */
+		ngids = count > ngids ? count : ngids * 2;
+	}
+	free(buf);
+
+	size = nss_buffer_size(_SC_GETGR_R_SIZE_MAX);
+	buf = malloc(size);
+	user->groups = calloc(ngids ? ngids : 1, sizeof(*user->groups));
+	if (!buf || !user->groups)
+		goto fail;
+
+	for (i = 0; i < ngids; i++) {
+		struct group grp, *gr;
+		int retval;
+
+		while ((retval = getgrgid_r(gids[i], &grp, buf, size, &gr))
+		       == ERANGE)
+		{
+			char *newbuf = realloc(buf, size * 2);
+
+			if (!newbuf)
+				goto fail;
+			buf = newbuf;
+			size *= 2;
+		}
+		/* a gid without a name can't be named in the config */
+		if (retval != 0 || !gr)
+			continue;
+
+		user->groups[user->ngroups] = strdup(gr->gr_name);
+		if (!user->groups[user->ngroups])
+			goto fail;
+		user->ngroups++;
+	}
+
+	free(buf);
+	free(gids);
+	return 0;
+
+fail:
+	pam_syslog(handle, LOG_ERR, "Could not look up groups for '%s'",
+	           user->name);
+	free(buf);
+	free(gids);
+	for (i = 0; i < user->ngroups; i++)
+		free(user->groups[i]);
+	free(user->groups);
+	user->groups = NULL;
+	user->ngroups = 0;
+	return -1;
+}
+
+
+int config_user_groups(const pam_handle_t *handle, struct config_user *user,
+                       char * const **groups)
+{
+	/* a failed lookup is logged once, and then taken as no groups */
+	if (!user->groups_loaded) {
+		user->groups_loaded = true;
+		if (load_user_groups(handle, user) < 0)
+			return -1;
+	}
+	*groups = user->groups;
+	return user->ngroups;
+}
+
+
+bool config_entry_matches(const pam_handle_t *handle, const char *entry,
+                          struct config_user *user)
+{
+	char * const *groups;
+	int ngroups, i;
+
+	if (!strcmp(entry, user->name) || !strcmp(entry, CONFIG_WILDCARD))
+		return true;
+	if (entry[0] != CONFIG_GROUP_PREFIX)
+		return false;
+
+	ngroups = config_user_groups(handle, user, &groups);
+	for (i = 0; i < ngroups; i++) {
+		if (!strcmp(entry + 1, groups[i]))
+			return true;
+	}
+	return false;
+}
+
+
+int parse_config_line(char *line, size_t length, char **user, char **limit)
+{
+	size_t i;
+	char *comment;
+
+	*user = NULL;
+	*limit = NULL;
+
+	/* strip comments */
+	comment = strchr(line, '#');
+	if (comment) {
+		*comment = '\0';
+		length = comment - line;
+	}
+
+	/* eat trailing whitespace */
+	while (length && isspace(line[length-1]))
+		line[--length] = '\0';
+
+	/* comment-only or empty line */
+	if (!length)
+		return PAM_SUCCESS;
+
+	/* find the end of the username, which may be the end of the line */
+	for (i = 0; i < length; i++) {
+		if (isspace(line[i]))
+			break;
+	}
+
+	/* no leading whitespace allowed, and a group needs a name */
+	if (!i || (i == 1 && line[0] == CONFIG_GROUP_PREFIX))
+		return PAM_SYSTEM_ERR;
+
+	/* skip whitespace to find the start of the limit */
+	*limit = line + i;
+	while (isspace(**limit))
+		(*limit)++;
+
+	/* no limit specified */
+	if (**limit == '\0') {
+		*limit = NULL;
+		return PAM_SYSTEM_ERR;
+	}
+
+	line[i] = '\0';
+	*user = line;
+
+	return PAM_SUCCESS;
+}
+
+
+bool config_limits_unlimited(const struct config_limits *limits)
+{
+	return limits->day == USEC_INFINITY && limits->week == USEC_INFINITY
+	       && limits->window == USEC_INFINITY;
+}
+
+
+/* the periods that a limit field has given a limit, which may be
+   USEC_INFINITY like one it hasn't */
+#define PERIOD_DAY (1u << 0)
+#define PERIOD_WEEK (1u << 1)
+#define PERIOD_WINDOW (1u << 2)
+
+/* Sets the limit that period names, which ends at the first whitespace
+   or at the end of the string, to timeval, adding the period to set.
+   Returns the end of the period's name, or NULL if it isn't one or is
+   already in set. */
+static char *set_period_limit(char *period, usec_t timeval,
+                              struct config_limits *limits,
+                              unsigned int *set)
+{
+	size_t len = strcspn(period, " \t\n\r\f\v");
+	unsigned long days;
+	char *end;
+
+	if (len == strlen("day") && !strncmp(period, "day", len)) {
+		if (*set & PERIOD_DAY)
+			return NULL;
+		*set |= PERIOD_DAY;
+		limits->day = timeval;
+		return period + len;
+	}
+
+	if (len == strlen("week") && !strncmp(period, "week", len)) {
+		if (*set & PERIOD_WEEK)
+			return NULL;
+		*set |= PERIOD_WEEK;
+		limits->week = timeval;
+		return period + len;
+	}
+
+	/* "<N>days", for a rolling window */
+	if (!isdigit(period[0]))
+		return NULL;
+	errno = 0;
+	days = strtoul(period, &end, 10);
+	if (errno || end + strlen("days") != period + len
+	    || strncmp(end, "days", strlen("days"))
+	    || days < 1 || days > CONFIG_MAX_WINDOW_DAYS
+	    || (*set & PERIOD_WINDOW))
+		return NULL;
+	*set |= PERIOD_WINDOW;
+	limits->window = timeval;
+	limits->window_days = days;
+	return period + len;
+}
+
+
+int parse_config_limits(char *limit, struct config_limits *limits)
+{
+	unsigned int set = 0;
+	char *slash;
+
+	limits->day = USEC_INFINITY;
+	limits->week = USEC_INFINITY;
+	limits->window = USEC_INFINITY;
+	limits->window_days = 0;
+
+	/* a lone timespan, which may itself contain spaces, is a daily
+	   limit */
+	if (!strchr(limit, '/'))
+		return parse_time(limit, &limits->day, USEC_PER_SEC) ? -1 : 0;
+
+	/* otherwise each timespan runs up to the "/" of its period */
+	while ((slash = strchr(limit, '/'))) {
+		usec_t timeval;
+
+		*slash = '\0';
+		if (parse_time(limit, &timeval, USEC_PER_SEC))
+			return -1;
+		limit = set_period_limit(slash + 1, timeval, limits, &set);
+		if (!limit)
+			return -1;
+	}
+
+	/* and nothing may follow the last of them */
+	while (isspace(*limit))
+		limit++;
+	return *limit ? -1 : 0;
+}
+
+
+/* Reads the whole file into the end of a single buffer, leaving room at
+   the start for a table with an entry per line plus the terminator. */
+static struct config_entry *read_config_file(int fd,
+                                             const struct stat *statbuf,
+                                             char **text, size_t *text_size)
+{
+	struct config_entry *results;
+	size_t lines = 0, done = 0, table_size;
+	char *buf, *p;
+
+	/* sized for the file as it is now; if it grows while being read,
+	   the rest is read next time */
+	buf = malloc(statbuf->st_size + 1);
+	if (!buf)
+		return NULL;
+	while (done < statbuf->st_size) {
+		ssize_t bytes = read(fd, buf + done, statbuf->st_size - done);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0) {
+			free(buf);
+			return NULL;
+		}
+		if (bytes == 0)
+			break;
+		done += bytes;
+	}
+
+	for (p = buf; (p = memchr(p, '\n', buf + done - p)); p++)
+		lines++;
+
+	/* only newline-terminated lines can hold an entry */
+	table_size = (lines + 1) * sizeof(*results);
+	results = realloc(buf, table_size + done + 1);
+	if (!results) {
+		free(buf);
+		return NULL;
+	}
+
+	*text = (char *)results + table_size;
+	memmove(*text, results, done);
+	(*text)[done] = '\0';
+	*text_size = done;
+	return results;
+}
+
+
+/* Opens the config file, leaving what fstat() says about it in statbuf.
+   Returns the file descriptor, or -1 with *retval set to the error. */
+static int open_config_file(const pam_handle_t *handle, const char *path,
+                            struct stat *statbuf, int *retval)
+{
+	int fd;
+
+	if (stat(path, statbuf)) {
+		pam_syslog(handle, LOG_INFO,
+		           "No config file for module, ignoring.");
+		*retval = PAM_IGNORE;
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pam_syslog(handle, LOG_ERR,
+		           "Failed to open config file '%s': %s",
+		           path, strerror(errno));
+		*retval = PAM_PERM_DENIED;
+		return -1;
+	}
+
+	if (fstat(fd, statbuf) < 0) {
+		close(fd);
+		*retval = PAM_BUF_ERR;
+		return -1;
+	}
+	return fd;
+}
+
+
+static int parse_open_config_file(const pam_handle_t *handle,
+                                  const char *path, int fd,
+                                  const struct stat *statbuf,
+                                  struct config_entry **user_table)
+{
+	int usercount = 0;
+	unsigned int lineno = 0;
+	char *text, *line, *end;
+	size_t text_size;
+	struct config_entry *results;
+
+	*user_table = NULL;
+
+	results = read_config_file(fd, statbuf, &text, &text_size);
+	if (!results)
+		return PAM_BUF_ERR;
+
+	for (line = text; line < text + text_size; line = end + 1) {
+		int ret = PAM_SUCCESS;
+		char *user = NULL;
+		char *limit = NULL;
+		struct config_limits limits;
+		char original[MAX_LINE_LENGTH];
+
+		lineno++;
+
+		/* lines that are too long, or not terminated, go away, as
+		   do those with a NUL that would cut them short */
+		end = memchr(line, '\n', text + text_size - line);
+		if (!end || end - line >= MAX_LINE_LENGTH
+		    || memchr(line, '\0', end - line))
+			ret = PAM_BUF_ERR;
+		else {
+			*end = '\0';
+			ret = parse_config_line(line, end - line, &user,
+			                        &limit);
+		}
+		if (ret != PAM_SUCCESS) {
+			free_config_file(results);
+			pam_syslog(handle, LOG_ERR,
+			           "invalid config file '%s' at line %u",
+			           path, lineno);
+			return PAM_PERM_DENIED;
+		}
+		if (!user)
+			continue;
+
+		/* parsing takes the limit apart, so keep it as it was for
+		   the error; the line is known to fit */
+		strcpy(original, limit);
+		if (parse_config_limits(limit, &limits) < 0) {
+			pam_syslog(handle, LOG_ERR,
+			           "Invalid time limit '%s' for '%s' at line %u "
+			           "of config file '%s'",
+			           original, user, lineno, path);
+			free_config_file(results);
+			return PAM_PERM_DENIED;
+		}
+
+		results[usercount].user = user;
+		results[usercount].limits = limits;
+		usercount++;
+	}
+	results[usercount].user = NULL;
+
+	if (!usercount) {
+		free(results);
+		return PAM_IGNORE;
+	}
+	*user_table = results;
+	return PAM_SUCCESS;
+}
+
+
+int parse_config_file(const pam_handle_t *handle, const char *path,
+                      struct config_entry **user_table)
+{
+	struct stat statbuf;
+	int fd, retval;
+
+	*user_table = NULL;
+
+	fd = open_config_file(handle, path, &statbuf, &retval);
+	if (fd < 0)
+		return retval;
+
+	retval = parse_open_config_file(handle, path, fd, &statbuf,
+	                                user_table);
+	close(fd);
+	return retval;
+}
+
+
+static void config_key_from_stat(struct config_key *key,
+                                 const struct stat *statbuf)
+{
+	memset(key, '\0', sizeof(*key));
+	key->dev = statbuf->st_dev;
+	key->ino = statbuf->st_ino;
+	key->size = statbuf->st_size;
+	key->mtime = statbuf->st_mtim;
+	key->ctime = statbuf->st_ctim;
+}
+
+
+static bool config_key_equal(const struct config_key *a,
+                             const struct config_key *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+	       && a->mtime.tv_sec == b->mtime.tv_sec
+	       && a->mtime.tv_nsec == b->mtime.tv_nsec
+	       && a->ctime.tv_sec == b->ctime.tv_sec
+	       && a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+
+static int compare_named_entries(const void *a, const void *b)
+{
+	const struct config_entry *x = *(const struct config_entry **)a;
+	const struct config_entry *y = *(const struct config_entry **)b;
+	int retval = strcmp(x->user, y->user);
+
+	if (retval)
+		return retval;
+	return (x > y) - (x < y);
+}
+
+
+/* Builds the snapshot's index over its table, so that a lookup need only
+   bsearch() the names and go through the group and "*" entries.  Returns
+   0, or -1 on failure. */
+static int index_config_snapshot(struct config_snapshot *snapshot)
+{
+	const struct config_entry **named;
+	size_t count = 0, i, kept = 0;
+
+	while (snapshot->table[count].user)
+		count++;
+
+	snapshot->index = malloc((count ? count : 1)
+	                         * sizeof(*snapshot->index));
+	if (!snapshot->index)
+		return -1;
+
+	snapshot->fallbacks = 0;
+	for (i = 0; i < count; i++) {
+		const char *user = snapshot->table[i].user;
+
+		if (user[0] == CONFIG_GROUP_PREFIX
+		    || !strcmp(user, CONFIG_WILDCARD))
+			snapshot->index[snapshot->fallbacks++] =
+				&snapshot->table[i];
+	}
+
+	named = snapshot->index + snapshot->fallbacks;
+	for (i = 0; i < count; i++) {
+		const char *user = snapshot->table[i].user;
+
+		if (user[0] != CONFIG_GROUP_PREFIX
+		    && strcmp(user, CONFIG_WILDCARD))
+			named[kept++] = &snapshot->table[i];
+	}
+	qsort(named, kept, sizeof(*named), compare_named_entries);
+
+	/* the last match wins, so of each run of entries for the same name
+	   keep only the final one */
+	snapshot->named = 0;
+	for (i = 0; i < kept; i++) {
+		if (i + 1 < kept && !strcmp(named[i]->user, named[i+1]->user))
+			continue;
+		named[snapshot->named++] = named[i];
+	}
+	return 0;
+}
+
+
+const struct config_entry *
+find_config_entry(const pam_handle_t *handle,
+                  const struct config_snapshot *snapshot,
+                  struct config_user *user)
+{
+	const struct config_entry *const *named =
+		snapshot->index + snapshot->fallbacks;
+	const struct config_entry *found = NULL;
+	size_t low = 0, high = snapshot->named, i;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		int retval = strcmp(named[mid]->user, user->name);
+
+		if (!retval) {
+			found = named[mid];
+			break;
+		}
+		if (retval < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	/* any group or "*" entry after the user's own overrides it */
+	for (i = snapshot->fallbacks; i-- > 0; ) {
+		if (found && snapshot->index[i] < found)
+			break;
+		if (config_entry_matches(handle, snapshot->index[i]->user,
+		                         user))
+			return snapshot->index[i];
+	}
+	return found;
+}
+
+
+/* called with config_cache_lock held */
+static void unref_config_snapshot(struct config_snapshot *snapshot)
+{
+	if (--snapshot->refs > 0)
+		return;
+	free(snapshot->index);
+	free_config_file(snapshot->table);
+	free(snapshot->path);
+	free(snapshot);
+}
+
+
+/* called with config_cache_lock held; returns a new reference to the
+   current snapshot of path if it is still of the file described by key */
+static struct config_snapshot *find_config_snapshot(const char *path,
+                                                    const struct config_key *key)
+{
+	struct config_snapshot *snapshot;
+
+	for (snapshot = config_snapshots; snapshot; snapshot = snapshot->next) {
+		if (strcmp(snapshot->path, path))
+			continue;
+		if (!config_key_equal(&snapshot->key, key))
+			return NULL;
+		snapshot->refs++;
+		return snapshot;
+	}
+	return NULL;
+}
+
+
+/* called with config_cache_lock held; makes snapshot the current one for
+   its path, dropping the cache's reference to the one it replaces */
+static void install_config_snapshot(struct config_snapshot *snapshot)
+{
+	struct config_snapshot **p;
+
+	for (p = &config_snapshots; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->path, snapshot->path)) {
+			struct config_snapshot *old = *p;
+
+			*p = old->next;
+			unref_config_snapshot(old);
+			break;
+		}
+	}
+	snapshot->refs++;
+	snapshot->next = config_snapshots;
+	config_snapshots = snapshot;
+}
+
+
+int acquire_config_file(const pam_handle_t *handle, const char *path,
+                        struct config_snapshot **snapshot,
+                        const struct config_entry **user_table)
+{
+	struct config_snapshot *found, *fresh;
+	struct config_entry *table;
+	struct config_key key;
+	struct stat statbuf;
+	int fd, retval;
+
+	*snapshot = NULL;
+	*user_table = NULL;
+
+	/* the one stat() that a lookup takes when the file hasn't changed;
+	   anything else is up to parse_config_file() to report */
+	if (stat(path, &statbuf) == 0) {
+		config_key_from_stat(&key, &statbuf);
+		pthread_mutex_lock(&config_cache_lock);
+		found = find_config_snapshot(path, &key);
+		pthread_mutex_unlock(&config_cache_lock);
+		if (found) {
+			*snapshot = found;
+			*user_table = found->table;
+			return PAM_SUCCESS;
+		}
+	}
+
+	/* parsed without the lock held, so other threads' lookups don't
+	   wait on it; if two threads both parse a new version, the second
+	   to finish replaces the first's snapshot */
+	fd = open_config_file(handle, path, &statbuf, &retval);
+	if (fd < 0)
+		return retval;
+	retval = parse_open_config_file(handle, path, fd, &statbuf, &table);
+	close(fd);
+	if (retval != PAM_SUCCESS)
+		return retval;
+
+	fresh = calloc(1, sizeof(*fresh));
+	if (fresh)
+		fresh->path = strdup(path);
+	if (!fresh || !fresh->path) {
+		free(fresh);
+		free_config_file(table);
+		return PAM_BUF_ERR;
+	}
+	/* keyed on the file that was read, which may already be newer than
+	   what the stat() above saw */
+	config_key_from_stat(&fresh->key, &statbuf);
+	fresh->table = table;
+	fresh->refs = 1;
+	if (index_config_snapshot(fresh) < 0) {
+		free(fresh->path);
+		free(fresh);
+		free_config_file(table);
+		return PAM_BUF_ERR;
+	}
+
+	pthread_mutex_lock(&config_cache_lock);
+	install_config_snapshot(fresh);
+	pthread_mutex_unlock(&config_cache_lock);
+
+	*snapshot = fresh;
+	*user_table = table;
+	return PAM_SUCCESS;
+}
+
+
+void release_config_file(struct config_snapshot *snapshot)
+{
+	if (!snapshot)
+		return;
+	pthread_mutex_lock(&config_cache_lock);
+	unref_config_snapshot(snapshot);
+	pthread_mutex_unlock(&config_cache_lock);
+}
+
+
+/* when the module is unloaded, free the snapshots nobody is using; any
+   still in use are freed by their last release_config_file() */
+static void __attribute__((destructor)) free_config_snapshots(void)
+{
+	pthread_mutex_lock(&config_cache_lock);
+	while (config_snapshots) {
+		struct config_snapshot *snapshot = config_snapshots;
+
+		config_snapshots = snapshot->next;
+		unref_config_snapshot(snapshot);
+	}
+	pthread_mutex_unlock(&config_cache_lock);
+}
@@ -0,0 +1,114 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONFIG_FILE_H
+#define CONFIG_FILE_H
+
+#include <stdbool.h>
+
+#include <security/pam_modules.h>
+
+#include "time-util.h"
+
+/* The limits of an entry, each USEC_INFINITY if the entry doesn't set
+   it.  An entry's limit field is a list of timespans, each followed by
+   "/day", "/week" or "/<N>days"; a single timespan on its own is a daily
+   limit, as it always was. */
+struct config_limits {
+	/* the calendar day */
+	usec_t day;
+	/* the calendar week, from Monday */
+	usec_t week;
+	/* the last window_days days, today included */
+	usec_t window;
+	unsigned int window_days;
+};
+
+/* the longest rolling window, which is as much as the state keeps */
+#define CONFIG_MAX_WINDOW_DAYS 7
+
+struct config_entry {
+	char *user;
+	/* already parsed, so a login never has to */
+	struct config_limits limits;
+};
+
+/* Besides a username, an entry can name "@group" to match the members of
+   that group, or "*" to match everyone.  The last matching entry wins. */
+#define CONFIG_WILDCARD "*"
+#define CONFIG_GROUP_PREFIX '@'
+
+/* the user being looked up; the names of the user's groups are looked up
+   the first time a group entry needs them, and then kept */
+struct config_user {
+	const char *name;
+	bool groups_loaded;
+	char **groups;
+	int ngroups;
+};
+
+void init_config_user(struct config_user *user, const char *name);
+void free_config_user(struct config_user *user);
+
+/* returns the number of the user's groups, with *groups pointing to
+   their names, or -1 on failure */
+int config_user_groups(const pam_handle_t *handle, struct config_user *user,
+                       char * const **groups);
+
+bool config_entry_matches(const pam_handle_t *handle, const char *entry,
+                          struct config_user *user);
+
+/* Parses the line of the given length, which has had its newline replaced
+   by a NUL.  On success *user and *limit point into line, which is
+   modified in place, or are both NULL for a blank or comment-only line. */
+int parse_config_line(char *line, size_t length, char **user, char **limit);
+
+/* parses a limit field, which is modified in place; returns 0, or -1 if
+   it is invalid */
+int parse_config_limits(char *limit, struct config_limits *limits);
+
+/* whether the limits are all USEC_INFINITY, so time used can't matter */
+bool config_limits_unlimited(const struct config_limits *limits);
+
+/* on PAM_SUCCESS, user_table holds the entries in file order, terminated
+   by one with a NULL user; the table and the usernames it points to are
+   a single allocation */
+int parse_config_file(const pam_handle_t *handle, const char *path,
+                      struct config_entry **user_table);
+void free_config_file(struct config_entry *user_table);
+
+struct config_snapshot;
+
+/* Like parse_config_file(), but the table is shared with the rest of the
+   process, and the file is only parsed again once its inode, size or
+   timestamps change, so a repeated lookup costs a single stat().  Safe to
+   call from any number of threads at once.  The table stays valid until
+   the snapshot is passed to release_config_file(). */
+int acquire_config_file(const pam_handle_t *handle, const char *path,
+                        struct config_snapshot **snapshot,
+                        const struct config_entry **user_table);
+void release_config_file(struct config_snapshot *snapshot);
+
+/* the entry that decides the user's limits, which is the last to match,
+   or NULL if none does; it is the snapshot's, like the table */
+const struct config_entry *
+find_config_entry(const pam_handle_t *handle,
+                  const struct config_snapshot *snapshot,
+                  struct config_user *user);
+
+#endif
@@ -0,0 +1,582 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/file.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <security/pam_ext.h>
+
+#include "live-sessions.h"
+
+/*
+ * The session list is little-endian, like the state file.  It starts with
+ * "Sessions", a uint32_t version, 4 bytes of padding and the NUL-padded
+ * boot ID of the boot that wrote it, and is followed by fixed-size
+ * entries.  An entry is the NUL-padded username, the uint32_t PID of the
+ * process that opened the session, 4 bytes of padding, the uint64_t start
+ * time of that process in clock ticks since boot (0 if unknown), the
+ * int64_t time_t the session started at and the uint64_t usec_t since the
+ * epoch up to which its time has been claimed.  An entry with an empty
+ * username is free.
+ *
+ * Opening, closing and checkpointing sessions take an exclusive lock,
+ * which a checkpoint holds until the time it claims is in the state, so
+ * no close can claim the same time meanwhile.  An account check only
+ * reads the list, under a shared lock that it holds while it reads the
+ * state as well, so that it sees any checkpoint whole or not at all.  The list is small, so it is read
+ * whole each time.
+ */
+
+#define SESSIONS_SUFFIX ".sessions"
+#define SESSIONS_STATEDIR_FILE "sessions"
+#define SESSIONS_MAGIC "Sessions"
+#define SESSIONS_MAGIC_LEN 8
+#define SESSIONS_VERSION 1
+#define SESSIONS_BOOT_ID 16
+#define BOOT_ID_SIZE 48
+#define SESSIONS_HEADER_SIZE (SESSIONS_BOOT_ID + BOOT_ID_SIZE)
+
+#define SESSION_PID (NAME_MAX+1)
+#define SESSION_PID_START (NAME_MAX+1 + 8)
+#define SESSION_START (NAME_MAX+1 + 16)
+#define SESSION_MARK (NAME_MAX+1 + 24)
+#define SESSION_SIZE (NAME_MAX+1 + 32)
+#define SESSION_OFFSET(i) (SESSIONS_HEADER_SIZE + (off_t)(i) * SESSION_SIZE)
+
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+
+struct live_session {
+	char name[NAME_MAX+1];
+	uint32_t pid;
+	uint64_t pid_start;
+	int64_t start;
+	usec_t mark;
+};
+
+struct session_list {
+	int fd;
+	/* the entries, without the header */
+	char *entries;
+	size_t count;
+};
+
+
+static void decode_session(const char *buf, struct live_session *session)
+{
+	uint32_t pid;
+	uint64_t pid_start, start, mark;
+
+	memcpy(session->name, buf, NAME_MAX+1);
+	session->name[NAME_MAX] = '\0';
+	memcpy(&pid, buf + SESSION_PID, sizeof(pid));
+	memcpy(&pid_start, buf + SESSION_PID_START, sizeof(pid_start));
+	memcpy(&start, buf + SESSION_START, sizeof(start));
+	memcpy(&mark, buf + SESSION_MARK, sizeof(mark));
+	session->pid = le32toh(pid);
+	session->pid_start = le64toh(pid_start);
+	session->start = (int64_t)le64toh(start);
+	session->mark = le64toh(mark);
+}
+
+
+static void encode_session(char *buf, const struct live_session *session)
+{
+	uint32_t pid = htole32(session->pid);
+	uint64_t pid_start = htole64(session->pid_start);
+	uint64_t start = htole64((uint64_t)session->start);
+	uint64_t mark = htole64(session->mark);
+
+	memset(buf, '\0', SESSION_SIZE);
+	memcpy(buf, session->name, strnlen(session->name, NAME_MAX));
+	memcpy(buf + SESSION_PID, &pid, sizeof(pid));
+	memcpy(buf + SESSION_PID_START, &pid_start, sizeof(pid_start));
+	memcpy(buf + SESSION_START, &start, sizeof(start));
+	memcpy(buf + SESSION_MARK, &mark, sizeof(mark));
+}
+
+
+/* the NUL-padded ID of this boot, or all NULs if it can't be read, in
+   which case sessions from before a reboot are only caught by their
+   processes being gone */
+static void current_boot_id(char *boot_id)
+{
+	ssize_t bytes;
+	int fd;
+
+	memset(boot_id, '\0', BOOT_ID_SIZE);
+	fd = open(BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	bytes = read(fd, boot_id, BOOT_ID_SIZE - 1);
+	close(fd);
+	if (bytes <= 0) {
+		memset(boot_id, '\0', BOOT_ID_SIZE);
+		return;
+	}
+	boot_id[strcspn(boot_id, "\n")] = '\0';
+}
+
+
+/* the start time of the process in clock ticks since boot, which tells
+   it apart from a later process given the same PID; or 0 if unknown */
+static uint64_t process_start(pid_t pid)
+{
+	unsigned long long start;
+	char path[64], buf[1024], *p;
+	ssize_t bytes;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	bytes = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (bytes <= 0)
+		return 0;
+	buf[bytes] = '\0';
+
+	/* the command name can hold anything, so start after the last
+	   parenthesis; the start time is the 22nd field */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u"
+	                 " %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+	                 &start) != 1)
+		return 0;
+	return start;
+}
+
+
+static bool session_owner_alive(const struct live_session *session)
+{
+	uint64_t start;
+
+	if (session->pid == 0
+	    || (kill((pid_t)session->pid, 0) < 0 && errno == ESRCH))
+		return false;
+
+	start = process_start((pid_t)session->pid);
+	return !session->pid_start || !start || start == session->pid_start;
+}
+
+
+static char *session_list_path(const struct state_options *opts)
+{
+	char *path;
+	int retval;
+
+	if (opts->statedir)
+		retval = asprintf(&path, "%s/" SESSIONS_STATEDIR_FILE,
+		                  opts->statedir);
+	else
+		retval = asprintf(&path, "%s" SESSIONS_SUFFIX,
+		                  opts->statepath);
+	return retval < 0 ? NULL : path;
+}
+
+
+static int write_session_header(const pam_handle_t *handle, int fd,
+                                const char *boot_id)
+{
+	char header[SESSIONS_HEADER_SIZE];
+	uint32_t version = htole32(SESSIONS_VERSION);
+
+	memset(header, '\0', sizeof(header));
+	memcpy(header, SESSIONS_MAGIC, SESSIONS_MAGIC_LEN);
+	memcpy(header + SESSIONS_MAGIC_LEN, &version, sizeof(version));
+	memcpy(header + SESSIONS_BOOT_ID, boot_id, BOOT_ID_SIZE);
+
+	if (pwrite(fd, header, sizeof(header), 0) != sizeof(header)
+	    || ftruncate(fd, sizeof(header)) < 0)
+	{
+		pam_syslog(handle, LOG_ERR, "Could not write session list: %s",
+		           strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+static bool header_is_current(const char *header, const char *boot_id)
+{
+	uint32_t version;
+
+	memcpy(&version, header + SESSIONS_MAGIC_LEN, sizeof(version));
+	return !memcmp(header, SESSIONS_MAGIC, SESSIONS_MAGIC_LEN)
+	       && le32toh(version) == SESSIONS_VERSION
+	       && !memcmp(header + SESSIONS_BOOT_ID, boot_id, BOOT_ID_SIZE);
+}
+
+
+/* Open, lock and read the session list.  A writer starts it afresh if it
+   is new, unreadable or from an earlier boot; a reader takes a shared lock
+   and sees such a list as empty.  Returns 1 if the list was opened, 0 if
+   there is none (only when reading), or -1 on failure. */
+static int open_session_list(const pam_handle_t *handle,
+                             const struct state_options *opts,
+                             struct session_list *list, bool exclusive)
+{
+	char header[SESSIONS_HEADER_SIZE], boot_id[BOOT_ID_SIZE];
+	struct stat statbuf;
+	size_t len, done;
+	char *path;
+
+	list->entries = NULL;
+	list->count = 0;
+
+	path = session_list_path(opts);
+	if (!path)
+		return -1;
+	for (;;) {
+		if (exclusive)
+			list->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+			                0600);
+		else
+			list->fd = open(path, O_RDONLY | O_CLOEXEC);
+		/* the directory is created along with its first file */
+		if (list->fd < 0 && errno == ENOENT && exclusive
+		    && opts->statedir
+		    && (mkdir(opts->statedir, 0700) == 0 || errno == EEXIST))
+			continue;
+		break;
+	}
+	free(path);
+	if (list->fd < 0 && errno == ENOENT && !exclusive)
+		return 0;
+	if (list->fd < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not open session list: %s",
+		           strerror(errno));
+		return -1;
+	}
+
+	if (flock(list->fd, exclusive ? LOCK_EX : LOCK_SH) < 0
+	    || fstat(list->fd, &statbuf) < 0)
+	{
+		pam_syslog(handle, LOG_ERR, "Could not lock session list: %s",
+		           strerror(errno));
+		close(list->fd);
+		return -1;
+	}
+
+	current_boot_id(boot_id);
+	if (statbuf.st_size < SESSIONS_HEADER_SIZE
+	    || pread(list->fd, header, sizeof(header), 0) != sizeof(header)
+	    || !header_is_current(header, boot_id))
+	{
+		if (exclusive
+		    && write_session_header(handle, list->fd, boot_id) < 0) {
+			close(list->fd);
+			return -1;
+		}
+		return 1;
+	}
+
+	/* a crash mid-write may have left a partial entry at the end */
+	list->count = (statbuf.st_size - SESSIONS_HEADER_SIZE) / SESSION_SIZE;
+	if (!list->count)
+		return 1;
+
+	len = list->count * SESSION_SIZE;
+	list->entries = malloc(len);
+	if (!list->entries) {
+		close(list->fd);
+		return -1;
+	}
+	for (done = 0; done < len; ) {
+		ssize_t bytes = pread(list->fd, list->entries + done,
+		                      len - done, SESSIONS_HEADER_SIZE + done);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0) {
+			pam_syslog(handle, LOG_ERR,
+			           "Could not read session list: %s",
+			           bytes < 0 ? strerror(errno) : "file truncated");
+			free(list->entries);
+			close(list->fd);
+			return -1;
+		}
+		done += bytes;
+	}
+	return 1;
+}
+
+
+static void close_session_list(struct session_list *list)
+{
+	free(list->entries);
+	close(list->fd);
+}
+
+
+/* Write back entries first to last, after dropping the free entries at
+   the end of the list.  Returns 0, or -1 on failure. */
+static int write_sessions(const pam_handle_t *handle,
+                          struct session_list *list, size_t first,
+                          size_t last)
+{
+	while (list->count > 0
+	       && !list->entries[(list->count - 1) * SESSION_SIZE])
+		list->count--;
+	last = MIN(last, list->count);
+
+	if ((first < last
+	     && pwrite(list->fd, list->entries + first * SESSION_SIZE,
+	               (last - first) * SESSION_SIZE, SESSION_OFFSET(first))
+	        != (ssize_t)((last - first) * SESSION_SIZE))
+	    || ftruncate(list->fd, SESSION_OFFSET(list->count)) < 0)
+	{
+		pam_syslog(handle, LOG_ERR, "Could not write session list: %s",
+		           strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+int begin_live_session(const pam_handle_t *handle,
+                       const struct state_options *opts,
+                       const char *username, time_t start)
+{
+	struct session_list list;
+	struct live_session session;
+	size_t i;
+	int retval = PAM_SUCCESS;
+
+	if (strlen(username) > NAME_MAX) {
+		pam_syslog(handle, LOG_ERR, "Username too long for session list");
+		return PAM_SYSTEM_ERR;
+	}
+
+	if (open_session_list(handle, opts, &list, true) < 0)
+		return PAM_SYSTEM_ERR;
+
+	for (i = 0; i < list.count; i++) {
+		if (!list.entries[i * SESSION_SIZE])
+			break;
+	}
+	if (i == list.count) {
+		char *entries = realloc(list.entries,
+		                        (list.count + 1) * SESSION_SIZE);
+
+		if (!entries) {
+			close_session_list(&list);
+			return PAM_BUF_ERR;
+		}
+		list.entries = entries;
+		list.count++;
+	}
+
+	memset(&session, '\0', sizeof(session));
+	strcpy(session.name, username);
+	session.pid = getpid();
+	session.pid_start = process_start(getpid());
+	session.start = start;
+	session.mark = (usec_t)start * USEC_PER_SEC;
+	encode_session(list.entries + i * SESSION_SIZE, &session);
+
+	if (write_sessions(handle, &list, i, i + 1) < 0)
+		retval = PAM_SYSTEM_ERR;
+	close_session_list(&list);
+	return retval;
+}
+
+
+int end_live_session(const pam_handle_t *handle,
+                     const struct state_options *opts,
+                     const char *username, time_t start, time_t now,
+                     usec_t *unclaimed)
+{
+	struct session_list list;
+	struct live_session session;
+	usec_t end = (usec_t)now * USEC_PER_SEC;
+	uint32_t pid = getpid();
+	int retval = PAM_IGNORE;
+	size_t i;
+
+	*unclaimed = 0;
+
+	if (open_session_list(handle, opts, &list, true) < 0)
+		return PAM_SYSTEM_ERR;
+
+	for (i = 0; i < list.count; i++) {
+		char *entry = list.entries + i * SESSION_SIZE;
+
+		if (!entry[0])
+			continue;
+		decode_session(entry, &session);
+		if (session.pid != pid || session.start != start
+		    || strncmp(session.name, username, NAME_MAX+1))
+			continue;
+
+		if (end > session.mark)
+			*unclaimed = end - session.mark;
+		memset(entry, '\0', SESSION_SIZE);
+		retval = write_sessions(handle, &list, i, i + 1) < 0
+		         ? PAM_SYSTEM_ERR : PAM_SUCCESS;
+		break;
+	}
+	close_session_list(&list);
+	return retval;
+}
+
+
+static void free_claims(struct used_time_update *claims, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		free((char *)claims[i].username);
+	free(claims);
+}
+
+
+/* adds the time to the user's claim, making one if there is none yet */
+static int add_claim(struct used_time_update **claims, size_t *count,
+                     const char *username, usec_t elapsed)
+{
+	struct used_time_update *grown;
+	size_t i;
+
+	for (i = 0; i < *count; i++) {
+		if (!strcmp((*claims)[i].username, username)) {
+			(*claims)[i].elapsed = usec_add((*claims)[i].elapsed,
+			                                elapsed);
+			return 0;
+		}
+	}
+
+	grown = realloc(*claims, (*count + 1) * sizeof(**claims));
+	if (!grown)
+		return -1;
+	*claims = grown;
+	grown[*count].username = strdup(username);
+	if (!grown[*count].username)
+		return -1;
+	grown[*count].elapsed = elapsed;
+	(*count)++;
+	return 0;
+}
+
+
+int claim_live_sessions(const pam_handle_t *handle,
+                        const struct state_options *opts, time_t now,
+                        add_claims_fn add, void *data,
+                        unsigned int *live, unsigned int *dropped)
+{
+	struct session_list list;
+	struct live_session session;
+	struct used_time_update *claims = NULL;
+	usec_t end = (usec_t)now * USEC_PER_SEC;
+	int retval = PAM_SUCCESS;
+	size_t i, count = 0;
+
+	*live = *dropped = 0;
+
+	if (open_session_list(handle, opts, &list, true) < 0)
+		return PAM_SYSTEM_ERR;
+
+	for (i = 0; i < list.count && retval == PAM_SUCCESS; i++) {
+		char *entry = list.entries + i * SESSION_SIZE;
+
+		if (!entry[0])
+			continue;
+		decode_session(entry, &session);
+
+		/* when a session's process went away unannounced isn't
+		   known, so nothing after its last checkpoint is counted */
+		if (!session_owner_alive(&session)) {
+			memset(entry, '\0', SESSION_SIZE);
+			(*dropped)++;
+			continue;
+		}
+		(*live)++;
+		if (end <= session.mark)
+			continue;
+		if (add_claim(&claims, &count, session.name,
+		              end - session.mark) < 0)
+		{
+			retval = PAM_BUF_ERR;
+			break;
+		}
+		session.mark = end;
+		encode_session(entry, &session);
+	}
+
+	/* The time goes into the state before the new marks are written,
+	   and with the list locked throughout, a closing session can't
+	   claim it in between.  Should the marks not be written, the next
+	   checkpoint or close claims the time again. */
+	if (retval == PAM_SUCCESS && count > 0)
+		retval = add(claims, count, data);
+	if (retval == PAM_SUCCESS
+	    && write_sessions(handle, &list, 0, list.count) < 0)
+		retval = PAM_SYSTEM_ERR;
+	close_session_list(&list);
+	free_claims(claims, count);
+	return retval;
+}
+
+
+int live_session_time(const pam_handle_t *handle,
+                      const struct state_options *opts,
+                      const char *username, time_t now,
+                      read_state_fn read, void *data, usec_t *in_flight)
+{
+	struct session_list list;
+	struct live_session session;
+	usec_t end = (usec_t)now * USEC_PER_SEC;
+	size_t i;
+	int opened, retval;
+
+	*in_flight = 0;
+
+	opened = open_session_list(handle, opts, &list, false);
+	retval = read(data);
+	if (opened <= 0)
+		return retval;
+
+	for (i = 0; i < list.count && retval == PAM_SUCCESS; i++) {
+		const char *entry = list.entries + i * SESSION_SIZE;
+
+		if (!entry[0] || strncmp(entry, username, NAME_MAX+1))
+			continue;
+		decode_session(entry, &session);
+		/* left for the next checkpoint to drop */
+		if (!session_owner_alive(&session) || end <= session.mark)
+			continue;
+		*in_flight = usec_add(*in_flight, end - session.mark);
+	}
+	close_session_list(&list);
+	return retval;
+}
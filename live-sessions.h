@@ -0,0 +1,78 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIVE_SESSIONS_H
+#define LIVE_SESSIONS_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include <security/pam_modules.h>
+
+#include "state-file.h"
+
+/* Sessions opened with the checkpoint option are listed in a file next to
+   the state file, or in the state directory, so that a periodic
+   checkpoint can account for the time they have run so far.  Each session
+   keeps the point up to which its time has been claimed; the checkpoint
+   claims the time since then, and the session's close only the rest. */
+
+/* list the session of username that this process began at start */
+int begin_live_session(const pam_handle_t *handle,
+                       const struct state_options *opts,
+                       const char *username, time_t start);
+
+/* Take the session out of the list, setting unclaimed to the time it has
+   run since it was last checkpointed.  Returns PAM_SUCCESS, PAM_IGNORE if
+   it isn't listed, or an error. */
+int end_live_session(const pam_handle_t *handle,
+                     const struct state_options *opts,
+                     const char *username, time_t start, time_t now,
+                     usec_t *unclaimed);
+
+/* reads the time the state has; returns PAM_SUCCESS or an error */
+typedef int (*read_state_fn)(void *data);
+
+/* Set in_flight to the time that username's listed sessions have run
+   since they were last checkpointed, which the state doesn't have yet,
+   calling read with the list locked, so that no checkpoint can move time
+   from the one to the other in between.  If the list can't be read,
+   in_flight is 0.  Returns what read does. */
+int live_session_time(const pam_handle_t *handle,
+                      const struct state_options *opts,
+                      const char *username, time_t now,
+                      read_state_fn read, void *data, usec_t *in_flight);
+
+/* called with the time claimed, one update per user; returns PAM_SUCCESS
+   once all of it has been added to the state, or an error if some of it
+   may not have been */
+typedef int (*add_claims_fn)(struct used_time_update *claims, size_t count,
+                             void *data);
+
+/* Claim the time every listed session has run since it was last claimed,
+   and drop the sessions of processes that have gone away without closing
+   them, or that are from before the last boot.  The claims are passed to
+   add while the list is still locked, and the sessions' marks only moved
+   on once it succeeds, so that a failure can count time twice but never
+   lose it. */
+int claim_live_sessions(const pam_handle_t *handle,
+                        const struct state_options *opts, time_t now,
+                        add_claims_fn add, void *data,
+                        unsigned int *live, unsigned int *dropped);
+
+#endif
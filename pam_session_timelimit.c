@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,12 +36,21 @@
 #include <security/pam_modules.h>
 #include <security/pam_ext.h>
 
+#include "config-cache.h"
+#include "config-file.h"
+#include "live-sessions.h"
+#include "state-daemon.h"
+#include "state-file.h"
 #include "time-util.h"
+#include "timing.h"
 
 #define UNUSED __attribute__((unused))
 
 #define DEFAULT_CONFIG_PATH CONFIGDIR "/time_limits.conf"
-#define DEFAULT_STATE_PATH LOCALSTATEDIR "/lib/session_times"
+
+/* the remaining time as a usec_t, alongside the string form that
+   pam_systemd reads, so that later stages don't have to parse it back */
+#define REMAINING_USEC_DATA "timelimit.remaining_usec"
 
 
 static void cleanup(pam_handle_t *handle UNUSED, void *data, int err UNUSED)
@@ -51,371 +61,300 @@ static void cleanup(pam_handle_t *handle UNUSED, void *data, int err UNUSED)
 }
 
 
-/* returns fd, or -1 on failure */
-static int open_state_path (const pam_handle_t *handle, const char *statepath)
+/* returns true if arg is one of the state file options shared by the
+   module types */
+static bool parse_state_argument(const char *arg, struct state_options *opts)
 {
-	int fd, retval;
-	ssize_t bytes;
-	char buf[12];
-
-	if (geteuid() == 0) {
-		/* must set the real uid to 0 so the helper will not error
-		   out if pam is called from setuid binary (su, sudo...) */
-		if (setuid(0) == -1) {
-			pam_syslog(handle, LOG_ERR,
-			           "Could not gain root privilege: %s",
-			           strerror(errno));
-			return -1;
-		}
-	}
-
-	fd = open(statepath, O_RDWR);
-
-	if (fd < 0 && errno == ENOENT) {
-		fd = open(statepath, O_RDWR|O_CREAT, 0600);
-		if (fd < 0) {
-			pam_syslog(handle, LOG_ERR,
-			           "Could not create statefile: %s",
-			           strerror(errno));
-			return -1;
-		}
-
-		retval = flock(fd, LOCK_EX);
-		if (retval < 0) {
-			pam_syslog(handle, LOG_ERR,
-			           "Could not lock statefile: %s",
-			           strerror(errno));
-			close(fd);
-			return -1;
-		}
-
-		strncpy(buf, "Format: ", 9);
-		/* This file format is not portable between systems of
-		   different endianness */
-		*((uint32_t *)(buf+8)) = 1;
-		bytes = write(fd, buf, 12);
-		if (bytes != 12) {
-			pam_syslog(handle, LOG_ERR,
-			           "Could not initialize statefile: %s",
-			           strerror(errno));
-			close(fd);
-			return -1;
-		}
-		return fd;
-	}
-	if (fd < 0) {
-		pam_syslog(handle, LOG_ERR, "Could not open statefile: %s",
-		           strerror(errno));
-		return -1;
-	}
-
-	retval = flock(fd, LOCK_EX);
-	if (retval < 0) {
-		pam_syslog(handle, LOG_ERR,
-		           "Could not lock statefile: %s",
-		           strerror(errno));
-		close(fd);
-		return -1;
-	}
-
-	bytes = read(fd, buf, 12);
-
-	if (bytes != 12) {
-		pam_syslog(handle, LOG_ERR, "Could not read from statefile: %s",
-		           strerror(errno));
-		close(fd);
-		return -1;
-	}
-
-	if (strncmp(buf, "Format: ", 8) != 0
-	    || *((uint32_t *)(buf+8)) != 1)
-	{
-		pam_syslog(handle, LOG_ERR, "Unknown statefile format");
-		close(fd);
-		return -1;
-	}
-
-	return fd;
-}
-
-
-static time_t time_today(void) {
-	struct tm current_tm;
-	time_t current_time = time(NULL);
-
-	if (localtime_r(&current_time, &current_tm) == NULL) {
-		return -1;
-	}
-	// get the time at 00:00:00 today
-	current_tm.tm_sec = current_tm.tm_min = current_tm.tm_hour = 0;
-	// we query the local time, but we write in GMT so that the session
-	// limits don't get reset if the system timezone changes
-	return timegm(&current_tm);
+	if (strncmp(arg, "statepath=", strlen("statepath=")) == 0)
+		opts->statepath = arg + strlen("statepath=");
+	else if (strncmp(arg, "statedir=", strlen("statedir=")) == 0)
+		opts->statedir = arg + strlen("statedir=");
+	else if (strcmp(arg, "statemmap") == 0)
+		opts->use_mmap = true;
+	else if (strcmp(arg, "statejournal") == 0)
+		opts->use_journal = true;
+	else if (strcmp(arg, "sync=none") == 0)
+		opts->sync = STATE_SYNC_NONE;
+	else if (strcmp(arg, "sync=always") == 0)
+		opts->sync = STATE_SYNC_ALWAYS;
+	else if (strcmp(arg, "sync=batched") == 0)
+		opts->sync = STATE_SYNC_BATCHED;
+	else if (strcmp(arg, "checkpoint") == 0)
+		opts->checkpoint = true;
+	else if (strcmp(arg, "daemon") == 0)
+		opts->daemon_socket = DEFAULT_DAEMON_SOCKET;
+	else if (strncmp(arg, "daemon=", strlen("daemon=")) == 0)
+		opts->daemon_socket = arg + strlen("daemon=");
+	else
+		return false;
+	return true;
 }
 
 
-static int get_used_time_for_user(const pam_handle_t *handle,
-                                  const char *statepath,
-                                  const char *username,
-                                  usec_t *used_time)
+/* Through the daemon if there is one, else from the state file.  The
+   daemon only keeps today's time, so with limits over days before that
+   the rest comes from the file, which the daemon writes back to when the
+   day changes. */
+static int get_usage(pam_handle_t *handle, const struct state_options *opts,
+                     const char *username, time_t today, bool only_today,
+                     struct usage *usage)
 {
-	char buf[NAME_MAX+1 + sizeof(time_t) + sizeof(usec_t)];
-	ssize_t read_bytes, buf_bytes = 0;
-	int retval = PAM_SUCCESS;
-	int state_file = open_state_path(handle, statepath);
+	usec_t start = 0, used_time;
+	int retval;
 
-	*used_time = 0;
+	if (!opts->daemon_socket)
+		return get_usage_for_user(handle, opts, username, today,
+		                          usage);
 
-	if (state_file < 0)
-		return PAM_SYSTEM_ERR;
+	if (opts->timing)
+		start = timing_now();
+	retval = daemon_get_used_time(handle, opts->daemon_socket, username,
+	                              today, &used_time);
+	if (opts->timing)
+		opts->timing->lookup += timing_now() - start;
 
-	do {
-		if (buf_bytes == sizeof(buf)) {
-			// found the record for this user
-			if (!strncmp(username, buf, NAME_MAX+1)) {
-				time_t last_seen;
-				memcpy(&last_seen, buf + NAME_MAX+1,
-				       sizeof(time_t));
-				/* record is for a different day, so doesn't
-				   count against us */
-				if (last_seen < time_today())
-					break;
-				memcpy(used_time,
-				       buf + NAME_MAX+1 + sizeof(time_t),
-				       sizeof(usec_t));
-				break;
-			}
-			buf_bytes = 0;
-		}
-		read_bytes = read(state_file, buf, sizeof(buf) - buf_bytes);
-		if (read_bytes < 0) {
-			if (errno == EINTR)
-				continue;
-			retval = PAM_SYSTEM_ERR;
-		}
-		buf_bytes += read_bytes;
-	} while (read_bytes != 0);
-
-	close(state_file);
+	/* nothing is changed by asking, so it's always safe to ask the
+	   file instead */
+	if (retval != PAM_SUCCESS)
+		return get_usage_for_user(handle, opts, username, today,
+		                          usage);
 
+	if (only_today)
+		memset(usage, '\0', sizeof(*usage));
+	else
+		retval = get_usage_for_user(handle, opts, username, today,
+		                            usage);
+	usage->days[0] = used_time;
 	return retval;
 }
 
 
-static int set_used_time_for_user(const pam_handle_t *handle,
-                                  const char *statepath,
-                                  const char *username,
-                                  usec_t used_time)
+static int add_used_time(pam_handle_t *handle,
+                         const struct state_options *opts,
+                         const char *username, time_t today,
+                         usec_t elapsed_time)
 {
-	char buf[NAME_MAX+1 + sizeof(time_t) + sizeof(usec_t)];
-	ssize_t read_bytes, buf_bytes = 0;
-	int state_file = open_state_path(handle, statepath);
+	usec_t start = 0;
+	int retval;
 
-	if (state_file < 0)
-		return PAM_SYSTEM_ERR;
+	if (!opts->daemon_socket)
+		return add_used_time_for_user(handle, opts, username, today,
+		                              elapsed_time);
+
+	if (opts->timing)
+		start = timing_now();
+	retval = daemon_add_used_time(handle, opts->daemon_socket, username,
+	                              today, elapsed_time);
+	if (opts->timing)
+		opts->timing->writeback += timing_now() - start;
+
+	/* but only add to the file if the daemon can't have done so */
+	if (retval == PAM_AUTHINFO_UNAVAIL)
+		retval = add_used_time_for_user(handle, opts, username, today,
+		                                elapsed_time);
+	return retval;
+}
 
-	do {
-		if (buf_bytes == sizeof(buf)) {
-			// found the record for this user
-			if (!strncmp(username, buf, NAME_MAX+1)) {
-				// found our record, so rewind to the start
-				lseek(state_file, -sizeof(buf), SEEK_CUR);
-				break;
-			}
-			buf_bytes = 0;
-		}
-		read_bytes = read(state_file, buf, sizeof(buf) - buf_bytes);
-		if (read_bytes < 0) {
-			if (errno == EINTR)
-				continue;
-			close(state_file);
-			return PAM_SYSTEM_ERR;
-		}
-		buf_bytes += read_bytes;
-	} while (read_bytes != 0);
 
-	memset(buf, '\0', sizeof(buf));
+/* appends the limit over period to the description in buf, if set */
+static void describe_limit(char *buf, size_t size, usec_t limit,
+                           const char *period)
+{
+	char timespan[FORMAT_TIMESPAN_MAX];
+	size_t len = strlen(buf);
 
-	strncpy(buf, username, NAME_MAX+1);
-	*((time_t *)(buf + NAME_MAX + 1)) = time_today();
-	*((usec_t *)(buf + NAME_MAX + 1 + sizeof(time_t))) = used_time;
+	if (limit == USEC_INFINITY || len >= size)
+		return;
+	snprintf(buf + len, size - len, "%s%s/%s", len ? " " : "",
+	         format_timespan(timespan, sizeof(timespan), limit,
+	                         USEC_PER_SEC), period);
+}
 
-	buf_bytes = write(state_file, buf, sizeof(buf));
 
-	close(state_file);
+static void log_limit(pam_handle_t *handle, const char *username,
+                      const struct config_limits *limits)
+{
+	char buf[3 * (FORMAT_TIMESPAN_MAX + sizeof("/7days"))] = "";
+	char window[sizeof("7days")];
 
-	if (buf_bytes != sizeof(buf)) {
-		pam_syslog(handle, LOG_ERR,
-		           "Could not update statefile: %s",
-		           strerror(errno));
-		return PAM_SYSTEM_ERR;
+	/* a daily limit on its own is logged as it always was */
+	if (limits->week == USEC_INFINITY && limits->window == USEC_INFINITY) {
+		pam_syslog(handle, LOG_INFO,
+		           "Limiting user login time for '%s' to '%s'",
+		           username,
+		           format_timespan(buf, FORMAT_TIMESPAN_MAX,
+		                           limits->day, USEC_PER_SEC));
+		return;
 	}
 
-	return PAM_SUCCESS;
+	snprintf(window, sizeof(window), "%udays", limits->window_days);
+	describe_limit(buf, sizeof(buf), limits->day, "day");
+	describe_limit(buf, sizeof(buf), limits->week, "week");
+	describe_limit(buf, sizeof(buf), limits->window, window);
+	pam_syslog(handle, LOG_INFO,
+	           "Limiting user login time for '%s' to '%s'", username, buf);
 }
 
 
-static void free_config_file(char **user_table)
+/* returns PAM_SUCCESS with the user's limits, or PAM_IGNORE if the user is
+   not limited */
+static int find_limit(pam_handle_t *handle, const char *path,
+                      struct config_user *user,
+                      struct config_limits *limits)
 {
-	int i;
+	const struct config_entry *user_table, *entry;
+	struct config_snapshot *snapshot;
+	int retval;
 
-	for (i = 0; user_table[i]; i += 2)
-	{
-		free(user_table[i]);
-		free(user_table[i+1]);
+	retval = acquire_config_file(handle, path, &snapshot, &user_table);
+	if (retval != PAM_SUCCESS)
+		return retval;
+
+	retval = PAM_IGNORE;
+	entry = find_config_entry(handle, snapshot, user);
+	if (entry) {
+		*limits = entry->limits;
+		log_limit(handle, user->name, limits);
+		retval = PAM_SUCCESS;
 	}
-	free(user_table);
-}
 
+	release_config_file(snapshot);
 
-static int parse_config_line(char *line, char **user, char **limit)
-{
-	size_t length;
-	int i;
-	char *comment;
+	return retval;
+}
 
-	*user = NULL;
-	*limit = NULL;
 
-	length = strlen(line);
-	/* line >= 1024 chars, go away */
-	if (line[length-1] != '\n')
-		return PAM_BUF_ERR;
+/* like find_limit(), but answered from a compiled copy of the config file
+   which is only rebuilt when the config file changes */
+static int find_cached_limit(pam_handle_t *handle, const char *path,
+                             const char *cachepath,
+                             struct config_user *user,
+                             struct config_limits *limits)
+{
+	struct config_cache *cache = NULL;
+	struct stat statbuf;
+	char *default_cachepath = NULL;
+	const struct config_entry *user_table;
+	struct config_snapshot *snapshot;
+	int retval;
 
-	/* remove trailing newline */
-	line[--length] = '\0';
+	if (stat(path, &statbuf))
+		return find_limit(handle, path, user, limits);
 
-	/* strip comments */
-	comment = strchr(line, '#');
-	if (comment) {
-		*comment = '\0';
-		length = comment - line;
+	if (!cachepath) {
+		default_cachepath = malloc(strlen(path) + sizeof(".cache"));
+		if (!default_cachepath)
+			return PAM_BUF_ERR;
+		sprintf(default_cachepath, "%s.cache", path);
+		cachepath = default_cachepath;
 	}
 
-	/* eat trailing whitespace */
-	while (isspace(line[length-1]))
-		line[--length] = '\0';
-
-	/* comment-only or empty line */
-	if (!length)
-		return PAM_SUCCESS;
-
-	/* find the end of the username */
-	for (i = 0; i <= length; i++) {
-		if (isspace(line[i]))
-			break;
+	cache = load_config_cache(handle, cachepath, &statbuf);
+	if (!cache) {
+		retval = acquire_config_file(handle, path, &snapshot,
+		                             &user_table);
+		if (retval != PAM_SUCCESS) {
+			free(default_cachepath);
+			return retval;
+		}
+		cache = build_config_cache(handle, cachepath, &statbuf,
+		                           user_table);
+		release_config_file(snapshot);
 	}
+	free(default_cachepath);
 
-	/* no leading whitespace allowed */
-	if (!i)
-		return PAM_SYSTEM_ERR;
-
-	*user = malloc(i+1);
-	if (!*user)
+	if (!cache)
 		return PAM_BUF_ERR;
 
-	if (!strncpy(*user, line, i)) {
-		free(*user);
-		*user = NULL;
-		return PAM_BUF_ERR;
+	retval = PAM_IGNORE;
+	if (config_cache_lookup(handle, cache, user, limits)) {
+		log_limit(handle, user->name, limits);
+		retval = PAM_SUCCESS;
 	}
-	(*user)[i] = '\0';
 
-	/* skip whitespace to find the start of the limit */
-	line += i;
-	while (isspace(*line))
-		line++;
-
-	/* no limit specified */
-	if (*line == '\0') {
-		free(*user);
-		*user = NULL;
-		return PAM_SYSTEM_ERR;
-	}
+	free_config_cache(cache);
 
-	*limit = strdup(line);
-
-	return PAM_SUCCESS;
+	return retval;
 }
 
 
-static int parse_config_file(pam_handle_t *handle, const char *path,
-                             char ***user_table)
+/* hand the limit on to pam_systemd, and to our own later stages */
+static int set_limit(pam_handle_t *handle, usec_t timeval)
 {
-	FILE *config_file;
-	struct stat statbuf;
-	int usercount = 0;
-	char line[1024];
-	char **results;
-
-	*user_table = NULL;
+	char *runtime_max_sec;
+	usec_t *remaining;
+	int retval;
 
-	if (stat(path, &statbuf)) {
-		pam_syslog(handle, LOG_INFO,
-		           "No config file for module, ignoring.");
-		return PAM_IGNORE;
+	runtime_max_sec = malloc(FORMAT_TIMESPAN_MAX);
+	if (!format_timespan(runtime_max_sec, FORMAT_TIMESPAN_MAX,
+	                     timeval, USEC_PER_SEC))
+	{
+		free((void *)runtime_max_sec);
+		return PAM_PERM_DENIED;
 	}
 
-	config_file = fopen(path, "r");
-	if (config_file == NULL) {
-		pam_syslog(handle, LOG_ERR,
-		           "Failed to open config file '%s': %s",
-		           path, strerror(errno));
+	retval = pam_set_data(handle, "systemd.runtime_max_sec",
+	                      (void *)runtime_max_sec, cleanup);
+	if (retval != PAM_SUCCESS) {
+		free((void *)runtime_max_sec);
 		return PAM_PERM_DENIED;
 	}
 
-	results = malloc(sizeof(char *));
-	results[0] = NULL;
-
-	while (fgets(line, sizeof(line), config_file)) {
-		int ret;
-		char *user = NULL;
-		char *limit = NULL;
-		char **newresults;
-
-		ret = parse_config_line(line, &user, &limit);
-		if (ret != PAM_SUCCESS) {
-			free_config_file(results);
-			pam_syslog(handle, LOG_ERR, "invalid config file '%s'",
-			           path);
-			return PAM_PERM_DENIED;
-		}
-		if (!user || !limit)
-		{
-			free(user);
-			free(limit);
-			continue;
-		}
+	remaining = malloc(sizeof(usec_t));
+	if (!remaining)
+		return PAM_PERM_DENIED;
+	*remaining = timeval;
 
-		newresults = reallocarray(results, sizeof(char *),
-		                          ++usercount * 2 + 1);
-		if (!newresults) {
-			free(user);
-			free(limit);
-			free_config_file(results);
-			return PAM_BUF_ERR;
-		}
-		results = newresults;
-		results[(usercount - 1) * 2] = user;
-		results[(usercount - 1) * 2 + 1] = limit;
-		results[usercount * 2] = NULL;
-	}
-	if (!usercount) {
-		free(results);
-		return PAM_IGNORE;
+	retval = pam_set_data(handle, REMAINING_USEC_DATA, remaining, cleanup);
+	if (retval != PAM_SUCCESS) {
+		free(remaining);
+		return PAM_PERM_DENIED;
 	}
-	*user_table = results;
+
 	return PAM_SUCCESS;
 }
 
 
+/* whether acct_mgmt set a limit for the session, without which there is
+   nothing to account for */
+static bool session_has_limit(pam_handle_t *handle)
+{
+	char *runtime_max_sec = NULL;
+	usec_t *remaining = NULL;
+
+	if (pam_get_data(handle, REMAINING_USEC_DATA,
+	                 (const void **)&remaining) == PAM_SUCCESS
+	    && remaining)
+		return true;
+	return pam_get_data(handle, "systemd.runtime_max_sec",
+	                    (const void **)&runtime_max_sec) == PAM_SUCCESS
+	       && runtime_max_sec;
+}
+
+
 PAM_EXTERN int pam_sm_open_session(pam_handle_t *handle,
                                    int flags,
                                    int argc, const char **argv)
 {
 	int retval;
-	time_t *current_time = malloc(sizeof(time_t));
+	struct state_options opts = { NULL };
+	const char *username = NULL;
+	time_t *current_time;
+
+	for (; argc-- > 0; ++argv) {
+		if (strcmp(*argv, "debug_timing") == 0)
+			continue;
+		if (!parse_state_argument(*argv, &opts)) {
+			pam_syslog(handle, LOG_ERR,
+			           "Unknown module argument: %s", *argv);
+			return PAM_SYSTEM_ERR;
+		}
+	}
+
+	if (!opts.statepath)
+		opts.statepath = DEFAULT_STATE_PATH;
 
+	current_time = malloc(sizeof(time_t));
 	if (!current_time)
 		return PAM_BUF_ERR;
 
@@ -428,6 +367,15 @@ PAM_EXTERN int pam_sm_open_session(pam_handle_t *handle,
 		free(current_time);
 		return PAM_SYSTEM_ERR;
 	}
+
+	/* a session that isn't listed is accounted for in full when it
+	   closes, so failing to list it loses nothing */
+	if (opts.checkpoint && session_has_limit(handle)
+	    && pam_get_item(handle, PAM_USER,
+	                    (const void **)&username) == PAM_SUCCESS
+	    && username)
+		begin_live_session(handle, &opts, username, *current_time);
+
 	return PAM_SUCCESS;
 }
 
@@ -437,34 +385,29 @@ PAM_EXTERN int pam_sm_close_session(pam_handle_t *handle,
                                     int argc, const char **argv)
 {
 	int retval;
-	const char *statepath = NULL, *username = NULL;
-	usec_t elapsed_time, used_time = 0;
+	struct state_options opts = { NULL };
+	struct call_timing timing = { 0 };
+	const char *username = NULL;
+	usec_t elapsed_time, unclaimed, start = timing_now();
 	time_t *start_time, end_time = time(NULL);
-	char *runtime_max_sec = NULL;
 
 	// if no time limit is set for us, then short-circuit to avoid
 	// creating an unnecessarily large state file
-        retval = pam_get_data(handle, "systemd.runtime_max_sec",
-	                      (const void **)&runtime_max_sec);
-	if (retval != PAM_SUCCESS || runtime_max_sec == NULL)
+	if (!session_has_limit(handle))
 		return PAM_SUCCESS;
 
-	retval = pam_get_data(handle, "timelimit.session_start",
-	                      (const void **)&start_time);
-
 	for (; argc-- > 0; ++argv) {
-		if (strncmp(*argv, "statepath=", strlen("statepath="))
-		      == 0)
-			statepath = *argv + strlen("statepath=");
-		else {
+		if (strcmp(*argv, "debug_timing") == 0)
+			opts.timing = &timing;
+		else if (!parse_state_argument(*argv, &opts)) {
 			pam_syslog(handle, LOG_ERR,
 			           "Unknown module argument: %s", *argv);
 			return PAM_SYSTEM_ERR;
 		}
 	}
 
-	if (!statepath)
-		statepath = DEFAULT_STATE_PATH;
+	if (!opts.statepath)
+		opts.statepath = DEFAULT_STATE_PATH;
 
 	retval = pam_get_data(handle, "timelimit.session_start",
 	                      (const void **)&start_time);
@@ -487,19 +430,19 @@ PAM_EXTERN int pam_sm_close_session(pam_handle_t *handle,
 	if (!username)
 		return PAM_SESSION_ERR;
 
-	retval = get_used_time_for_user(handle, statepath, username,
-	                                &used_time);
-	if (retval != PAM_SUCCESS) {
-		return PAM_SESSION_ERR;
-	}
+	/* checkpoints may have accounted for some of the session already;
+	   if the list can't be read, counting all of it again errs on the
+	   side of the limit */
+	if (opts.checkpoint
+	    && end_live_session(handle, &opts, username, *start_time,
+	                        end_time, &unclaimed) == PAM_SUCCESS)
+		elapsed_time = unclaimed;
 
-	if (USEC_INFINITY - used_time < elapsed_time)
-		elapsed_time = USEC_INFINITY;
-	else
-		elapsed_time += used_time;
-
-	retval = set_used_time_for_user(handle, statepath, username,
-	                                elapsed_time);
+	retval = add_used_time(handle, &opts, username, time_today(),
+	                       elapsed_time);
+	if (opts.timing)
+		log_call_timing(handle, "close_session", username, retval,
+		                &timing, start);
 
 	if (retval != PAM_SUCCESS)
 		return PAM_SESSION_ERR;
@@ -508,24 +451,168 @@ PAM_EXTERN int pam_sm_close_session(pam_handle_t *handle,
 }
 
 
+/* get_usage()'s arguments, for live_session_time() to call it with */
+struct usage_lookup {
+	pam_handle_t *handle;
+	const struct state_options *opts;
+	const char *username;
+	time_t today;
+	bool only_today;
+	struct usage *usage;
+};
+
+
+static int lookup_usage(void *data)
+{
+	const struct usage_lookup *lookup = data;
+
+	return get_usage(lookup->handle, lookup->opts, lookup->username,
+	                 lookup->today, lookup->only_today, lookup->usage);
+}
+
+
+/* the time used over the days days up to today */
+static usec_t usage_over(const struct usage *usage, unsigned int days)
+{
+	usec_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < days && i < USAGE_DAYS; i++)
+		total = usec_add(total, usage->days[i]);
+	return total;
+}
+
+
+/* Lowers remaining to what is left of limit, given what has been used
+   over its period.  Returns false if none of it is left. */
+static bool apply_limit(usec_t limit, usec_t used, usec_t *remaining)
+{
+	if (limit == USEC_INFINITY)
+		return true;
+	if (limit <= used)
+		return false;
+	*remaining = MIN(*remaining, limit - used);
+	return true;
+}
+
+
+/* the account checks proper, once the arguments are parsed */
+static int check_account(pam_handle_t *handle, const char *path,
+                         const char *cachepath, bool use_cache,
+                         const struct state_options *opts,
+                         const char *username)
+{
+	char *current_limit = NULL;
+	usec_t *current_usec = NULL;
+	usec_t timeval = USEC_INFINITY, old_timeval = 0, start = 0;
+	struct config_limits limits;
+	struct config_user user;
+	int retval;
+
+	if (opts->timing)
+		start = timing_now();
+	init_config_user(&user, username);
+	if (use_cache)
+		retval = find_cached_limit(handle, path, cachepath, &user,
+		                           &limits);
+	else
+		retval = find_limit(handle, path, &user, &limits);
+	free_config_user(&user);
+	if (opts->timing)
+		opts->timing->config += timing_now() - start;
+	if (retval != PAM_SUCCESS)
+		return retval;
+
+	/* time used can't matter to a user without a limit, so don't let
+	   the state file slow down or fail their login */
+	if (!config_limits_unlimited(&limits)) {
+		time_t today = time_today();
+		/* 1970-01-01 was a Thursday, and weeks start on Monday */
+		unsigned int week_days = (today / (24*60*60) + 3) % 7 + 1;
+		struct usage usage;
+		usec_t in_flight;
+
+		struct usage_lookup lookup = {
+			handle, opts, username, today,
+			limits.week == USEC_INFINITY && limits.window_days <= 1,
+			&usage
+		};
+
+		/* the user's other sessions are using up time too, of which
+		   only what the last checkpoint claimed is in the state; if
+		   the list can't be read, that much is all there is */
+		if (opts->checkpoint)
+			retval = live_session_time(handle, opts, username,
+			                           time(NULL), lookup_usage,
+			                           &lookup, &in_flight);
+		else {
+			retval = lookup_usage(&lookup);
+			in_flight = 0;
+		}
+		if (retval != PAM_SUCCESS) {
+			return PAM_PERM_DENIED;
+		}
+		usage.days[0] = usec_add(usage.days[0], in_flight);
+
+		/* what is left is the least that any of the limits leaves */
+		if (!apply_limit(limits.day, usage.days[0], &timeval)
+		    || !apply_limit(limits.week, usage_over(&usage, week_days),
+		                    &timeval)
+		    || !apply_limit(limits.window,
+		                    usage_over(&usage, limits.window_days),
+		                    &timeval))
+			return PAM_PERM_DENIED;
+	}
+
+	/* an earlier stage (perhaps us, with another config file) may
+	   already have set a tighter limit; only fall back to parsing the
+	   string if nobody left the native value */
+	retval = pam_get_data(handle, REMAINING_USEC_DATA,
+	                      (const void **)&current_usec);
+	if (retval == PAM_SUCCESS && current_usec) {
+		old_timeval = *current_usec;
+		timeval = MIN(old_timeval, timeval);
+	} else {
+		pam_get_data(handle, "systemd.runtime_max_sec",
+		             (const void **)&current_limit);
+		if (current_limit
+		    && !parse_time(current_limit, &old_timeval, USEC_PER_SEC))
+			timeval = MIN(old_timeval, timeval);
+	}
+
+	if (timeval == old_timeval)
+		return PAM_SUCCESS;
+
+	return set_limit(handle, timeval);
+}
+
+
 PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t *handle,
                                 int flags,
                                 int argc, const char **argv)
 {
-	const char *path = NULL, *statepath = NULL, *username = NULL;
-	char *current_limit = NULL, *runtime_max_sec = NULL;
-	char **user_table;
-	unsigned int i;
+	const char *path = NULL, *username = NULL;
+	struct state_options opts = { NULL };
+	struct call_timing timing = { 0 };
+	const char *cachepath = NULL;
+	bool use_cache = false;
+	usec_t start = timing_now();
 	int retval;
-	usec_t timeval = 0, old_timeval = 0, used_time = 0;
 
 	for (; argc-- > 0; ++argv) {
 		if (strncmp(*argv, "path=", strlen("path=")) == 0)
 			path = *argv + strlen("path=");
-		else if (strncmp(*argv, "statepath=", strlen("statepath="))
-		           == 0)
-			statepath = *argv + strlen("statepath=");
-		else {
+		else if (strcmp(*argv, "configcache") == 0)
+			use_cache = true;
+		else if (strncmp(*argv, "configcache=", strlen("configcache="))
+		         == 0)
+		{
+			use_cache = true;
+			cachepath = *argv + strlen("configcache=");
+		}
+		else if (strcmp(*argv, "debug_timing") == 0)
+			opts.timing = &timing;
+		else if (!parse_state_argument(*argv, &opts)) {
 			pam_syslog(handle, LOG_ERR,
 			           "Unknown module argument: %s", *argv);
 			return PAM_PERM_DENIED;
@@ -534,8 +621,8 @@ PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t *handle,
 
 	if (!path)
 		path = DEFAULT_CONFIG_PATH;
-	if (!statepath)
-		statepath = DEFAULT_STATE_PATH;
+	if (!opts.statepath)
+		opts.statepath = DEFAULT_STATE_PATH;
 
 	retval = pam_get_item(handle, PAM_USER, (const void **)&username);
 
@@ -546,70 +633,10 @@ PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t *handle,
 	if (!username)
 		return PAM_PERM_DENIED;
 
-	retval = parse_config_file(handle, path, &user_table);
-	if (retval != PAM_SUCCESS)
-		return retval;
-
-	for (i = 0; user_table[i]; i += 2)
-	{
-		if (!strcmp(user_table[i], username))
-		{
-			runtime_max_sec = user_table[i+1];
-			pam_syslog(handle, LOG_INFO,
-			           "Limiting user login time for '%s' to '%s'",
-			           username, runtime_max_sec);
-		}
-	}
-
-	if (!runtime_max_sec) {
-		free_config_file(user_table);
-		return PAM_IGNORE;
-	}
-
-	retval = parse_time(runtime_max_sec, &timeval, USEC_PER_SEC);
-
-	free_config_file(user_table);
-
-	if (retval) {
-		pam_syslog(handle, LOG_ERR,
-		           "Invalid time limit '%s'", runtime_max_sec);
-		return PAM_PERM_DENIED;
-	}
-
-	retval = get_used_time_for_user(handle, statepath, username,
-	                                &used_time);
-	if (retval != PAM_SUCCESS) {
-		return PAM_PERM_DENIED;
-	}
-
-	if (timeval <= used_time)
-		return PAM_PERM_DENIED;
-
-	timeval -= used_time;
-
-	pam_get_data(handle, "systemd.runtime_max_sec",
-	             (const void **)&current_limit);
-	if (current_limit) {
-		retval = parse_time(current_limit, &old_timeval, USEC_PER_SEC);
-		timeval = MIN(old_timeval, timeval);
-	}
-
-	if (timeval != old_timeval) {
-		runtime_max_sec = malloc(FORMAT_TIMESPAN_MAX);
-		if (!format_timespan(runtime_max_sec, FORMAT_TIMESPAN_MAX,
-		                     timeval, USEC_PER_SEC))
-		{
-			free((void *)runtime_max_sec);
-			return PAM_PERM_DENIED;
-		}
-
-	        retval = pam_set_data(handle, "systemd.runtime_max_sec",
-		                      (void *)runtime_max_sec, cleanup);
-		if (retval != PAM_SUCCESS) {
-			free((void *)runtime_max_sec);
-			retval = PAM_PERM_DENIED;
-		}
-	}
-
+	retval = check_account(handle, path, cachepath, use_cache, &opts,
+	                       username);
+	if (opts.timing)
+		log_call_timing(handle, "acct_mgmt", username, retval, &timing,
+		                start);
 	return retval;
 }
@@ -0,0 +1,489 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <security/pam_ext.h>
+
+#include "live-sessions.h"
+#include "state-daemon.h"
+#include "state-file.h"
+#include "time-util.h"
+
+static const char *program_name = "session-timelimit-ctl";
+
+/* with --json, output is for programs rather than people */
+static bool json;
+
+
+/* the state file code reports errors with pam_syslog(); outside of a PAM
+   stack they belong on stderr instead */
+void pam_syslog(const pam_handle_t *pamh __attribute__((unused)),
+                int priority, const char *fmt, ...)
+{
+	va_list args;
+
+	if (priority > LOG_WARNING)
+		return;
+
+	fprintf(stderr, "%s: ", program_name);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+
+static void usage(FILE *stream)
+{
+	fprintf(stream,
+	        "Usage: %s [--statepath=PATH | --statedir=DIR]\n"
+	        "       [--sync=none|always|batched] [--daemon[=SOCKET]] [--json]\n"
+	        "       COMMAND [USER...]\n"
+	        "\n"
+	        "Commands:\n"
+	        "  dump              list every user's time used\n"
+	        "  query USER...     show the time used by each user\n"
+	        "  reset USER...     forget the time used by each user\n"
+	        "  compact           drop the records of users not seen for a week\n"
+	        "  checkpoint        add the time that open sessions have run so far\n"
+	        "\n"
+	        "A USER of \"-\" reads the users from standard input, one per line.\n",
+	        program_name);
+}
+
+
+/* a string as a JSON string literal */
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+
+/* Prints a user's usage, as a JSON object or as a line of tab-separated
+   fields: the name, the date last updated if there is one, and the time
+   used today and over the last USAGE_DAYS days.  first is whether it's
+   the first of a JSON list. */
+static void print_usage(const char *username, const time_t *day,
+                        const struct usage *usage, bool first)
+{
+	char date[sizeof("YYYY-MM-DD")] = "", today[FORMAT_TIMESPAN_MAX];
+	char total[FORMAT_TIMESPAN_MAX];
+	usec_t sum = 0;
+	struct tm tm;
+	int i;
+
+	/* days are stamped as midnight GMT of the local date */
+	if (day && gmtime_r(day, &tm))
+		strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+
+	if (json) {
+		printf("%s{\"user\":", first ? "" : ",\n");
+		print_json_string(username);
+		if (day)
+			printf(",\"last_day\":\"%s\"", date);
+		printf(",\"days_usec\":[");
+		for (i = 0; i < USAGE_DAYS; i++)
+			printf("%s%llu", i ? "," : "",
+			       (unsigned long long)usage->days[i]);
+		printf("]}");
+		return;
+	}
+
+	for (i = 0; i < USAGE_DAYS; i++)
+		sum = usec_add(sum, usage->days[i]);
+	printf("%s\t", username);
+	if (day)
+		printf("%s\t", date);
+	printf("%s\t%s\n",
+	       format_timespan(today, sizeof(today), usage->days[0],
+	                       USEC_PER_SEC),
+	       format_timespan(total, sizeof(total), sum, USEC_PER_SEC));
+}
+
+
+static int print_record(const struct state_record *record, void *data)
+{
+	bool *first = data;
+
+	print_usage(record->username, &record->day, &record->usage, *first);
+	*first = false;
+	return PAM_SUCCESS;
+}
+
+
+static int do_dump(const struct state_options *opts)
+{
+	bool first = true;
+	int retval;
+
+	if (json)
+		printf("[");
+	retval = list_state_records(NULL, opts, time_today(), print_record,
+	                            &first);
+	if (json)
+		printf("%s]\n", first ? "" : "\n");
+	return retval == PAM_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static int do_query(const struct state_options *opts,
+                    const char *const *usernames, size_t count)
+{
+	time_t today = time_today();
+	struct usage *usages;
+	size_t i;
+
+	usages = calloc(count, sizeof(*usages));
+	if (!usages)
+		return EXIT_FAILURE;
+	if (get_usages(NULL, opts, today, usernames, count, usages)
+	    != PAM_SUCCESS)
+	{
+		free(usages);
+		return EXIT_FAILURE;
+	}
+
+	/* the daemon has the latest of today's time, if it's running */
+	for (i = 0; opts->daemon_socket && i < count; i++) {
+		usec_t used;
+
+		if (daemon_get_used_time(NULL, opts->daemon_socket,
+		                         usernames[i], today, &used)
+		    == PAM_SUCCESS)
+			usages[i].days[0] = used;
+	}
+
+	if (json)
+		printf("[");
+	for (i = 0; i < count; i++)
+		print_usage(usernames[i], NULL, &usages[i], i == 0);
+	if (json)
+		printf("%s]\n", count ? "\n" : "");
+	free(usages);
+	return EXIT_SUCCESS;
+}
+
+
+/* The daemon, if there is one, first forgets the time it holds, so that
+   none of it is written back afterwards, and then the file is reset in a
+   single pass.  Returns the first error. */
+static int reset_users(const struct state_options *opts, time_t today,
+                       const char *const *usernames, size_t count,
+                       uint32_t *reset)
+{
+	int retval = PAM_SUCCESS, file_retval;
+	size_t i;
+
+	/* one it can't be reached for holds nothing to write back */
+	for (i = 0; opts->daemon_socket && i < count; i++) {
+		int user_retval = daemon_forget_used_time(NULL,
+		                                          opts->daemon_socket,
+		                                          usernames[i], today);
+
+		if (user_retval != PAM_SUCCESS
+		    && user_retval != PAM_AUTHINFO_UNAVAIL
+		    && retval == PAM_SUCCESS)
+			retval = user_retval;
+	}
+
+	file_retval = reset_used_times(NULL, opts, today, usernames, count,
+	                               reset);
+	return retval != PAM_SUCCESS ? retval : file_retval;
+}
+
+
+static int do_reset(const struct state_options *opts,
+                    const char *const *usernames, size_t count)
+{
+	uint32_t reset;
+
+	if (reset_users(opts, time_today(), usernames, count, &reset)
+	    != PAM_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (json)
+		printf("{\"reset\":%u}\n", reset);
+	else
+		printf("%u records reset\n", reset);
+	return EXIT_SUCCESS;
+}
+
+
+/* Reads the users from stdin, one per line, into an array that the
+   caller must free along with each name.  Returns the number read, or
+   -1 on failure. */
+static ssize_t read_usernames(char ***usernames)
+{
+	size_t count = 0, size = 0, len = 0;
+	char *line = NULL;
+	ssize_t bytes;
+
+	*usernames = NULL;
+	while ((bytes = getline(&line, &len, stdin)) >= 0) {
+		if (bytes && line[bytes - 1] == '\n')
+			line[--bytes] = '\0';
+		if (!bytes)
+			continue;
+
+		if (count == size) {
+			char **grown;
+
+			size = size ? size * 2 : 64;
+			grown = reallocarray(*usernames, size,
+			                     sizeof(**usernames));
+			if (!grown)
+				break;
+			*usernames = grown;
+		}
+		(*usernames)[count] = strdup(line);
+		if (!(*usernames)[count])
+			break;
+		count++;
+	}
+	free(line);
+
+	if (!ferror(stdin) && feof(stdin))
+		return count;
+
+	fprintf(stderr, "%s: could not read users\n", program_name);
+	while (count-- > 0)
+		free((*usernames)[count]);
+	free(*usernames);
+	*usernames = NULL;
+	return -1;
+}
+
+
+/* runs a command that takes users, from the arguments or from stdin */
+static int do_user_command(const struct state_options *opts,
+                           const char *command, char **args, size_t count)
+{
+	char **usernames = args;
+	ssize_t i, from_stdin = -1;
+	int retval;
+
+	if (count == 1 && !strcmp(args[0], "-")) {
+		from_stdin = read_usernames(&usernames);
+		if (from_stdin < 0)
+			return EXIT_FAILURE;
+		count = from_stdin;
+	}
+
+	if (!strcmp(command, "query"))
+		retval = do_query(opts, (const char *const *)usernames,
+		                  count);
+	else
+		retval = do_reset(opts, (const char *const *)usernames,
+		                  count);
+
+	for (i = 0; i < from_stdin; i++)
+		free(usernames[i]);
+	if (from_stdin >= 0)
+		free(usernames);
+	return retval;
+}
+
+
+static int do_compact(const struct state_options *opts)
+{
+	uint32_t kept, dropped;
+
+	if (compact_state_file(NULL, opts, time_today(), &kept, &dropped)
+	    != PAM_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (json)
+		printf("{\"kept\":%u,\"dropped\":%u}\n", kept, dropped);
+	else
+		printf("%u records kept, %u stale records dropped\n", kept,
+		       dropped);
+	return EXIT_SUCCESS;
+}
+
+
+struct checkpoint {
+	const struct state_options *opts;
+	time_t today;
+	/* the first error from the daemon, which the claims it didn't take
+	   were written to the state file in spite of */
+	int daemon_error;
+};
+
+
+/* make sure the time claimed from the session list is added, through
+   the daemon if there is one, or else with a single pass over the state */
+static int add_claims(struct used_time_update *claims, size_t count,
+                      void *data)
+{
+	struct checkpoint *checkpoint = data;
+	const struct state_options *opts = checkpoint->opts;
+	size_t i, left = 0;
+
+	if (!opts->daemon_socket)
+		return add_used_times(NULL, opts, checkpoint->today, claims,
+		                      count);
+
+	/* the claims the daemon didn't take are moved to the front, and
+	   written to the file themselves; whether one it failed on was
+	   counted isn't known, and counting it twice is the lesser harm */
+	for (i = 0; i < count; i++) {
+		int retval = daemon_add_used_time(NULL, opts->daemon_socket,
+		                                  claims[i].username,
+		                                  checkpoint->today,
+		                                  claims[i].elapsed);
+		struct used_time_update claim;
+
+		if (retval == PAM_SUCCESS)
+			continue;
+		if (retval != PAM_AUTHINFO_UNAVAIL
+		    && checkpoint->daemon_error == PAM_SUCCESS)
+			checkpoint->daemon_error = retval;
+
+		claim = claims[left];
+		claims[left++] = claims[i];
+		claims[i] = claim;
+	}
+	return add_used_times(NULL, opts, checkpoint->today, claims, left);
+}
+
+
+static int do_checkpoint(const struct state_options *opts)
+{
+	struct checkpoint checkpoint = { opts, time_today(), PAM_SUCCESS };
+	unsigned int live, dropped;
+
+	if (claim_live_sessions(NULL, opts, time(NULL), add_claims,
+	                        &checkpoint, &live, &dropped) != PAM_SUCCESS
+	    || checkpoint.daemon_error != PAM_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (json)
+		printf("{\"checkpointed\":%u,\"dropped\":%u}\n", live,
+		       dropped);
+	else
+		printf("%u sessions checkpointed, "
+		       "%u abandoned sessions dropped\n", live, dropped);
+	return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "statepath", required_argument, NULL, 's' },
+		{ "statedir", required_argument, NULL, 'd' },
+		{ "sync", required_argument, NULL, 'y' },
+		{ "daemon", optional_argument, NULL, 'D' },
+		{ "json", no_argument, NULL, 'j' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct state_options opts = { .statepath = DEFAULT_STATE_PATH };
+	const char *command;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "s:d:y:h", options, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			opts.statepath = optarg;
+			break;
+		case 'd':
+			opts.statedir = optarg;
+			break;
+		case 'y':
+			/* a command's updates are a batch of their own */
+			if (!strcmp(optarg, "none"))
+				opts.sync = STATE_SYNC_NONE;
+			else if (!strcmp(optarg, "always")
+			         || !strcmp(optarg, "batched"))
+				opts.sync = STATE_SYNC_ALWAYS;
+			else {
+				fprintf(stderr, "%s: invalid sync policy "
+				        "'%s'\n", program_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'D':
+			opts.daemon_socket = optarg ? optarg
+			                            : DEFAULT_DAEMON_SOCKET;
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'h':
+			usage(stdout);
+			return EXIT_SUCCESS;
+		default:
+			usage(stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(stderr);
+		return EXIT_FAILURE;
+	}
+	command = argv[optind++];
+
+	/* the commands that take users need at least one, and the rest
+	   take none */
+	if (!strcmp(command, "query") || !strcmp(command, "reset")) {
+		if (optind == argc) {
+			usage(stderr);
+			return EXIT_FAILURE;
+		}
+		return do_user_command(&opts, command, argv + optind,
+		                       argc - optind);
+	}
+	if (optind != argc) {
+		usage(stderr);
+		return EXIT_FAILURE;
+	}
+
+	if (!strcmp(command, "dump"))
+		return do_dump(&opts);
+	if (!strcmp(command, "compact"))
+		return do_compact(&opts);
+	if (!strcmp(command, "checkpoint"))
+		return do_checkpoint(&opts);
+
+	fprintf(stderr, "%s: unknown command '%s'\n", program_name, command);
+	usage(stderr);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,623 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <security/pam_ext.h>
+
+#include "state-daemon.h"
+#include "state-file.h"
+
+static const char *program_name = "session-timelimitd";
+
+/* a client gets this long to send its request once connected */
+#define REQUEST_TIMEOUT_SEC 1
+
+#define INITIAL_SLOTS 64
+
+/* the most clients served in one round, sharing a single sync */
+#define MAX_BATCH 64
+
+/* how often the records are read again when every update is written
+   through; otherwise they are read again at each flush */
+#define REFRESH_INTERVAL_SEC 60
+
+/*
+ * The daemon's copy of a user's record: the time used on day as read from
+ * the state file plus what has been added since, of which pending has not
+ * yet been written back.  Only the deltas are ever written, with
+ * add_used_time_for_user(), so that anything that went to the file
+ * directly while the daemon was unreachable is not overwritten; and used
+ * is read from the file again every so often, so that such time counts
+ * here as well.
+ */
+struct record {
+	char name[NAME_MAX + 1];
+	usec_t used;
+	usec_t pending;
+};
+
+/* an open-addressed hash table on the username, holding only the records
+   of a single day; it is emptied when the day changes */
+struct table {
+	struct record *slots;
+	size_t size;
+	size_t used;
+	time_t day;
+	size_t pending;
+};
+
+static volatile sig_atomic_t quit;
+
+
+/* the shared code reports errors with pam_syslog(); the daemon runs in
+   the foreground, so they go to stderr */
+void pam_syslog(const pam_handle_t *pamh __attribute__((unused)),
+                int priority, const char *fmt, ...)
+{
+	va_list args;
+
+	if (priority > LOG_WARNING)
+		return;
+
+	fprintf(stderr, "%s: ", program_name);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+
+static void usage(FILE *stream)
+{
+	fprintf(stream,
+	        "Usage: %s [--statepath=PATH | --statedir=DIR] [--socket=PATH]\n"
+	        "       [--flush-interval=SECONDS] [--sync=none|always|batched]\n",
+	        program_name);
+}
+
+
+static void handle_signal(int signum __attribute__((unused)))
+{
+	quit = 1;
+}
+
+
+/* FNV-1a */
+static uint32_t hash_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+/* the slot holding name, or the free slot where it would go */
+static struct record *find_slot(struct record *slots, size_t size,
+                                const char *name)
+{
+	size_t i = hash_name(name) & (size - 1);
+
+	while (slots[i].name[0] && strcmp(slots[i].name, name))
+		i = (i + 1) & (size - 1);
+	return &slots[i];
+}
+
+
+static bool grow_table(struct table *table)
+{
+	size_t size = table->size ? table->size * 2 : INITIAL_SLOTS;
+	struct record *slots = calloc(size, sizeof(*slots));
+	size_t i;
+
+	if (!slots)
+		return false;
+
+	for (i = 0; i < table->size; i++) {
+		if (table->slots[i].name[0])
+			*find_slot(slots, size, table->slots[i].name) =
+				table->slots[i];
+	}
+	free(table->slots);
+	table->slots = slots;
+	table->size = size;
+	return true;
+}
+
+
+/* writes back what has been added since the last flush; records that
+   can't be written stay pending for the next one */
+static void flush_table(const struct state_options *opts,
+                        struct table *table)
+{
+	size_t i;
+
+	for (i = 0; i < table->size && table->pending; i++) {
+		struct record *record = &table->slots[i];
+
+		if (!record->name[0] || !record->pending)
+			continue;
+		if (add_used_time_for_user(NULL, opts, record->name,
+		                           table->day, record->pending)
+		    != PAM_SUCCESS)
+			continue;
+		record->pending = 0;
+		table->pending--;
+	}
+}
+
+
+/* Reads every record's time used again, on top of which goes what is
+   still pending.  Ones that can't be read keep the time they had. */
+static void refresh_table(const struct state_options *opts,
+                          struct table *table)
+{
+	const char **names;
+	struct record **records;
+	struct usage *usages;
+	size_t i, count = 0;
+
+	if (!table->used)
+		return;
+
+	names = malloc(table->used * sizeof(*names));
+	records = malloc(table->used * sizeof(*records));
+	usages = malloc(table->used * sizeof(*usages));
+	if (names && records && usages) {
+		for (i = 0; i < table->size; i++) {
+			if (!table->slots[i].name[0])
+				continue;
+			records[count] = &table->slots[i];
+			names[count] = table->slots[i].name;
+			count++;
+		}
+		if (get_usages(NULL, opts, table->day, names, count, usages)
+		    == PAM_SUCCESS)
+		{
+			for (i = 0; i < count; i++)
+				records[i]->used = usec_add(
+					usages[i].days[0], records[i]->pending);
+		}
+	}
+	free(names);
+	free(records);
+	free(usages);
+}
+
+
+/* moves the table on to day, which is after its own */
+static void start_day(const struct state_options *opts, struct table *table,
+                      time_t day)
+{
+	flush_table(opts, table);
+	if (table->pending)
+		pam_syslog(NULL, LOG_ERR,
+		           "Dropping %zu records that could not be written back",
+		           table->pending);
+
+	if (table->slots)
+		memset(table->slots, 0, table->size * sizeof(*table->slots));
+	table->used = 0;
+	table->pending = 0;
+	table->day = day;
+}
+
+
+/* returns the user's record for the table's day, read in from the state
+   file the first time, or NULL on failure */
+static struct record *get_record(const struct state_options *opts,
+                                 struct table *table, const char *name)
+{
+	struct record *record;
+	usec_t used;
+
+	if (table->size) {
+		record = find_slot(table->slots, table->size, name);
+		if (record->name[0])
+			return record;
+	}
+
+	if (get_used_time_for_user(NULL, opts, name, table->day, &used)
+	    != PAM_SUCCESS)
+		return NULL;
+
+	/* keep the table at most three quarters full */
+	if ((table->used + 1) * 4 > table->size * 3 && !grow_table(table))
+		return NULL;
+
+	record = find_slot(table->slots, table->size, name);
+	strcpy(record->name, name);
+	record->used = used;
+	record->pending = 0;
+	table->used++;
+	return record;
+}
+
+
+static int add_time(const struct state_options *opts, struct table *table,
+                    struct record *record, usec_t elapsed_time,
+                    bool write_through)
+{
+	if (write_through) {
+		/* on the file before the client is told it's done */
+		int retval = add_used_time_for_user(NULL, opts, record->name,
+		                                    table->day, elapsed_time);
+		if (retval != PAM_SUCCESS)
+			return retval;
+	} else {
+		if (!record->pending)
+			table->pending++;
+		record->pending = usec_add(record->pending, elapsed_time);
+	}
+	record->used = usec_add(record->used, elapsed_time);
+	return PAM_SUCCESS;
+}
+
+
+/* drops the time the table holds for the user, pending time included,
+   all of which is from before the reset the caller makes in the file */
+static void forget_record(struct table *table, const char *name)
+{
+	struct record *record;
+
+	if (!table->size)
+		return;
+	record = find_slot(table->slots, table->size, name);
+	if (!record->name[0])
+		return;
+	if (record->pending)
+		table->pending--;
+	record->used = 0;
+	record->pending = 0;
+}
+
+
+static void handle_request(const struct state_options *opts,
+                           struct table *table, bool write_through,
+                           const struct daemon_request *request,
+                           struct daemon_reply *reply)
+{
+	struct record *record;
+
+	reply->version = DAEMON_PROTOCOL_VERSION;
+	reply->status = PAM_SYSTEM_ERR;
+	reply->usec = 0;
+
+	if (request->version != DAEMON_PROTOCOL_VERSION
+	    || !request->username[0]
+	    || !memchr(request->username, '\0', sizeof(request->username)))
+		return;
+
+	if (request->today > table->day)
+		start_day(opts, table, request->today);
+
+	if (request->op == DAEMON_FORGET_USED_TIME) {
+		forget_record(table, request->username);
+		reply->status = PAM_SUCCESS;
+		return;
+	}
+
+	/* a caller still on an earlier day, with the clock or time zone
+	   moving backwards: pass it straight through to the file */
+	if (request->today < table->day) {
+		if (request->op == DAEMON_GET_USED_TIME) {
+			usec_t used;
+
+			reply->status = get_used_time_for_user(
+				NULL, opts, request->username, request->today,
+				&used);
+			reply->usec = used;
+		} else if (request->op == DAEMON_ADD_USED_TIME)
+			reply->status = add_used_time_for_user(
+				NULL, opts, request->username, request->today,
+				request->usec);
+		return;
+	}
+
+	record = get_record(opts, table, request->username);
+	if (!record)
+		return;
+
+	if (request->op == DAEMON_GET_USED_TIME)
+		reply->status = PAM_SUCCESS;
+	else if (request->op == DAEMON_ADD_USED_TIME)
+		reply->status = add_time(opts, table, record, request->usec,
+		                         write_through);
+	else
+		return;
+	reply->usec = record->used;
+}
+
+
+/* only the superuser, which the PAM stacks run as, and our own user may
+   talk to us */
+static bool client_allowed(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return false;
+	return cred.uid == 0 || cred.uid == geteuid();
+}
+
+
+static bool read_request(int fd, struct daemon_request *request)
+{
+	struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT_SEC };
+
+	return client_allowed(fd)
+	       && !setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+	                      sizeof(timeout))
+	       && recv(fd, request, sizeof(*request), 0) == sizeof(*request);
+}
+
+
+struct client {
+	int fd;
+	bool added;
+	struct daemon_reply reply;
+};
+
+
+/* Serve everyone who is waiting, up to MAX_BATCH of them.  With
+   batch_sync, the updates written through for the whole round share one
+   sync, and nobody is replied to until it is done. */
+static void serve_round(const struct state_options *opts,
+                        struct table *table, bool write_through,
+                        bool batch_sync, int listen_fd)
+{
+	struct client clients[MAX_BATCH];
+	struct daemon_request request;
+	bool synced = true;
+	size_t count = 0, i;
+
+	while (count < MAX_BATCH) {
+		struct client *client = &clients[count];
+
+		/* the listening socket is non-blocking, so this ends the
+		   round once nobody else is waiting */
+		client->fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client->fd < 0)
+			break;
+		if (!read_request(client->fd, &request)) {
+			close(client->fd);
+			continue;
+		}
+		handle_request(opts, table, write_through, &request,
+		               &client->reply);
+		client->added = request.op == DAEMON_ADD_USED_TIME
+		                && client->reply.status == PAM_SUCCESS;
+		if (client->added && write_through)
+			synced = false;
+		count++;
+	}
+
+	if (batch_sync && !synced && sync_state_file(NULL, opts) != PAM_SUCCESS)
+	{
+		/* written but maybe not durable: not safe to say it's done,
+		   but not safe to do again either */
+		for (i = 0; i < count; i++) {
+			if (clients[i].added)
+				clients[i].reply.status = PAM_SYSTEM_ERR;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		send(clients[i].fd, &clients[i].reply, sizeof(clients[i].reply),
+		     MSG_NOSIGNAL);
+		close(clients[i].fd);
+	}
+}
+
+
+static int listen_socket(const char *socketpath)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat statbuf;
+	mode_t mask;
+	int fd;
+
+	if (strlen(socketpath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long: %s\n",
+		        program_name, socketpath);
+		return -1;
+	}
+	strcpy(addr.sun_path, socketpath);
+
+	/* a socket left behind by an earlier run */
+	if (lstat(socketpath, &statbuf) == 0 && S_ISSOCK(statbuf.st_mode))
+		unlink(socketpath);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: socket: %s\n", program_name,
+		        strerror(errno));
+		return -1;
+	}
+
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(fd, SOMAXCONN) < 0)
+	{
+		fprintf(stderr, "%s: could not listen on %s: %s\n",
+		        program_name, socketpath, strerror(errno));
+		umask(mask);
+		close(fd);
+		return -1;
+	}
+	umask(mask);
+	return fd;
+}
+
+
+/* flushes the table, syncing the state file afterwards with batch_sync */
+static void flush_and_sync(const struct state_options *opts,
+                           struct table *table, bool batch_sync)
+{
+	size_t pending = table->pending;
+
+	flush_table(opts, table);
+	if (batch_sync && table->pending < pending)
+		sync_state_file(NULL, opts);
+}
+
+
+static void serve(const struct state_options *opts, int listen_fd,
+                  unsigned int flush_interval, bool batch_sync)
+{
+	struct table table = { .day = time_today() };
+	unsigned int interval = flush_interval ? flush_interval
+	                                       : REFRESH_INTERVAL_SEC;
+	usec_t next_flush = timing_now() + interval * USEC_PER_SEC;
+	struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+
+	while (!quit) {
+		usec_t now = timing_now();
+		int timeout;
+
+		if (now >= next_flush) {
+			flush_and_sync(opts, &table, batch_sync);
+			refresh_table(opts, &table);
+			next_flush = now + interval * USEC_PER_SEC;
+		}
+		timeout = (next_flush - now + USEC_PER_MSEC - 1)
+		          / USEC_PER_MSEC;
+
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		serve_round(opts, &table, !flush_interval, batch_sync,
+		            listen_fd);
+	}
+
+	flush_and_sync(opts, &table, batch_sync);
+	if (table.pending)
+		pam_syslog(NULL, LOG_ERR,
+		           "%zu records could not be written back", table.pending);
+	free(table.slots);
+}
+
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "statepath", required_argument, NULL, 's' },
+		{ "statedir", required_argument, NULL, 'd' },
+		{ "socket", required_argument, NULL, 'S' },
+		{ "flush-interval", required_argument, NULL, 'i' },
+		{ "sync", required_argument, NULL, 'y' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct state_options opts = { .statepath = DEFAULT_STATE_PATH };
+	const char *socketpath = DEFAULT_DAEMON_SOCKET;
+	struct sigaction action = { .sa_handler = handle_signal };
+	unsigned long flush_interval = 0;
+	bool batch_sync = false;
+	char *end;
+	int c, fd;
+
+	while ((c = getopt_long(argc, argv, "s:d:S:i:y:h", options, NULL))
+	       != -1)
+	{
+		switch (c) {
+		case 's':
+			opts.statepath = optarg;
+			break;
+		case 'd':
+			opts.statedir = optarg;
+			break;
+		case 'S':
+			socketpath = optarg;
+			break;
+		case 'i':
+			errno = 0;
+			flush_interval = strtoul(optarg, &end, 10);
+			if (errno || end == optarg || *end
+			    || flush_interval > 86400) {
+				fprintf(stderr, "%s: invalid flush interval "
+				        "'%s'\n", program_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'y':
+			/* batched syncs are done here, once per round or
+			   flush, rather than by each update */
+			opts.sync = STATE_SYNC_NONE;
+			batch_sync = false;
+			if (!strcmp(optarg, "always"))
+				opts.sync = STATE_SYNC_ALWAYS;
+			else if (!strcmp(optarg, "batched"))
+				batch_sync = true;
+			else if (strcmp(optarg, "none")) {
+				fprintf(stderr, "%s: invalid sync policy "
+				        "'%s'\n", program_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			usage(stdout);
+			return EXIT_SUCCESS;
+		default:
+			usage(stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc) {
+		usage(stderr);
+		return EXIT_FAILURE;
+	}
+
+	/* without SA_RESTART, so that poll() returns */
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fd = listen_socket(socketpath);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	serve(&opts, fd, flush_interval, batch_sync);
+
+	close(fd);
+	unlink(socketpath);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <security/pam_ext.h>
+
+#include "state-daemon.h"
+
+/* long enough for a daemon that is writing through to a busy state file,
+   short enough that a wedged one doesn't hold up logins for long */
+#define DAEMON_TIMEOUT_SEC 5
+
+
+static int connect_daemon(const pam_handle_t *handle, const char *socketpath)
+{
+	struct timeval timeout = { .tv_sec = DAEMON_TIMEOUT_SEC };
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(socketpath) >= sizeof(addr.sun_path)) {
+		pam_syslog(handle, LOG_ERR, "Daemon socket path too long: %s",
+		           socketpath);
+		return -1;
+	}
+	strcpy(addr.sun_path, socketpath);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+	    || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+	                  sizeof(timeout))
+	    || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		pam_syslog(handle, LOG_WARNING,
+		           "Could not reach the daemon at %s: %s", socketpath,
+		           strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+static int daemon_call(const pam_handle_t *handle, const char *socketpath,
+                       struct daemon_request *request,
+                       struct daemon_reply *reply)
+{
+	ssize_t bytes;
+	int fd;
+
+	fd = connect_daemon(handle, socketpath);
+	if (fd < 0)
+		return PAM_AUTHINFO_UNAVAIL;
+
+	request->version = DAEMON_PROTOCOL_VERSION;
+	if (send(fd, request, sizeof(*request), MSG_NOSIGNAL)
+	    != sizeof(*request))
+	{
+		pam_syslog(handle, LOG_WARNING,
+		           "Could not send to the daemon at %s: %s", socketpath,
+		           strerror(errno));
+		close(fd);
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+
+	bytes = recv(fd, reply, sizeof(*reply), 0);
+	close(fd);
+	if (bytes != sizeof(*reply)
+	    || reply->version != DAEMON_PROTOCOL_VERSION)
+	{
+		pam_syslog(handle, LOG_ERR,
+		           "No valid reply from the daemon at %s", socketpath);
+		return PAM_SYSTEM_ERR;
+	}
+	return reply->status;
+}
+
+
+/* with the username copied in, or false if it doesn't fit */
+static bool init_request(struct daemon_request *request, uint32_t op,
+                         const char *username, time_t today, usec_t usec)
+{
+	size_t len = strlen(username);
+
+	if (len == 0 || len >= sizeof(request->username))
+		return false;
+
+	memset(request, 0, sizeof(*request));
+	request->op = op;
+	request->today = today;
+	request->usec = usec;
+	memcpy(request->username, username, len);
+	return true;
+}
+
+
+int daemon_get_used_time(const pam_handle_t *handle, const char *socketpath,
+                         const char *username, time_t today,
+                         usec_t *used_time)
+{
+	struct daemon_request request;
+	struct daemon_reply reply;
+	int retval;
+
+	/* the state file code has its own way of rejecting these */
+	if (!init_request(&request, DAEMON_GET_USED_TIME, username, today, 0))
+		return PAM_AUTHINFO_UNAVAIL;
+
+	retval = daemon_call(handle, socketpath, &request, &reply);
+	if (retval == PAM_SUCCESS)
+		*used_time = reply.usec;
+	return retval;
+}
+
+
+int daemon_add_used_time(const pam_handle_t *handle, const char *socketpath,
+                         const char *username, time_t today,
+                         usec_t elapsed_time)
+{
+	struct daemon_request request;
+	struct daemon_reply reply;
+
+	if (!init_request(&request, DAEMON_ADD_USED_TIME, username, today,
+	                  elapsed_time))
+		return PAM_AUTHINFO_UNAVAIL;
+
+	return daemon_call(handle, socketpath, &request, &reply);
+}
+
+
+int daemon_forget_used_time(const pam_handle_t *handle,
+                            const char *socketpath, const char *username,
+                            time_t today)
+{
+	struct daemon_request request;
+	struct daemon_reply reply;
+
+	if (!init_request(&request, DAEMON_FORGET_USED_TIME, username, today,
+	                  0))
+		return PAM_AUTHINFO_UNAVAIL;
+
+	return daemon_call(handle, socketpath, &request, &reply);
+}
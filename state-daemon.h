@@ -0,0 +1,79 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATE_DAEMON_H
+#define STATE_DAEMON_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <security/pam_modules.h>
+
+#include "time-util.h"
+
+#define DEFAULT_DAEMON_SOCKET LOCALSTATEDIR "/run/session-timelimitd.socket"
+
+/*
+ * session-timelimitd keeps the state in memory and answers the module over
+ * a SOCK_SEQPACKET UNIX socket: one request and one reply per connection,
+ * each a single fixed-size message.  Both ends are on the same host, so
+ * the messages are in native byte order.
+ */
+#define DAEMON_PROTOCOL_VERSION 1
+
+enum daemon_op {
+	DAEMON_GET_USED_TIME = 1,
+	DAEMON_ADD_USED_TIME = 2,
+	/* drop the time held for the user, leaving the state file alone, for
+	   a caller about to reset_used_times() there */
+	DAEMON_FORGET_USED_TIME = 3,
+};
+
+struct daemon_request {
+	uint32_t version;
+	uint32_t op;
+	/* as from time_today() in the caller */
+	int64_t today;
+	/* the time to add, for DAEMON_ADD_USED_TIME */
+	uint64_t usec;
+	char username[NAME_MAX + 1];
+};
+
+struct daemon_reply {
+	uint32_t version;
+	/* a PAM return code */
+	int32_t status;
+	/* the time used today, after any addition */
+	uint64_t usec;
+};
+
+/* These return PAM_AUTHINFO_UNAVAIL if the request never reached the
+   daemon, in which case the caller can go to the state file instead; any
+   other failure means the daemon may have acted on it. */
+int daemon_get_used_time(const pam_handle_t *handle, const char *socketpath,
+                         const char *username, time_t today,
+                         usec_t *used_time);
+int daemon_add_used_time(const pam_handle_t *handle, const char *socketpath,
+                         const char *username, time_t today,
+                         usec_t elapsed_time);
+int daemon_forget_used_time(const pam_handle_t *handle,
+                            const char *socketpath, const char *username,
+                            time_t today);
+
+#endif
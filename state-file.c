@@ -0,0 +1,2256 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_ext.h>
+
+#include "state-file.h"
+
+/*
+ * The state file starts with "Format: " followed by a uint32_t version.
+ *
+ * Format 1 is a flat list of named records, appended to as new users are
+ * seen.  A named record is a NUL-padded username, the time_t of the day it
+ * was last updated and the usec_t used on that day.
+ *
+ * Format 2 adds a uint32_t slot count, a uint32_t count of used slots and
+ * 4 bytes of padding to the header, followed by an open-addressed hash
+ * table of named records keyed on the username.  A slot with an empty
+ * username is free.
+ *
+ * Both are in native byte order and are converted to the current format
+ * the first time they are opened for writing.
+ *
+ * Format 3 is little-endian throughout.  The version is followed by a
+ * uint32_t slot count, a uint32_t count of used slots, 4 bytes of padding
+ * and the uint64_t size of the name pool.  Then comes the hash table,
+ * whose slots hold the 64-bit hash of the username, a uint32_t day number
+ * (days since the epoch, of the day last updated), the uint32_t offset of
+ * the username in the pool and the usec_t used that day.  Last is the
+ * pool of NUL-terminated usernames, which starts with an empty one so
+ * that offset 0 marks a free slot.  The hash is what probing compares;
+ * the name is only read to confirm a match.  Names of users that have
+ * been dropped stay in the pool until the table is next rebuilt.
+ *
+ * Format 4 is format 3 with six uint32_t added to the end of each slot:
+ * the seconds used on each of the six days before the day last updated,
+ * most recent first, so that limits over a week or a rolling window can be
+ * checked from the one slot.  Moving a record on to a later day shifts
+ * them along, and records stay until they have gone a week without use.
+ * Format 3 files are converted like the older formats.
+ *
+ * With the statejournal option, time used is instead appended to a journal
+ * next to the state file, as entries laid out like named records but with
+ * a little-endian int64_t day and the usec_t to add to it.  Appenders hold
+ * a shared lock on the journal; folding it into the table takes an
+ * exclusive one, under the state file's own exclusive lock.
+ */
+#define STATE_MAGIC "Format: "
+#define STATE_MAGIC_LEN 8
+
+#define RECORD_SIZE (NAME_MAX+1 + sizeof(time_t) + sizeof(usec_t))
+#define RECORD_LAST_SEEN (NAME_MAX+1)
+#define RECORD_USED_TIME (NAME_MAX+1 + sizeof(time_t))
+
+#define V1_HEADER_SIZE 12
+#define V2_HEADER_SIZE 24
+
+#define V3_SLOT_SIZE 24
+
+#define STATE_VERSION 4
+#define HEADER_SIZE 32
+/* the used count, padding and pool size, updated together */
+#define HEADER_USED 16
+#define HEADER_POOL_SIZE 24
+
+#define SLOT_SIZE 48
+#define SLOT_HASH 0
+#define SLOT_DAY 8
+#define SLOT_NAME 12
+#define SLOT_USED_TIME 16
+#define SLOT_HISTORY 24
+
+/* the days before the last updated one that a slot keeps */
+#define HISTORY_DAYS (USAGE_DAYS - 1)
+
+/* must be a power of two */
+#define MIN_SLOTS 64
+
+#define SLOT_OFFSET(slot) (HEADER_SIZE + (off_t)(slot) * SLOT_SIZE)
+#define POOL_OFFSET(sf) SLOT_OFFSET((sf)->slots)
+
+#define SECONDS_PER_DAY (24*60*60)
+
+/* with statedir, the number of files that users are spread across */
+#define STATEDIR_BUCKETS 64
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_ENTRY_SIZE (NAME_MAX+1 + sizeof(int64_t) + sizeof(usec_t))
+#define JOURNAL_DAY (NAME_MAX+1)
+#define JOURNAL_DELTA (NAME_MAX+1 + sizeof(int64_t))
+/* a journal this large is folded by whoever appended to it: a lookup
+   reads all of it, so it mustn't grow for long */
+#define JOURNAL_FOLD_SIZE (256 * JOURNAL_ENTRY_SIZE)
+/* with sync=batched, appends are synced every this many entries */
+#define JOURNAL_SYNC_ENTRIES 16
+/* how much of each entry's NUL-padded name is compared with a single
+   fixed-size memcmp() before the rest of it */
+#define JOURNAL_KEY_SIZE 16
+
+
+struct state_file {
+	const char *path;
+	int fd;
+	/* locked exclusively and opened for writing */
+	bool writable;
+	uint32_t slots;
+	uint32_t used;
+	uint64_t pool_size;
+	/* with the statemmap option, the whole file mapped shared, as it
+	   was when it was opened */
+	char *map;
+	size_t map_size;
+};
+
+/* a slot of the table, decoded */
+struct slot {
+	uint64_t hash;
+	uint32_t day;
+	/* 0 if the slot is free */
+	uint32_t name;
+	usec_t used;
+	/* seconds used on day-1, day-2 and so on */
+	uint32_t history[HISTORY_DAYS];
+};
+
+/* a user's record, as gathered up to be written into a new table */
+struct live_record {
+	/* NUL-terminated or NAME_MAX+1 long, whichever is shorter */
+	const char *name;
+	uint32_t day;
+	usec_t used;
+	uint32_t history[HISTORY_DAYS];
+};
+
+
+/* FNV-1a, over at most as much of the name as fits in a named record; this
+   spreads users over the files of a statedir */
+static uint32_t hash_username(const char *username)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i <= NAME_MAX && username[i]; i++) {
+		hash ^= (unsigned char)username[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+/* the 64-bit FNV-1a over the same, for the table within a file */
+static uint64_t hash_name(const char *username)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i <= NAME_MAX && username[i]; i++) {
+		hash ^= (unsigned char)username[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+/* days since the epoch of a time_today() value */
+static uint32_t day_number(time_t today)
+{
+	if (today < 0)
+		return 0;
+	if (today / SECONDS_PER_DAY > UINT32_MAX)
+		return UINT32_MAX;
+	return today / SECONDS_PER_DAY;
+}
+
+
+static void decode_slot(const char *buf, struct slot *slot)
+{
+	uint64_t hash, used;
+	uint32_t day, name, seconds;
+	int i;
+
+	memcpy(&hash, buf + SLOT_HASH, sizeof(hash));
+	memcpy(&day, buf + SLOT_DAY, sizeof(day));
+	memcpy(&name, buf + SLOT_NAME, sizeof(name));
+	memcpy(&used, buf + SLOT_USED_TIME, sizeof(used));
+	slot->hash = le64toh(hash);
+	slot->day = le32toh(day);
+	slot->name = le32toh(name);
+	slot->used = le64toh(used);
+	for (i = 0; i < HISTORY_DAYS; i++) {
+		memcpy(&seconds, buf + SLOT_HISTORY + i * sizeof(seconds),
+		       sizeof(seconds));
+		slot->history[i] = le32toh(seconds);
+	}
+}
+
+
+static void encode_slot(char *buf, const struct slot *slot)
+{
+	uint64_t hash = htole64(slot->hash), used = htole64(slot->used);
+	uint32_t day = htole32(slot->day), name = htole32(slot->name);
+	uint32_t seconds;
+	int i;
+
+	memcpy(buf + SLOT_HASH, &hash, sizeof(hash));
+	memcpy(buf + SLOT_DAY, &day, sizeof(day));
+	memcpy(buf + SLOT_NAME, &name, sizeof(name));
+	memcpy(buf + SLOT_USED_TIME, &used, sizeof(used));
+	for (i = 0; i < HISTORY_DAYS; i++) {
+		seconds = htole32(slot->history[i]);
+		memcpy(buf + SLOT_HISTORY + i * sizeof(seconds), &seconds,
+		       sizeof(seconds));
+	}
+}
+
+
+/* a day's time as kept in the history, rounded up to the second */
+static uint32_t history_seconds(usec_t used)
+{
+	usec_t seconds = used / USEC_PER_SEC + (used % USEC_PER_SEC != 0);
+
+	return MIN(seconds, UINT32_MAX);
+}
+
+
+/* and back, with the saturated value standing for USEC_INFINITY */
+static usec_t history_usec(uint32_t seconds)
+{
+	if (seconds == UINT32_MAX)
+		return USEC_INFINITY;
+	return (usec_t)seconds * USEC_PER_SEC;
+}
+
+
+/* Moves the record on to a later day, shifting the time used on the day
+   it was last updated and those before into the history.  A day it has
+   no record of is taken to have had no use. */
+static void roll_slot(struct slot *slot, uint32_t day)
+{
+	uint32_t history[HISTORY_DAYS] = { 0 };
+	uint32_t gap;
+	int i;
+
+	if (day <= slot->day)
+		return;
+	gap = day - slot->day;
+
+	/* history[i] is for day-1-i, which was slot->history[i-gap] */
+	if (gap <= HISTORY_DAYS) {
+		history[gap - 1] = history_seconds(slot->used);
+		for (i = gap; i < HISTORY_DAYS; i++)
+			history[i] = slot->history[i - gap];
+	}
+	memcpy(slot->history, history, sizeof(history));
+	slot->day = day;
+	slot->used = 0;
+}
+
+
+/* returns the number of bytes read, which is only short at end of file,
+   or -1 on failure */
+static ssize_t read_full(int fd, void *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t bytes = pread(fd, (char *)buf + done, len - done,
+		                      offset + done);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (bytes == 0)
+			break;
+		done += bytes;
+	}
+	return done;
+}
+
+
+/* returns 0, or -1 on failure */
+static int write_full(int fd, const void *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t bytes = pwrite(fd, (const char *)buf + done,
+		                       len - done, offset + done);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += bytes;
+	}
+	return 0;
+}
+
+
+static int map_state_file(const pam_handle_t *handle, struct state_file *sf)
+{
+	sf->map_size = POOL_OFFSET(sf) + sf->pool_size;
+	sf->map = mmap(NULL, sf->map_size,
+	               sf->writable ? PROT_READ|PROT_WRITE : PROT_READ,
+	               MAP_SHARED, sf->fd, 0);
+	if (sf->map == MAP_FAILED) {
+		sf->map = NULL;
+		pam_syslog(handle, LOG_ERR, "Could not map statefile: %s",
+		           strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+static void unmap_state_file(struct state_file *sf)
+{
+	if (sf->map)
+		munmap(sf->map, sf->map_size);
+	sf->map = NULL;
+}
+
+
+static void close_state_file(struct state_file *sf)
+{
+	unmap_state_file(sf);
+	close(sf->fd);
+}
+
+
+/* A window of consecutive slots read with a single pread(), so that a
+   probe sequence costs one system call however many slots it runs over
+   within the window.  At half load nearly every sequence ends within the
+   first few slots, so the window stays small rather than reading ahead
+   through a large table for nothing. */
+#define PROBE_WINDOW 16
+
+struct probe_window {
+	char slots[PROBE_WINDOW * SLOT_SIZE];
+	uint32_t first;
+	uint32_t count;
+};
+
+
+/* returns the encoded slot, through the map or the window, reading the
+   window afresh from slot if slot is outside it; or NULL on failure */
+static const char *probe_slot(const struct state_file *sf,
+                              struct probe_window *window, uint32_t slot)
+{
+	size_t len;
+
+	if (sf->map)
+		return sf->map + SLOT_OFFSET(slot);
+
+	if (slot >= window->first && slot - window->first < window->count)
+		return window->slots + (slot - window->first) * SLOT_SIZE;
+
+	/* up to the end of the table; probing wraps around to the start
+	   with a read of its own */
+	window->first = slot;
+	window->count = MIN(PROBE_WINDOW, sf->slots - slot);
+	len = (size_t)window->count * SLOT_SIZE;
+	if (read_full(sf->fd, window->slots, len, SLOT_OFFSET(slot))
+	    != (ssize_t)len)
+	{
+		window->count = 0;
+		return NULL;
+	}
+	return window->slots;
+}
+
+
+/* Write through the map if there is one and it covers the range; names
+   appended to the pool since it was mapped are past its end.  Writeback
+   of the dirty pages is scheduled with MS_ASYNC before the lock is
+   dropped, which gives the same guarantees as write(): other hosts of the
+   file see the update at once, and it reaches the disk when the kernel
+   flushes it. */
+static int write_state(struct state_file *sf, const void *buf, size_t len,
+                       off_t offset)
+{
+	off_t page;
+
+	if (!sf->map || offset + len > sf->map_size)
+		return write_full(sf->fd, buf, len, offset);
+
+	memcpy(sf->map + offset, buf, len);
+	page = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	return msync(sf->map + page, offset + len - page, MS_ASYNC);
+}
+
+
+/* Reads the NUL-terminated name at offset in the pool into buf, which
+   holds NAME_MAX+2 bytes.  Returns 0, or -1 if it can't be read or is
+   not a name. */
+static int read_name(const struct state_file *sf, uint32_t offset, char *buf)
+{
+	size_t len;
+
+	if (offset == 0 || offset >= sf->pool_size)
+		return -1;
+	len = MIN(NAME_MAX + 2, sf->pool_size - offset);
+
+	if (sf->map && POOL_OFFSET(sf) + offset + len <= sf->map_size)
+		memcpy(buf, sf->map + POOL_OFFSET(sf) + offset, len);
+	else if (read_full(sf->fd, buf, len, POOL_OFFSET(sf) + offset)
+	         != (ssize_t)len)
+		return -1;
+
+	return memchr(buf, '\0', len) ? 0 : -1;
+}
+
+
+static void fill_header(char *header, uint32_t slots, uint32_t used,
+                        uint64_t pool_size)
+{
+	uint32_t version = htole32(STATE_VERSION);
+	uint64_t pool = htole64(pool_size);
+
+	memset(header, '\0', HEADER_SIZE);
+	memcpy(header, STATE_MAGIC, STATE_MAGIC_LEN);
+	memcpy(header + 8, &version, sizeof(uint32_t));
+	slots = htole32(slots);
+	memcpy(header + 12, &slots, sizeof(uint32_t));
+	used = htole32(used);
+	memcpy(header + HEADER_USED, &used, sizeof(uint32_t));
+	memcpy(header + HEADER_POOL_SIZE, &pool, sizeof(uint64_t));
+}
+
+
+/* smallest table that keeps records at or below half load */
+static uint32_t slots_for_records(size_t records)
+{
+	uint32_t slots = MIN_SLOTS;
+
+	while (slots / 2 < records && slots < UINT32_MAX / 2)
+		slots *= 2;
+	return slots;
+}
+
+
+/* Adds the record to a new table and its name to the pool, returning true
+   if it was added, or false if the user was already present; the first
+   record seen for a user wins, as it did when format 1 files were scanned
+   front to back. */
+static bool insert_record(char *table, uint32_t slots, char *pool,
+                          uint64_t *pool_size,
+                          const struct live_record *record)
+{
+	size_t len = strnlen(record->name, NAME_MAX+1);
+	struct slot slot = {
+		.hash = hash_name(record->name),
+		.day = record->day,
+		.name = *pool_size,
+		.used = record->used,
+	};
+	uint32_t i = slot.hash & (slots - 1);
+
+	memcpy(slot.history, record->history, sizeof(slot.history));
+
+	for (;; i = (i + 1) & (slots - 1)) {
+		struct slot other;
+
+		decode_slot(table + (size_t)i * SLOT_SIZE, &other);
+		if (!other.name)
+			break;
+		if (other.hash == slot.hash
+		    && !strncmp(record->name, pool + other.name, NAME_MAX+1))
+			return false;
+	}
+
+	memcpy(pool + *pool_size, record->name, len);
+	pool[*pool_size + len] = '\0';
+	*pool_size += len + 1;
+	encode_slot(table + (size_t)i * SLOT_SIZE, &slot);
+	return true;
+}
+
+
+/* Long-lived PAM hosts call this for every login and logout, and
+   localtime_r() may check the zone file each time, so each thread keeps
+   the zone's UTC offset for a minute.  The date itself is worked out
+   afresh on every call, so a cached offset is never wrong at midnight,
+   only for up to a minute after a zone or DST change. */
+#define TZ_RECHECK_SECONDS 60
+
+time_t time_today(void) {
+	static __thread time_t checked_at, utc_offset;
+	static __thread bool have_offset;
+	time_t current_time = time(NULL), local_time;
+
+	if (!have_offset || current_time < checked_at
+	    || current_time - checked_at >= TZ_RECHECK_SECONDS)
+	{
+		struct tm current_tm;
+
+		if (localtime_r(&current_time, &current_tm) == NULL) {
+			return -1;
+		}
+		utc_offset = current_tm.tm_gmtoff;
+		checked_at = current_time;
+		have_offset = true;
+	}
+
+	// get the time at 00:00:00 today; we query the local time, but we
+	// write in GMT so that the session limits don't get reset if the
+	// system timezone changes
+	local_time = current_time + utc_offset;
+	return local_time - local_time % (24*60*60);
+}
+
+
+/* Replace the state file with a table of the given size holding the given
+   records, less any last seen before the day stale_before.  The new file
+   is written alongside and renamed into place while still locked, so a
+   crash cannot leave a half-written table and anyone blocked on the old
+   file will notice that it was replaced.  On success sf refers to the new
+   file. */
+static int rewrite_state_file(const pam_handle_t *handle,
+                              const struct state_options *opts,
+                              struct state_file *sf,
+                              const struct live_record *records,
+                              size_t count, uint32_t slots,
+                              uint32_t stale_before)
+{
+	uint64_t pool_size = 1, pool_max = 1;
+	char *image, *table, *pool, *tmppath;
+	size_t table_size, i;
+	uint32_t used = 0;
+	int fd;
+
+	for (i = 0; i < count; i++)
+		pool_max += strnlen(records[i].name, NAME_MAX+1) + 1;
+	if (pool_max > UINT32_MAX)
+		return -1;
+
+	/* the whole file, written out in one go */
+	table_size = (size_t)slots * SLOT_SIZE;
+	image = calloc(1, HEADER_SIZE + table_size + pool_max);
+	tmppath = malloc(strlen(sf->path) + sizeof(".new"));
+	if (!image || !tmppath) {
+		free(image);
+		free(tmppath);
+		return -1;
+	}
+	table = image + HEADER_SIZE;
+	pool = table + table_size;
+
+	for (i = 0; i < count; i++) {
+		if (!records[i].name[0] || records[i].day < stale_before)
+			continue;
+		if (insert_record(table, slots, pool, &pool_size, &records[i]))
+			used++;
+	}
+	fill_header(image, slots, used, pool_size);
+
+	sprintf(tmppath, "%s.new", sf->path);
+	fd = open(tmppath, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not create statefile: %s",
+		           strerror(errno));
+		free(image);
+		free(tmppath);
+		return -1;
+	}
+
+	if (flock(fd, LOCK_EX) < 0
+	    || write_full(fd, image, HEADER_SIZE + table_size + pool_size,
+	                  0) < 0
+	    || fsync(fd) < 0
+	    || rename(tmppath, sf->path) < 0)
+	{
+		pam_syslog(handle, LOG_ERR, "Could not rewrite statefile: %s",
+		           strerror(errno));
+		close(fd);
+		unlink(tmppath);
+		free(image);
+		free(tmppath);
+		return -1;
+	}
+
+	free(image);
+	free(tmppath);
+
+	close_state_file(sf);
+	sf->fd = fd;
+	sf->writable = true;
+	sf->slots = slots;
+	sf->used = used;
+	sf->pool_size = pool_size;
+
+	if (opts->use_mmap)
+		return map_state_file(handle, sf);
+	return 0;
+}
+
+
+/* Convert count named records, as found in format 1 and 2 files, to the
+   current format.  Stale records are kept for now, so that duplicates
+   are resolved the same way as before. */
+static int migrate_named_records(const pam_handle_t *handle,
+                                 const struct state_options *opts,
+                                 struct state_file *sf,
+                                 const char *named, size_t count)
+{
+	struct live_record *records;
+	size_t i, live = 0;
+	int retval;
+
+	records = calloc(count ? count : 1, sizeof(*records));
+	if (!records)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		const char *record = named + i * RECORD_SIZE;
+		time_t last_seen;
+
+		if (!record[0])
+			continue;
+		memcpy(&last_seen, record + RECORD_LAST_SEEN, sizeof(time_t));
+		records[live].name = record;
+		records[live].day = day_number(last_seen);
+		memcpy(&records[live].used, record + RECORD_USED_TIME,
+		       sizeof(usec_t));
+		live++;
+	}
+
+	retval = rewrite_state_file(handle, opts, sf, records, live,
+	                            slots_for_records(live), 0);
+	free(records);
+	return retval;
+}
+
+
+/* reads the named records that follow the header of a format 1 or 2
+   file */
+static int migrate_legacy(const pam_handle_t *handle,
+                          const struct state_options *opts,
+                          struct state_file *sf, size_t header_size)
+{
+	struct stat statbuf;
+	char *named;
+	ssize_t bytes;
+	size_t count;
+	int retval;
+
+	if (fstat(sf->fd, &statbuf) < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not stat statefile: %s",
+		           strerror(errno));
+		return -1;
+	}
+
+	/* a trailing partial record is ignored, as it always has been */
+	count = statbuf.st_size < (off_t)header_size ? 0
+	        : (statbuf.st_size - header_size) / RECORD_SIZE;
+	named = malloc(count * RECORD_SIZE + 1);
+	if (!named)
+		return -1;
+
+	bytes = read_full(sf->fd, named, count * RECORD_SIZE, header_size);
+	if (bytes < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not read from statefile: %s",
+		           strerror(errno));
+		free(named);
+		return -1;
+	}
+
+	retval = migrate_named_records(handle, opts, sf, named,
+	                               bytes / RECORD_SIZE);
+	free(named);
+	return retval;
+}
+
+
+/* the first day of the week up to day, before which records are stale */
+static uint32_t stale_before(uint32_t day)
+{
+	return day > HISTORY_DAYS ? day - HISTORY_DAYS : 0;
+}
+
+
+/* Reads the table, of slots slot_size long, and the pool that follows it
+   into a buffer that the caller must free along with the records, which
+   point into it.  Returns the number of records, or -1 on failure. */
+static int64_t read_records(const pam_handle_t *handle,
+                            const struct state_file *sf, size_t slot_size,
+                            char **image, struct live_record **records)
+{
+	size_t table_size = (size_t)sf->slots * slot_size;
+	uint32_t i, count = 0;
+	bool corrupt = false;
+	char *pool;
+
+	/* the table and the pool, which follows it, in one read */
+	*image = malloc(table_size + sf->pool_size);
+	*records = calloc(sf->used ? sf->used : 1, sizeof(**records));
+	if (!*image || !*records) {
+		free(*image);
+		free(*records);
+		return -1;
+	}
+	pool = *image + table_size;
+
+	if (read_full(sf->fd, *image, table_size + sf->pool_size,
+	              HEADER_SIZE) != table_size + sf->pool_size)
+	{
+		pam_syslog(handle, LOG_ERR, "Could not read from statefile: %s",
+		           strerror(errno));
+		free(*image);
+		free(*records);
+		return -1;
+	}
+
+	for (i = 0; i < sf->slots && count < sf->used && !corrupt; i++) {
+		char buf[SLOT_SIZE] = { 0 };
+		struct slot slot;
+
+		/* an older format's slot is the start of the current one */
+		memcpy(buf, *image + (size_t)i * slot_size, slot_size);
+		decode_slot(buf, &slot);
+		if (!slot.name)
+			continue;
+		/* every name is terminated if the pool ends in a NUL */
+		if (slot.name >= sf->pool_size || pool[sf->pool_size - 1]) {
+			corrupt = true;
+			continue;
+		}
+		(*records)[count].name = pool + slot.name;
+		(*records)[count].day = slot.day;
+		(*records)[count].used = slot.used;
+		memcpy((*records)[count].history, slot.history,
+		       sizeof(slot.history));
+		count++;
+	}
+
+	if (corrupt) {
+		pam_syslog(handle, LOG_ERR, "Corrupt statefile");
+		free(*image);
+		free(*records);
+		return -1;
+	}
+	return count;
+}
+
+
+/* converts a format 3 file, whose records gain an empty history */
+static int migrate_format_3(const pam_handle_t *handle,
+                            const struct state_options *opts,
+                            struct state_file *sf)
+{
+	struct live_record *records;
+	char *image;
+	int64_t count;
+	int retval;
+
+	count = read_records(handle, sf, V3_SLOT_SIZE, &image, &records);
+	if (count < 0)
+		return -1;
+
+	retval = rewrite_state_file(handle, opts, sf, records, count,
+	                            sf->slots, 0);
+	free(image);
+	free(records);
+	return retval;
+}
+
+
+/* Rebuild the table without the records that are stale as of today.
+   When making room for a new user, the table is only kept at its current
+   size (or shrunk) if at least half of it was stale; otherwise it is
+   doubled, so that rebuilds stay rare.  With compact set it is always
+   shrunk to fit.  Returns the number of live records, or -1 on failure. */
+static int64_t resize_state_file(const pam_handle_t *handle,
+                                 const struct state_options *opts,
+                                 struct state_file *sf, time_t today,
+                                 bool compact)
+{
+	uint32_t live = 0, slots, day = day_number(today);
+	struct live_record *records;
+	int64_t count, i;
+	char *image;
+	int retval;
+
+	count = read_records(handle, sf, SLOT_SIZE, &image, &records);
+	if (count < 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		if (records[i].day >= stale_before(day))
+			live++;
+	}
+
+	if (compact)
+		slots = slots_for_records(live);
+	else if (live * 2 <= sf->used)
+		slots = slots_for_records(live + 1);
+	else if (sf->slots < UINT32_MAX / 2)
+		slots = sf->slots * 2;
+	else {
+		free(image);
+		free(records);
+		return -1;
+	}
+
+	retval = rewrite_state_file(handle, opts, sf, records, count, slots,
+	                            stale_before(day));
+	free(image);
+	free(records);
+	return retval < 0 ? -1 : live;
+}
+
+
+/* Validate the header of an existing state file, converting it to the
+   current format if needed.  Returns 1 if it needs converting but was
+   opened read-only. */
+static int read_state_header(const pam_handle_t *handle,
+                             const struct state_options *opts,
+                             struct state_file *sf,
+                             const struct stat *fd_stat)
+{
+	char buf[HEADER_SIZE];
+	uint32_t version, slots, used;
+	uint64_t pool_size;
+	size_t slot_size;
+	ssize_t bytes;
+
+	bytes = read_full(sf->fd, buf, HEADER_SIZE, 0);
+
+	if (bytes < V1_HEADER_SIZE) {
+		pam_syslog(handle, LOG_ERR, "Could not read from statefile: %s",
+		           bytes < 0 ? strerror(errno) : "file truncated");
+		return -1;
+	}
+
+	if (strncmp(buf, STATE_MAGIC, STATE_MAGIC_LEN) != 0) {
+		pam_syslog(handle, LOG_ERR, "Unknown statefile format");
+		return -1;
+	}
+
+	/* the older formats are in whatever byte order wrote them */
+	memcpy(&version, buf + 8, sizeof(uint32_t));
+	if (le32toh(version) != STATE_VERSION && le32toh(version) != 3) {
+		if (version != 1 && version != 2) {
+			pam_syslog(handle, LOG_ERR, "Unknown statefile format");
+			return -1;
+		}
+		if (!sf->writable)
+			return 1;
+		return migrate_legacy(handle, opts, sf,
+		                      version == 1 ? V1_HEADER_SIZE
+		                                   : V2_HEADER_SIZE);
+	}
+	slot_size = le32toh(version) == 3 ? V3_SLOT_SIZE : SLOT_SIZE;
+
+	memcpy(&slots, buf + 12, sizeof(uint32_t));
+	memcpy(&used, buf + HEADER_USED, sizeof(uint32_t));
+	memcpy(&pool_size, buf + HEADER_POOL_SIZE, sizeof(uint64_t));
+	sf->slots = le32toh(slots);
+	sf->used = le32toh(used);
+	sf->pool_size = le64toh(pool_size);
+
+	if (bytes != HEADER_SIZE
+	    || sf->slots < MIN_SLOTS || (sf->slots & (sf->slots - 1))
+	    || sf->pool_size == 0 || sf->pool_size > UINT32_MAX
+	    || fd_stat->st_size < HEADER_SIZE + (off_t)sf->slots * slot_size
+	                          + (off_t)sf->pool_size)
+	{
+		pam_syslog(handle, LOG_ERR, "Corrupt statefile");
+		return -1;
+	}
+
+	if (slot_size != SLOT_SIZE) {
+		if (!sf->writable)
+			return 1;
+		return migrate_format_3(handle, opts, sf);
+	}
+	return 0;
+}
+
+
+/* Returns the state file that holds username's record, which the caller
+   must free.  With statedir, users are spread over a fixed set of files by
+   the top bits of their hash; the table inside each file uses the low
+   bits, so that a file's users still spread over its slots. */
+static char *state_path_for_user(const struct state_options *opts,
+                                 const char *username)
+{
+	uint32_t bucket;
+	char *path;
+
+	if (!opts->statedir)
+		return strdup(opts->statepath);
+
+	bucket = hash_username(username) / (UINT32_MAX / STATEDIR_BUCKETS + 1);
+	if (asprintf(&path, "%s/%02x", opts->statedir, bucket) < 0)
+		return NULL;
+	return path;
+}
+
+
+/* Open and lock the state file, exclusively if it is to be written and
+   shared otherwise.  A reader that finds a file needing conversion retries
+   as a writer.  Returns 1 if the file was opened, 0 if there is no state
+   file yet (only when reading), or -1 on failure. */
+static int open_state_path(const pam_handle_t *handle,
+                           const struct state_options *opts,
+                           const char *statepath,
+                           struct state_file *sf, bool exclusive)
+{
+	struct stat fd_stat, path_stat;
+	usec_t lock_start = 0;
+	int fd, retval;
+	char buf[HEADER_SIZE];
+
+	if (geteuid() == 0) {
+		/* must set the real uid to 0 so the helper will not error
+		   out if pam is called from setuid binary (su, sudo...) */
+		if (setuid(0) == -1) {
+			pam_syslog(handle, LOG_ERR,
+			           "Could not gain root privilege: %s",
+			           strerror(errno));
+			return -1;
+		}
+	}
+
+	for (;;) {
+		if (exclusive)
+			fd = open(statepath, O_RDWR|O_CREAT, 0600);
+		else
+			fd = open(statepath, O_RDONLY);
+		if (fd < 0 && errno == ENOENT && !exclusive)
+			return 0;
+		/* the directory is created along with its first file */
+		if (fd < 0 && errno == ENOENT && opts->statedir
+		    && (mkdir(opts->statedir, 0700) == 0 || errno == EEXIST))
+			continue;
+		if (fd < 0) {
+			pam_syslog(handle, LOG_ERR,
+			           "Could not open statefile: %s",
+			           strerror(errno));
+			return -1;
+		}
+
+		if (opts->timing)
+			lock_start = timing_now();
+		retval = flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+		if (opts->timing)
+			opts->timing->lock += timing_now() - lock_start;
+		if (retval < 0) {
+			pam_syslog(handle, LOG_ERR,
+			           "Could not lock statefile: %s",
+			           strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		if (fstat(fd, &fd_stat) < 0) {
+			pam_syslog(handle, LOG_ERR,
+			           "Could not stat statefile: %s",
+			           strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		/* the file may have been replaced or removed while we waited
+		   for the lock, in which case we have to start over */
+		if (stat(statepath, &path_stat) < 0
+		    || fd_stat.st_dev != path_stat.st_dev
+		    || fd_stat.st_ino != path_stat.st_ino)
+		{
+			close(fd);
+			continue;
+		}
+
+		sf->path = statepath;
+		sf->fd = fd;
+		sf->writable = exclusive;
+		sf->map = NULL;
+
+		/* a writer holding the lock may not have initialized it yet */
+		if (fd_stat.st_size == 0 && !exclusive) {
+			close(fd);
+			return 0;
+		}
+
+		/* newly created, or abandoned before it could be
+		   initialized */
+		if (fd_stat.st_size == 0) {
+			/* with the pool's leading empty name */
+			fill_header(buf, MIN_SLOTS, 0, 1);
+			if (write_full(fd, buf, HEADER_SIZE, 0) < 0
+			    || ftruncate(fd, SLOT_OFFSET(MIN_SLOTS) + 1) < 0)
+			{
+				pam_syslog(handle, LOG_ERR,
+				           "Could not initialize statefile: %s",
+				           strerror(errno));
+				close(fd);
+				return -1;
+			}
+			sf->slots = MIN_SLOTS;
+			sf->used = 0;
+			sf->pool_size = 1;
+			break;
+		}
+
+		retval = read_state_header(handle, opts, sf, &fd_stat);
+		if (retval < 0) {
+			close_state_file(sf);
+			return -1;
+		}
+		if (retval == 0)
+			break;
+
+		/* only a writer can convert the file */
+		close_state_file(sf);
+		exclusive = true;
+	}
+
+	if (opts->use_mmap && !sf->map && map_state_file(handle, sf) < 0) {
+		close_state_file(sf);
+		return -1;
+	}
+
+	return 1;
+}
+
+
+/* Probe the table for username, leaving the slot's contents in record.
+   Returns the slot holding the user's record, or the free slot where it
+   belongs if there is none; or -1 on failure. */
+static int64_t find_slot(const struct state_file *sf, const char *username,
+                         struct slot *record, bool *found)
+{
+	uint64_t hash = hash_name(username);
+	uint32_t slot = hash & (sf->slots - 1);
+	struct probe_window window = { .count = 0 };
+	char name[NAME_MAX + 2];
+	uint32_t probes;
+
+	*found = false;
+
+	/* the table is never more than half full, so this always ends at a
+	   free slot unless the file has been tampered with */
+	for (probes = 0; probes < sf->slots; probes++) {
+		const char *current = probe_slot(sf, &window, slot);
+
+		if (!current)
+			return -1;
+		decode_slot(current, record);
+		if (!record->name)
+			return slot;
+		if (record->hash == hash) {
+			if (read_name(sf, record->name, name) < 0) {
+				errno = EINVAL;
+				return -1;
+			}
+			if (!strncmp(username, name, NAME_MAX+1)) {
+				*found = true;
+				return slot;
+			}
+		}
+		slot = (slot + 1) & (sf->slots - 1);
+	}
+	return -1;
+}
+
+
+static char *journal_path(const char *statepath)
+{
+	char *path;
+
+	if (asprintf(&path, "%s" JOURNAL_SUFFIX, statepath) < 0)
+		return NULL;
+	return path;
+}
+
+
+/* Open and lock the journal next to statepath, returning the file
+   descriptor, or -1 with errno set. */
+static int open_journal(const struct state_options *opts,
+                        const char *statepath, int flags, int operation)
+{
+	usec_t lock_start = 0;
+	char *path;
+	int fd, retval;
+
+	path = journal_path(statepath);
+	if (!path) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	fd = open(path, flags | O_CLOEXEC, 0600);
+	free(path);
+	if (fd < 0)
+		return -1;
+
+	if (opts->timing)
+		lock_start = timing_now();
+	retval = flock(fd, operation);
+	if (opts->timing)
+		opts->timing->lock += timing_now() - lock_start;
+	if (retval < 0) {
+		int saved_errno = errno;
+
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+
+static void decode_journal_entry(const char *entry, time_t *day,
+                                 usec_t *delta)
+{
+	int64_t raw_day;
+	uint64_t raw_delta;
+
+	memcpy(&raw_day, entry + JOURNAL_DAY, sizeof(int64_t));
+	memcpy(&raw_delta, entry + JOURNAL_DELTA, sizeof(uint64_t));
+	*day = (int64_t)le64toh(raw_day);
+	*delta = le64toh(raw_delta);
+}
+
+
+/* Read all of the journal's complete entries into a buffer that the
+   caller must free.  Returns the number of entries, or -1 on failure. */
+static ssize_t read_journal(int fd, char **entries)
+{
+	struct stat statbuf;
+	ssize_t bytes;
+
+	*entries = NULL;
+	if (fstat(fd, &statbuf) < 0)
+		return -1;
+	if (statbuf.st_size < JOURNAL_ENTRY_SIZE)
+		return 0;
+
+	*entries = malloc(statbuf.st_size);
+	if (!*entries)
+		return -1;
+
+	bytes = read_full(fd, *entries, statbuf.st_size, 0);
+	if (bytes < 0) {
+		free(*entries);
+		*entries = NULL;
+		return -1;
+	}
+	/* a crash mid-append may have left a partial entry at the end */
+	return bytes / JOURNAL_ENTRY_SIZE;
+}
+
+
+/* The name of every entry is padded with NULs, so comparing its first
+   JOURNAL_KEY_SIZE bytes with the username padded the same way, which
+   compilers turn into a vector compare or a couple of word compares,
+   settles whether a short name matches.  Longer names only need the rest
+   compared when that much of them matches. */
+static bool journal_entry_matches(const char *entry, const char *key,
+                                  const char *username, size_t len)
+{
+	if (memcmp(entry, key, JOURNAL_KEY_SIZE) != 0)
+		return false;
+	return len < JOURNAL_KEY_SIZE
+	       || !strncmp(username + JOURNAL_KEY_SIZE,
+	                   entry + JOURNAL_KEY_SIZE,
+	                   NAME_MAX+1 - JOURNAL_KEY_SIZE);
+}
+
+
+/* the day of usage that a record or journal entry for day counts
+   towards as of today, or -1 if it's too old to count */
+static int usage_index(uint32_t day, uint32_t today)
+{
+	/* the clock may have gone back since it was recorded */
+	if (day >= today)
+		return 0;
+	if (today - day >= USAGE_DAYS)
+		return -1;
+	return today - day;
+}
+
+
+/* Read the journal next to statepath, under a shared lock, into a buffer
+   that the caller must free.  Returns the number of entries, which is 0
+   if there is no journal, or -1 on failure. */
+static ssize_t load_journal(const pam_handle_t *handle,
+                            const struct state_options *opts,
+                            const char *statepath, char **entries)
+{
+	ssize_t count;
+	int fd;
+
+	*entries = NULL;
+	fd = open_journal(opts, statepath, O_RDONLY, LOCK_SH);
+	if (fd < 0 && errno == ENOENT)
+		return 0;
+	if (fd < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not open journal: %s",
+		           strerror(errno));
+		return -1;
+	}
+
+	count = read_journal(fd, entries);
+	close(fd);
+	if (count < 0)
+		pam_syslog(handle, LOG_ERR, "Could not read from journal: %s",
+		           strerror(errno));
+	return count;
+}
+
+
+/* Add the entries for username to its usage as of today. */
+static void add_journal_usage(const char *entries, ssize_t count,
+                              const char *username, time_t today,
+                              struct usage *usage)
+{
+	char key[JOURNAL_KEY_SIZE] = { 0 };
+	size_t len = strlen(username);
+	ssize_t i;
+
+	memcpy(key, username, MIN(len, JOURNAL_KEY_SIZE));
+
+	for (i = 0; i < count; i++) {
+		const char *entry = entries + i * JOURNAL_ENTRY_SIZE;
+		time_t day;
+		usec_t delta;
+		int index;
+
+		if (!journal_entry_matches(entry, key, username, len))
+			continue;
+		decode_journal_entry(entry, &day, &delta);
+		index = usage_index(day_number(day), day_number(today));
+		if (index < 0)
+			continue;
+		usage->days[index] = usec_add(usage->days[index], delta);
+	}
+}
+
+
+/* Add the journal's entries for username to its usage as of today. */
+static int sum_journal(const pam_handle_t *handle,
+                       const struct state_options *opts,
+                       const char *statepath, const char *username,
+                       time_t today, struct usage *usage)
+{
+	char *entries;
+	ssize_t count;
+
+	count = load_journal(handle, opts, statepath, &entries);
+	if (count < 0)
+		return -1;
+	add_journal_usage(entries, count, username, today, usage);
+	free(entries);
+	return 0;
+}
+
+
+/* what the record says was used on each day as of today */
+static void slot_usage(const struct slot *record, uint32_t today,
+                       struct usage *usage)
+{
+	int index = usage_index(record->day, today), i;
+
+	if (index < 0)
+		return;
+	usage->days[index] = record->used;
+	for (i = 0; index + 1 + i < USAGE_DAYS; i++)
+		usage->days[index + 1 + i] = history_usec(record->history[i]);
+}
+
+
+int get_usage_for_user(const pam_handle_t *handle,
+                       const struct state_options *opts,
+                       const char *username, time_t today,
+                       struct usage *usage)
+{
+	struct slot record;
+	struct state_file sf;
+	int retval = PAM_SUCCESS;
+	usec_t start = 0;
+	char *statepath;
+	bool found;
+
+	memset(usage, '\0', sizeof(*usage));
+
+	statepath = state_path_for_user(opts, username);
+	if (!statepath)
+		return PAM_BUF_ERR;
+
+	retval = open_state_path(handle, opts, statepath, &sf, false);
+	if (retval < 0) {
+		free(statepath);
+		return PAM_SYSTEM_ERR;
+	}
+	/* there may be a journal even if nothing has been folded yet */
+	if (retval == 0) {
+		retval = PAM_SUCCESS;
+		if (opts->use_journal
+		    && sum_journal(handle, opts, statepath, username, today,
+		                   usage) < 0)
+			retval = PAM_SYSTEM_ERR;
+		free(statepath);
+		return retval;
+	}
+	retval = PAM_SUCCESS;
+
+	if (opts->timing)
+		start = timing_now();
+	if (find_slot(&sf, username, &record, &found) < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not read from statefile: %s",
+		           strerror(errno));
+		retval = PAM_SYSTEM_ERR;
+	} else if (found) {
+		slot_usage(&record, day_number(today), usage);
+	}
+
+	/* still under the shared lock, so nobody can be folding the
+	   journal into what we just read */
+	if (retval == PAM_SUCCESS && opts->use_journal
+	    && sum_journal(handle, opts, statepath, username, today,
+	                   usage) < 0)
+		retval = PAM_SYSTEM_ERR;
+
+	if (opts->timing)
+		opts->timing->lookup += timing_now() - start;
+
+	close_state_file(&sf);
+	free(statepath);
+
+	return retval;
+}
+
+
+int get_used_time_for_user(const pam_handle_t *handle,
+                           const struct state_options *opts,
+                           const char *username, time_t today,
+                           usec_t *used_time)
+{
+	struct usage usage;
+	int retval;
+
+	retval = get_usage_for_user(handle, opts, username, today, &usage);
+	*used_time = usage.days[0];
+	return retval;
+}
+
+
+/* Write the user's time for today to the state file, which the caller has
+   open and locked exclusively, either replacing what is recorded or, if
+   accumulate is set, adding to the time already used today.  A today
+   before the day the record was last updated goes into its history, or
+   if it's too long ago is dropped.  username need only be terminated if
+   it is shorter than a named record's name. */
+static int update_record(const pam_handle_t *handle,
+                         const struct state_options *opts,
+                         struct state_file *sf, const char *username,
+                         time_t today, usec_t used_time, bool accumulate)
+{
+	uint32_t day = day_number(today);
+	char buf[SLOT_SIZE];
+	struct slot record;
+	usec_t start = 0;
+	int64_t slot;
+	bool found;
+
+	if (opts->timing)
+		start = timing_now();
+	slot = find_slot(sf, username, &record, &found);
+	/* everything after the first probe counts as writing back */
+	if (opts->timing) {
+		usec_t now = timing_now();
+
+		opts->timing->lookup += now - start;
+		start = now;
+	}
+
+	/* compacting away stale records if there are enough of them, rather
+	   than growing the file forever */
+	if (slot >= 0 && !found && (sf->used + 1) * 2 > sf->slots) {
+		if (resize_state_file(handle, opts, sf, today, false) < 0)
+			return PAM_SYSTEM_ERR;
+		slot = find_slot(sf, username, &record, &found);
+	}
+
+	if (slot < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not read from statefile: %s",
+		           strerror(errno));
+		return PAM_SYSTEM_ERR;
+	}
+
+	if (found && day < record.day) {
+		uint32_t *history;
+
+		if (record.day - day > HISTORY_DAYS)
+			return PAM_SUCCESS;
+		history = &record.history[record.day - day - 1];
+		*history = history_seconds(accumulate
+		                           ? usec_add(history_usec(*history),
+		                                      used_time)
+		                           : used_time);
+		used_time = record.used;
+		day = record.day;
+	} else if (found) {
+		roll_slot(&record, day);
+		if (accumulate)
+			used_time = usec_add(record.used, used_time);
+	}
+
+	/* A new user's name goes on the end of the pool, and the header is
+	   updated, before the slot that refers to it is written: a crash
+	   in between leaves at worst an unreferenced name. */
+	if (!found) {
+		size_t len = strnlen(username, NAME_MAX+1);
+		char name[NAME_MAX + 2], header[HEADER_SIZE - HEADER_USED];
+		uint64_t pool_size = htole64(sf->pool_size + len + 1);
+		uint32_t used = htole32(sf->used + 1);
+
+		if (sf->pool_size + len + 1 > UINT32_MAX) {
+			pam_syslog(handle, LOG_ERR, "Statefile name pool full");
+			return PAM_SYSTEM_ERR;
+		}
+
+		memcpy(name, username, len);
+		name[len] = '\0';
+		memset(header, '\0', sizeof(header));
+		memcpy(header, &used, sizeof(used));
+		memcpy(header + HEADER_POOL_SIZE - HEADER_USED, &pool_size,
+		       sizeof(pool_size));
+
+		if (write_state(sf, name, len + 1,
+		                POOL_OFFSET(sf) + sf->pool_size) < 0
+		    || write_state(sf, header, sizeof(header), HEADER_USED) < 0)
+		{
+			pam_syslog(handle, LOG_ERR,
+			           "Could not update statefile: %s",
+			           strerror(errno));
+			return PAM_SYSTEM_ERR;
+		}
+
+		record.hash = hash_name(username);
+		record.name = sf->pool_size;
+		memset(record.history, '\0', sizeof(record.history));
+		sf->pool_size += len + 1;
+		sf->used++;
+	}
+
+	record.day = day;
+	record.used = used_time;
+	encode_slot(buf, &record);
+
+	if (write_state(sf, buf, sizeof(buf), SLOT_OFFSET(slot)) < 0) {
+		pam_syslog(handle, LOG_ERR,
+		           "Could not update statefile: %s",
+		           strerror(errno));
+		return PAM_SYSTEM_ERR;
+	}
+
+	if (opts->timing)
+		opts->timing->writeback += timing_now() - start;
+
+	return PAM_SUCCESS;
+}
+
+
+/* Fold the journal next to the state file into it; the caller has the
+   state file open and locked exclusively.  Entries from before the
+   USAGE_DAYS up to today no longer count and are dropped.  A crash
+   between updating the table and truncating the journal counts its
+   entries twice, which errs on the side of the limit. */
+static int fold_journal(const pam_handle_t *handle,
+                        const struct state_options *opts,
+                        struct state_file *sf, time_t today)
+{
+	char *entries;
+	ssize_t count, i;
+	int fd, retval = 0;
+
+	fd = open_journal(opts, sf->path, O_RDWR, LOCK_EX);
+	if (fd < 0 && errno == ENOENT)
+		return 0;
+	if (fd < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not open journal: %s",
+		           strerror(errno));
+		return -1;
+	}
+
+	count = read_journal(fd, &entries);
+	if (count < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not read from journal: %s",
+		           strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < count && retval == 0; i++) {
+		const char *entry = entries + i * JOURNAL_ENTRY_SIZE;
+		time_t day;
+		usec_t delta;
+
+		decode_journal_entry(entry, &day, &delta);
+		if (!entry[0] || usage_index(day_number(day),
+		                             day_number(today)) < 0)
+			continue;
+		if (update_record(handle, opts, sf, entry, day, delta, true)
+		    != PAM_SUCCESS)
+			retval = -1;
+	}
+	free(entries);
+
+	/* the folded entries must be on disk before they are dropped from
+	   a journal that is */
+	if (retval == 0 && opts->sync != STATE_SYNC_NONE
+	    && fdatasync(sf->fd) < 0)
+	{
+		pam_syslog(handle, LOG_ERR, "Could not sync statefile: %s",
+		           strerror(errno));
+		retval = -1;
+	}
+
+	/* on failure, the entries folded so far would count twice */
+	if (retval == 0 && ftruncate(fd, 0) < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not truncate journal: %s",
+		           strerror(errno));
+		retval = -1;
+	}
+	close(fd);
+	return retval;
+}
+
+
+static int store_used_time(const pam_handle_t *handle,
+                           const struct state_options *opts,
+                           const char *statepath, const char *username,
+                           time_t today, usec_t used_time, bool accumulate)
+{
+	struct state_file sf;
+	int retval;
+
+	if (open_state_path(handle, opts, statepath, &sf, true) < 0)
+		return PAM_SYSTEM_ERR;
+
+	retval = update_record(handle, opts, &sf, username, today, used_time,
+	                       accumulate);
+	/* without a journal, every update is a batch of its own */
+	if (retval == PAM_SUCCESS && opts->sync != STATE_SYNC_NONE) {
+		usec_t start = 0;
+
+		if (opts->timing)
+			start = timing_now();
+		if (fdatasync(sf.fd) < 0) {
+			pam_syslog(handle, LOG_ERR,
+			           "Could not sync statefile: %s",
+			           strerror(errno));
+			retval = PAM_SYSTEM_ERR;
+		}
+		if (opts->timing)
+			opts->timing->writeback += timing_now() - start;
+	}
+	close_state_file(&sf);
+	return retval;
+}
+
+
+/* Append the time to the journal with a single write, folding the journal
+   into the state file if it has grown too large. */
+static int append_journal(const pam_handle_t *handle,
+                          const struct state_options *opts,
+                          const char *statepath, const char *username,
+                          time_t today, usec_t elapsed_time)
+{
+	char buf[JOURNAL_ENTRY_SIZE];
+	uint64_t raw_day = htole64((int64_t)today);
+	uint64_t raw_delta = htole64(elapsed_time);
+	struct state_file sf;
+	usec_t start = 0;
+	off_t size;
+	int fd, retval;
+
+	if (strlen(username) > NAME_MAX) {
+		pam_syslog(handle, LOG_ERR, "Username too long for statefile");
+		return PAM_SYSTEM_ERR;
+	}
+
+	memset(buf, '\0', sizeof(buf));
+	strcpy(buf, username);
+	memcpy(buf + JOURNAL_DAY, &raw_day, sizeof(raw_day));
+	memcpy(buf + JOURNAL_DELTA, &raw_delta, sizeof(raw_delta));
+
+	for (;;) {
+		fd = open_journal(opts, statepath,
+		                  O_WRONLY|O_APPEND|O_CREAT, LOCK_SH);
+		/* the directory is created along with its first file */
+		if (fd < 0 && errno == ENOENT && opts->statedir
+		    && (mkdir(opts->statedir, 0700) == 0 || errno == EEXIST))
+			continue;
+		break;
+	}
+	if (fd < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not open journal: %s",
+		           strerror(errno));
+		return PAM_SYSTEM_ERR;
+	}
+
+	if (opts->timing)
+		start = timing_now();
+	errno = 0;
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+		pam_syslog(handle, LOG_ERR, "Could not append to journal: %s",
+		           errno ? strerror(errno) : "short write");
+		close(fd);
+		return PAM_SYSTEM_ERR;
+	}
+	size = lseek(fd, 0, SEEK_CUR);
+	if ((opts->sync == STATE_SYNC_ALWAYS
+	     || (opts->sync == STATE_SYNC_BATCHED
+	         && (size / JOURNAL_ENTRY_SIZE) % JOURNAL_SYNC_ENTRIES == 0))
+	    && fdatasync(fd) < 0)
+	{
+		pam_syslog(handle, LOG_ERR, "Could not sync journal: %s",
+		           strerror(errno));
+		close(fd);
+		return PAM_SYSTEM_ERR;
+	}
+	close(fd);
+	if (opts->timing)
+		opts->timing->writeback += timing_now() - start;
+
+	if (size < JOURNAL_FOLD_SIZE)
+		return PAM_SUCCESS;
+
+	/* the time is recorded either way, so this can only fail to
+	   tidy up */
+	if (open_state_path(handle, opts, statepath, &sf, true) < 0)
+		return PAM_SUCCESS;
+	retval = fold_journal(handle, opts, &sf, today);
+	close_state_file(&sf);
+	if (retval < 0)
+		pam_syslog(handle, LOG_ERR, "Could not fold journal");
+	return PAM_SUCCESS;
+}
+
+
+static int store_used_time_for_user(const pam_handle_t *handle,
+                                    const struct state_options *opts,
+                                    const char *username, time_t today,
+                                    usec_t used_time, bool accumulate)
+{
+	char *statepath;
+	int retval;
+
+	statepath = state_path_for_user(opts, username);
+	if (!statepath)
+		return PAM_BUF_ERR;
+
+	if (opts->use_journal && accumulate)
+		retval = append_journal(handle, opts, statepath, username,
+		                        today, used_time);
+	else
+		retval = store_used_time(handle, opts, statepath, username,
+		                         today, used_time, accumulate);
+	free(statepath);
+	return retval;
+}
+
+
+int set_used_time_for_user(const pam_handle_t *handle,
+                           const struct state_options *opts,
+                           const char *username, time_t today,
+                           usec_t used_time)
+{
+	return store_used_time_for_user(handle, opts, username, today,
+	                                used_time, false);
+}
+
+
+int add_used_time_for_user(const pam_handle_t *handle,
+                           const struct state_options *opts,
+                           const char *username, time_t today,
+                           usec_t elapsed_time)
+{
+	return store_used_time_for_user(handle, opts, username, today,
+	                                elapsed_time, true);
+}
+
+
+/* Adds the time of every update whose user's records are in statepath,
+   clearing done for each, under a single lock and with at most a single
+   sync of the file. */
+static int add_used_times_to_path(const pam_handle_t *handle,
+                                  const struct state_options *opts,
+                                  const char *statepath, char **paths,
+                                  const struct used_time_update *updates,
+                                  size_t count, time_t today)
+{
+	struct state_file sf;
+	int retval = PAM_SUCCESS;
+	size_t i;
+
+	if (open_state_path(handle, opts, statepath, &sf, true) < 0)
+		return PAM_SYSTEM_ERR;
+
+	for (i = 0; i < count && retval == PAM_SUCCESS; i++) {
+		if (!paths[i] || strcmp(paths[i], statepath))
+			continue;
+		retval = update_record(handle, opts, &sf, updates[i].username,
+		                       today, updates[i].elapsed, true);
+	}
+
+	if (retval == PAM_SUCCESS && opts->sync != STATE_SYNC_NONE
+	    && fdatasync(sf.fd) < 0)
+	{
+		pam_syslog(handle, LOG_ERR, "Could not sync statefile: %s",
+		           strerror(errno));
+		retval = PAM_SYSTEM_ERR;
+	}
+	close_state_file(&sf);
+	return retval;
+}
+
+
+int add_used_times(const pam_handle_t *handle,
+                   const struct state_options *opts, time_t today,
+                   const struct used_time_update *updates, size_t count)
+{
+	int retval = PAM_SUCCESS;
+	char **paths;
+	size_t i, j;
+
+	if (!count)
+		return PAM_SUCCESS;
+
+	paths = calloc(count, sizeof(*paths));
+	if (!paths)
+		return PAM_BUF_ERR;
+	for (i = 0; i < count && retval == PAM_SUCCESS; i++) {
+		if (strlen(updates[i].username) > NAME_MAX) {
+			pam_syslog(handle, LOG_ERR,
+			           "Username too long for statefile");
+			retval = PAM_SYSTEM_ERR;
+			break;
+		}
+		paths[i] = state_path_for_user(opts, updates[i].username);
+		if (!paths[i])
+			retval = PAM_BUF_ERR;
+	}
+
+	/* each file in the order its first user comes, which for a single
+	   state file is the one pass; the journal is bypassed, as a batch
+	   is no more writes than the appends would be */
+	for (i = 0; i < count && retval == PAM_SUCCESS; i++) {
+		for (j = 0; j < i; j++) {
+			if (!strcmp(paths[j], paths[i]))
+				break;
+		}
+		if (j < i)
+			continue;
+		retval = add_used_times_to_path(handle, opts, paths[i], paths,
+		                                updates, count, today);
+	}
+
+	for (i = 0; i < count; i++)
+		free(paths[i]);
+	free(paths);
+	return retval;
+}
+
+
+static int sync_state_path(const pam_handle_t *handle, const char *statepath)
+{
+	int fd, retval = PAM_SUCCESS;
+
+	fd = open(statepath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT)
+		return PAM_SUCCESS;
+	if (fd < 0 || fdatasync(fd) < 0) {
+		pam_syslog(handle, LOG_ERR, "Could not sync statefile: %s",
+		           strerror(errno));
+		retval = PAM_SYSTEM_ERR;
+	}
+	if (fd >= 0)
+		close(fd);
+	return retval;
+}
+
+
+int sync_state_file(const pam_handle_t *handle,
+                    const struct state_options *opts)
+{
+	unsigned int bucket;
+
+	if (!opts->statedir)
+		return sync_state_path(handle, opts->statepath);
+
+	for (bucket = 0; bucket < STATEDIR_BUCKETS; bucket++) {
+		char *statepath;
+		int retval;
+
+		if (asprintf(&statepath, "%s/%02x", opts->statedir, bucket) < 0)
+			return PAM_BUF_ERR;
+		retval = sync_state_path(handle, statepath);
+		free(statepath);
+		if (retval != PAM_SUCCESS)
+			return retval;
+	}
+	return PAM_SUCCESS;
+}
+
+
+static int compact_state_path(const pam_handle_t *handle,
+                              const struct state_options *opts,
+                              const char *statepath, time_t today,
+                              uint32_t *kept, uint32_t *dropped)
+{
+	struct state_file sf;
+	uint32_t used;
+	int64_t live;
+
+	if (open_state_path(handle, opts, statepath, &sf, true) < 0)
+		return PAM_SYSTEM_ERR;
+
+	/* whether or not the journal is in use now, it may have been */
+	if (fold_journal(handle, opts, &sf, today) < 0) {
+		close_state_file(&sf);
+		return PAM_SYSTEM_ERR;
+	}
+
+	used = sf.used;
+	live = resize_state_file(handle, opts, &sf, today, true);
+
+	close_state_file(&sf);
+
+	if (live < 0)
+		return PAM_SYSTEM_ERR;
+
+	*kept += live;
+	*dropped += used - live;
+	return PAM_SUCCESS;
+}
+
+
+static int compact_state_dir(const pam_handle_t *handle,
+                             const struct state_options *opts, time_t today,
+                             uint32_t *kept, uint32_t *dropped)
+{
+	unsigned int bucket;
+
+	for (bucket = 0; bucket < STATEDIR_BUCKETS; bucket++) {
+		struct stat statbuf;
+		char *statepath, *journal;
+		int retval = PAM_SUCCESS;
+		bool used;
+
+		if (asprintf(&statepath, "%s/%02x", opts->statedir, bucket) < 0)
+			return PAM_BUF_ERR;
+		journal = journal_path(statepath);
+		if (!journal) {
+			free(statepath);
+			return PAM_BUF_ERR;
+		}
+
+		/* don't create the buckets that nobody has used */
+		used = stat(statepath, &statbuf) == 0
+		       || stat(journal, &statbuf) == 0;
+		free(journal);
+		if (used)
+			retval = compact_state_path(handle, opts, statepath,
+			                            today, kept, dropped);
+		free(statepath);
+		if (retval != PAM_SUCCESS)
+			return retval;
+	}
+	return PAM_SUCCESS;
+}
+
+
+int compact_state_file(const pam_handle_t *handle,
+                       const struct state_options *opts, time_t today,
+                       uint32_t *kept, uint32_t *dropped)
+{
+	uint32_t total_kept = 0, total_dropped = 0;
+	int retval;
+
+	if (opts->statedir)
+		retval = compact_state_dir(handle, opts, today, &total_kept,
+		                           &total_dropped);
+	else
+		retval = compact_state_path(handle, opts, opts->statepath,
+		                            today, &total_kept,
+		                            &total_dropped);
+
+	if (kept)
+		*kept = total_kept;
+	if (dropped)
+		*dropped = total_dropped;
+	return retval;
+}
+
+
+/* Returns the state file of each of the users, or NULL on failure, in
+   an array that the caller must free with free_state_paths(). */
+static char **state_paths_for_users(const pam_handle_t *handle,
+                                    const struct state_options *opts,
+                                    const char *const *usernames,
+                                    size_t count)
+{
+	char **paths;
+	size_t i;
+
+	paths = calloc(count ? count : 1, sizeof(*paths));
+	if (!paths)
+		return NULL;
+	for (i = 0; i < count; i++) {
+		if (strlen(usernames[i]) > NAME_MAX) {
+			pam_syslog(handle, LOG_ERR,
+			           "Username too long for statefile");
+			break;
+		}
+		paths[i] = state_path_for_user(opts, usernames[i]);
+		if (!paths[i])
+			break;
+	}
+	if (i == count)
+		return paths;
+
+	while (i-- > 0)
+		free(paths[i]);
+	free(paths);
+	return NULL;
+}
+
+
+static void free_state_paths(char **paths, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		free(paths[i]);
+	free(paths);
+}
+
+
+/* whether paths[i] is the first of the paths to name its file */
+static bool first_of_path(char **paths, size_t i)
+{
+	size_t j;
+
+	for (j = 0; j < i; j++) {
+		if (!strcmp(paths[j], paths[i]))
+			return false;
+	}
+	return true;
+}
+
+
+static int list_state_path(const pam_handle_t *handle,
+                           const struct state_options *opts,
+                           const char *statepath, time_t today,
+                           state_record_fn fn, void *data)
+{
+	struct live_record *records;
+	struct state_file sf;
+	struct stat statbuf;
+	char *image, *journal;
+	bool exclusive;
+	int64_t count, i;
+	int retval = 0;
+
+	/* a journal has to be folded in first, which needs the file to
+	   ourselves; otherwise looking is all we do */
+	journal = journal_path(statepath);
+	if (!journal)
+		return PAM_BUF_ERR;
+	exclusive = stat(journal, &statbuf) == 0;
+	free(journal);
+
+	retval = open_state_path(handle, opts, statepath, &sf, exclusive);
+	if (retval <= 0)
+		return retval < 0 ? PAM_SYSTEM_ERR : PAM_SUCCESS;
+
+	if (exclusive && fold_journal(handle, opts, &sf, today) < 0) {
+		close_state_file(&sf);
+		return PAM_SYSTEM_ERR;
+	}
+
+	count = read_records(handle, &sf, SLOT_SIZE, &image, &records);
+	close_state_file(&sf);
+	if (count < 0)
+		return PAM_SYSTEM_ERR;
+
+	retval = PAM_SUCCESS;
+	for (i = 0; i < count && retval == PAM_SUCCESS; i++) {
+		struct state_record record = {
+			.username = records[i].name,
+			.day = (time_t)records[i].day * SECONDS_PER_DAY,
+		};
+		struct slot slot = {
+			.day = records[i].day,
+			.used = records[i].used,
+		};
+
+		memcpy(slot.history, records[i].history, sizeof(slot.history));
+		memset(&record.usage, '\0', sizeof(record.usage));
+		slot_usage(&slot, day_number(today), &record.usage);
+		retval = fn(&record, data);
+	}
+	free(image);
+	free(records);
+	return retval;
+}
+
+
+int list_state_records(const pam_handle_t *handle,
+                       const struct state_options *opts, time_t today,
+                       state_record_fn fn, void *data)
+{
+	unsigned int bucket;
+
+	if (!opts->statedir)
+		return list_state_path(handle, opts, opts->statepath, today,
+		                       fn, data);
+
+	for (bucket = 0; bucket < STATEDIR_BUCKETS; bucket++) {
+		char *statepath;
+		int retval;
+
+		if (asprintf(&statepath, "%s/%02x", opts->statedir, bucket) < 0)
+			return PAM_BUF_ERR;
+		retval = list_state_path(handle, opts, statepath, today, fn,
+		                         data);
+		free(statepath);
+		if (retval != PAM_SUCCESS)
+			return retval;
+	}
+	return PAM_SUCCESS;
+}
+
+
+/* Looks up every user whose records are in statepath under a single
+   shared lock, reading the journal once for all of them. */
+static int get_usages_from_path(const pam_handle_t *handle,
+                                const struct state_options *opts,
+                                const char *statepath, char **paths,
+                                const char *const *usernames, size_t count,
+                                time_t today, struct usage *usages)
+{
+	struct state_file sf;
+	char *entries = NULL;
+	ssize_t entry_count = 0;
+	bool opened;
+	size_t i;
+	int retval;
+
+	retval = open_state_path(handle, opts, statepath, &sf, false);
+	if (retval < 0)
+		return PAM_SYSTEM_ERR;
+	opened = retval > 0;
+
+	/* still under the shared lock, so nobody can be folding the
+	   journal into what is read; whether or not the journal is in use
+	   now, it may have been, and its time will count once folded */
+	entry_count = load_journal(handle, opts, statepath, &entries);
+	if (entry_count < 0) {
+		if (opened)
+			close_state_file(&sf);
+		return PAM_SYSTEM_ERR;
+	}
+
+	retval = PAM_SUCCESS;
+	for (i = 0; i < count && retval == PAM_SUCCESS; i++) {
+		struct slot record;
+		bool found;
+
+		if (strcmp(paths[i], statepath))
+			continue;
+		if (opened && find_slot(&sf, usernames[i], &record, &found) < 0) {
+			pam_syslog(handle, LOG_ERR,
+			           "Could not read from statefile: %s",
+			           strerror(errno));
+			retval = PAM_SYSTEM_ERR;
+			break;
+		}
+		if (opened && found)
+			slot_usage(&record, day_number(today), &usages[i]);
+		add_journal_usage(entries, entry_count, usernames[i], today,
+		                  &usages[i]);
+	}
+
+	free(entries);
+	if (opened)
+		close_state_file(&sf);
+	return retval;
+}
+
+
+int get_usages(const pam_handle_t *handle, const struct state_options *opts,
+               time_t today, const char *const *usernames, size_t count,
+               struct usage *usages)
+{
+	int retval = PAM_SUCCESS;
+	char **paths;
+	size_t i;
+
+	memset(usages, '\0', count * sizeof(*usages));
+	paths = state_paths_for_users(handle, opts, usernames, count);
+	if (!paths)
+		return PAM_SYSTEM_ERR;
+
+	for (i = 0; i < count && retval == PAM_SUCCESS; i++) {
+		if (first_of_path(paths, i))
+			retval = get_usages_from_path(handle, opts, paths[i],
+			                              paths, usernames, count,
+			                              today, usages);
+	}
+
+	free_state_paths(paths, count);
+	return retval;
+}
+
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+
+/* Drops the records of the users whose records are in statepath, with
+   the journal folded in first so that none of their time is left there,
+   and the rest of the records written out again in a single pass. */
+static int reset_path(const pam_handle_t *handle,
+                      const struct state_options *opts,
+                      const char *statepath, char **paths,
+                      const char *const *usernames, size_t count,
+                      time_t today, uint32_t *reset)
+{
+	const char **names;
+	struct live_record *records;
+	struct state_file sf;
+	size_t i, nnames = 0;
+	int64_t records_count;
+	uint32_t dropped = 0;
+	char *image;
+	int retval = PAM_SUCCESS;
+
+	names = malloc(count * sizeof(*names));
+	if (!names)
+		return PAM_BUF_ERR;
+	for (i = 0; i < count; i++) {
+		if (!strcmp(paths[i], statepath))
+			names[nnames++] = usernames[i];
+	}
+	/* so that each record is checked with a binary search */
+	qsort(names, nnames, sizeof(*names), compare_names);
+
+	if (open_state_path(handle, opts, statepath, &sf, true) < 0) {
+		free(names);
+		return PAM_SYSTEM_ERR;
+	}
+
+	if (fold_journal(handle, opts, &sf, today) < 0) {
+		close_state_file(&sf);
+		free(names);
+		return PAM_SYSTEM_ERR;
+	}
+
+	records_count = read_records(handle, &sf, SLOT_SIZE, &image, &records);
+	if (records_count < 0) {
+		close_state_file(&sf);
+		free(names);
+		return PAM_SYSTEM_ERR;
+	}
+
+	/* an empty name is one that rewriting leaves out */
+	for (i = 0; i < records_count; i++) {
+		if (bsearch(&records[i].name, names, nnames, sizeof(*names),
+		            compare_names))
+		{
+			records[i].name = "";
+			dropped++;
+		}
+	}
+
+	if (dropped && rewrite_state_file(handle, opts, &sf, records,
+	                                  records_count, sf.slots,
+	                                  stale_before(day_number(today))) < 0)
+		retval = PAM_SYSTEM_ERR;
+	else
+		*reset += dropped;
+
+	close_state_file(&sf);
+	free(image);
+	free(records);
+	free(names);
+	return retval;
+}
+
+
+int reset_used_times(const pam_handle_t *handle,
+                     const struct state_options *opts, time_t today,
+                     const char *const *usernames, size_t count,
+                     uint32_t *reset)
+{
+	int retval = PAM_SUCCESS;
+	uint32_t total = 0;
+	char **paths;
+	size_t i;
+
+	paths = state_paths_for_users(handle, opts, usernames, count);
+	if (!paths)
+		return PAM_SYSTEM_ERR;
+
+	for (i = 0; i < count && retval == PAM_SUCCESS; i++) {
+		if (first_of_path(paths, i))
+			retval = reset_path(handle, opts, paths[i], paths,
+			                    usernames, count, today, &total);
+	}
+
+	free_state_paths(paths, count);
+	if (reset)
+		*reset = total;
+	return retval;
+}
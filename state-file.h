@@ -0,0 +1,160 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATE_FILE_H
+#define STATE_FILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <security/pam_modules.h>
+
+#include "time-util.h"
+#include "timing.h"
+
+#define DEFAULT_STATE_PATH LOCALSTATEDIR "/lib/session_times"
+
+enum state_sync {
+	/* leave writeback to the kernel */
+	STATE_SYNC_NONE,
+	/* fdatasync() each update before returning */
+	STATE_SYNC_ALWAYS,
+	/* with use_journal, fdatasync() once per batch of appends, so that a
+	   crash loses at most a batch; otherwise as STATE_SYNC_ALWAYS */
+	STATE_SYNC_BATCHED,
+};
+
+struct state_options {
+	const char *statepath;
+	/* if set, used instead of statepath: a directory of state files,
+	   each holding the records of a share of the users */
+	const char *statedir;
+	/* if set, the socket of a session-timelimitd to go through,
+	   with the state file only used if it can't be reached */
+	const char *daemon_socket;
+	/* access the state file through a shared mapping rather than
+	   with read() and write() */
+	bool use_mmap;
+	/* record time used by appending to a journal next to the state
+	   file, which lookups add in and which is folded into the file
+	   when it grows or the file is compacted */
+	bool use_journal;
+	enum state_sync sync;
+	/* list open sessions next to the state file, for checkpoints to
+	   account for while they run */
+	bool checkpoint;
+	/* if set, where the time spent is added up */
+	struct call_timing *timing;
+};
+
+/* the start of the current local day, as the time_t of that date's
+   midnight in GMT; this is what records are stamped with, and each PAM
+   call works out once and passes to the functions below */
+time_t time_today(void);
+
+/* how many days of time used are kept for each user, today included */
+#define USAGE_DAYS 7
+
+struct usage {
+	/* days[0] is today, days[1] yesterday, and so on */
+	usec_t days[USAGE_DAYS];
+};
+
+/* the time used on each of the days up to today */
+int get_usage_for_user(const pam_handle_t *handle,
+                       const struct state_options *opts,
+                       const char *username, time_t today,
+                       struct usage *usage);
+/* the time used today */
+int get_used_time_for_user(const pam_handle_t *handle,
+                           const struct state_options *opts,
+                           const char *username, time_t today,
+                           usec_t *used_time);
+int set_used_time_for_user(const pam_handle_t *handle,
+                           const struct state_options *opts,
+                           const char *username, time_t today,
+                           usec_t used_time);
+/* Add to the time used today, saturating at USEC_INFINITY.  With a
+   today that is before the user's latest, both this and setting apply
+   to that earlier day, if it is still one of the USAGE_DAYS. */
+int add_used_time_for_user(const pam_handle_t *handle,
+                           const struct state_options *opts,
+                           const char *username, time_t today,
+                           usec_t elapsed_time);
+
+struct used_time_update {
+	const char *username;
+	usec_t elapsed;
+};
+
+/* add each update's time to its user's time used today, as would
+   add_used_time_for_user(), taking each state file's lock once for all of
+   the updates whose users' records it holds */
+int add_used_times(const pam_handle_t *handle,
+                   const struct state_options *opts, time_t today,
+                   const struct used_time_update *updates, size_t count);
+
+/* the usage of each of count users, as get_usage_for_user() would find
+   it, with each state file locked and its journal read once for all of
+   the users whose records it holds */
+int get_usages(const pam_handle_t *handle, const struct state_options *opts,
+               time_t today, const char *const *usernames, size_t count,
+               struct usage *usages);
+
+/* Drop the records of each of count users, so that they start again with
+   none of the last USAGE_DAYS days used.  Each state file is locked once,
+   has its journal folded in, and is rewritten in a single pass; reset,
+   which may be NULL, is set to the number of records dropped. */
+int reset_used_times(const pam_handle_t *handle,
+                     const struct state_options *opts, time_t today,
+                     const char *const *usernames, size_t count,
+                     uint32_t *reset);
+
+/* a user's record, as passed to list_state_records()'s callback */
+struct state_record {
+	const char *username;
+	/* when it was last updated, as from time_today() */
+	time_t day;
+	struct usage usage;
+};
+
+/* returns PAM_SUCCESS to carry on, or the error to stop with */
+typedef int (*state_record_fn)(const struct state_record *record,
+                               void *data);
+
+/* Call fn with every record in the state file, or with statedir each
+   file, with its usage as of today.  Each file is locked once for all of
+   its records, and any journal folded in first. */
+int list_state_records(const pam_handle_t *handle,
+                       const struct state_options *opts, time_t today,
+                       state_record_fn fn, void *data);
+
+/* fdatasync() the state file, or with statedir each file, for callers that
+   batch updates up themselves */
+int sync_state_file(const pam_handle_t *handle,
+                    const struct state_options *opts);
+
+/* drop the records of users who have not been seen in the last USAGE_DAYS
+   days, and shrink the file (or with statedir, each file) to fit the rest;
+   kept and dropped may be NULL */
+int compact_state_file(const pam_handle_t *handle,
+                       const struct state_options *opts, time_t today,
+                       uint32_t *kept, uint32_t *dropped);
+
+#endif
@@ -0,0 +1,838 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks the module's entry points against generated state files and
+ * configs of increasing size, reporting latency percentiles and the read
+ * and write syscalls made per call.  With -w, instead forks that many
+ * workers opening and closing sessions against one state file, reporting
+ * throughput, time spent waiting for the state file lock, and whether any
+ * session time went unrecorded.  With -P, times parse_time() on its own.
+ * Not run by "make check"; build and run it with "make benchmark".
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dlfcn.h>
+
+#include <security/_pam_types.h>
+
+#include "time-util.h"
+
+#define MAX_DATA_ITEMS 8
+#define MAX_MODULE_ARGS 16
+
+/* users looked up in the state benchmarks, who all have config entries */
+#define STATE_CONFIG_ENTRIES 1000
+
+typedef void (*cleanup_fn)(struct pam_handle *pamh, void *data,
+                           int error_status);
+
+typedef struct pam_handle {
+	const char *username;
+	struct {
+		const char *name;
+		void *data;
+		cleanup_fn cleanup;
+	} items[MAX_DATA_ITEMS];
+} pam_handle_t;
+
+typedef int (*pam_module_fn)(pam_handle_t *handle,
+                             int flags,
+                             int argc, const char **argv);
+
+static pam_module_fn acct_mgmt, open_session, close_session;
+static int (*parse_time_fn)(const char *t, usec_t *usec, usec_t default_unit);
+
+/* time spent in flock() by this process, see below */
+static double lock_wait_usec;
+static unsigned long lock_calls;
+
+/* read and write syscalls, and voluntary context switches */
+struct counters {
+	unsigned long long reads;
+	unsigned long long writes;
+	long switches;
+};
+
+struct bench_options {
+	const char *dir;
+	unsigned int iterations;
+	/* passed to every entry point, and to acct_mgmt only */
+	const char *args[MAX_MODULE_ARGS];
+	int argc;
+	const char *acct_args[MAX_MODULE_ARGS];
+	int acct_argc;
+	/* users that contention mode workers share */
+	unsigned int users;
+};
+
+/* what each contention mode worker reports back */
+struct worker_result {
+	double lock_wait_usec;
+	unsigned long lock_calls;
+	unsigned long failures;
+	/* bounds on the session time that should have been recorded; the
+	   module only has one second resolution, so it depends on when the
+	   clock ticked */
+	usec_t expected_min;
+	usec_t expected_max;
+};
+
+
+int pam_set_data(pam_handle_t *pamh, const char *module_data_name,
+                 void *data, cleanup_fn cleanup)
+{
+	int i, slot = -1;
+
+	for (i = 0; i < MAX_DATA_ITEMS; i++) {
+		if (pamh->items[i].name
+		    && !strcmp(pamh->items[i].name, module_data_name))
+		{
+			if (pamh->items[i].cleanup)
+				pamh->items[i].cleanup(pamh,
+				                       pamh->items[i].data,
+				                       PAM_SUCCESS);
+			slot = i;
+			break;
+		}
+		if (!pamh->items[i].name && slot < 0)
+			slot = i;
+	}
+	if (slot < 0)
+		return PAM_BUF_ERR;
+
+	pamh->items[slot].name = module_data_name;
+	pamh->items[slot].data = data;
+	pamh->items[slot].cleanup = cleanup;
+	return PAM_SUCCESS;
+}
+
+
+int pam_get_data(const pam_handle_t *pamh, const char *module_data_name,
+                 const void **data)
+{
+	int i;
+
+	for (i = 0; i < MAX_DATA_ITEMS; i++) {
+		if (pamh->items[i].name
+		    && !strcmp(pamh->items[i].name, module_data_name))
+		{
+			*data = pamh->items[i].data;
+			return PAM_SUCCESS;
+		}
+	}
+	return PAM_NO_MODULE_DATA;
+}
+
+
+int pam_get_item(const pam_handle_t *pamh, int item_type,
+                 const void **item)
+{
+	if (item_type != PAM_USER || !pamh->username)
+		return PAM_BAD_ITEM;
+	*item = pamh->username;
+	return PAM_SUCCESS;
+}
+
+
+void pam_syslog(const pam_handle_t *pamh, int priority,
+                const char *fmt, ...)
+{
+}
+
+
+static double now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+/* The executable is linked with -export-dynamic, so this rather than the
+   libc function is what the module's flock() calls resolve to, which
+   lets the lock waits be timed without instrumenting the module. */
+int flock(int fd, int operation)
+{
+	static int (*real_flock)(int, int);
+	double start;
+	int retval;
+
+	if (!real_flock)
+		real_flock = (int (*)(int, int))dlsym(RTLD_NEXT, "flock");
+
+	start = now_usec();
+	retval = real_flock(fd, operation);
+	lock_wait_usec += now_usec() - start;
+	lock_calls++;
+	return retval;
+}
+
+
+/* as pam_end() would */
+static void reset_handle(pam_handle_t *pamh)
+{
+	int i;
+
+	for (i = 0; i < MAX_DATA_ITEMS; i++) {
+		if (pamh->items[i].name && pamh->items[i].cleanup)
+			pamh->items[i].cleanup(pamh, pamh->items[i].data,
+			                       PAM_SUCCESS);
+	}
+	memset(pamh, '\0', sizeof(*pamh));
+}
+
+
+static void free_data(pam_handle_t *pamh, void *data, int error_status)
+{
+	free(data);
+}
+
+
+static void read_counters(struct counters *counters)
+{
+	char line[128];
+	struct rusage usage;
+	FILE *io;
+
+	counters->reads = counters->writes = 0;
+
+	/* syscr and syscw count every read and write family syscall */
+	io = fopen("/proc/self/io", "r");
+	if (io) {
+		while (fgets(line, sizeof(line), io)) {
+			sscanf(line, "syscr: %llu", &counters->reads);
+			sscanf(line, "syscw: %llu", &counters->writes);
+		}
+		fclose(io);
+	}
+
+	getrusage(RUSAGE_SELF, &usage);
+	counters->switches = usage.ru_nvcsw;
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+
+static void report(const char *name, unsigned int state_users,
+                   unsigned int config_entries, double *samples,
+                   unsigned int count, const struct counters *before,
+                   const struct counters *after)
+{
+	qsort(samples, count, sizeof(*samples), compare_doubles);
+
+	printf("%-13s state=%-8u config=%-7u "
+	       "p50=%8.1fus p90=%8.1fus p99=%8.1fus max=%8.1fus "
+	       "reads/op=%.1f writes/op=%.1f waits/op=%.2f\n",
+	       name, state_users, config_entries,
+	       samples[count / 2], samples[count * 9 / 10],
+	       samples[count * 99 / 100], samples[count - 1],
+	       (double)(after->reads - before->reads) / count,
+	       (double)(after->writes - before->writes) / count,
+	       (double)(after->switches - before->switches) / count);
+}
+
+
+static void bench_path(char *buf, size_t len, const struct bench_options *opts,
+                       const char *name)
+{
+	snprintf(buf, len, "%s/%s", opts->dir, name);
+}
+
+
+/* with a NULL limit, the users get a spread of different limits */
+static int write_config(const char *path, unsigned int entries,
+                        const char *limit)
+{
+	unsigned int i;
+	FILE *config;
+
+	config = fopen(path, "w");
+	if (!config)
+		return -1;
+	for (i = 0; i < entries; i++) {
+		if (limit)
+			fprintf(config, "user%u\t%s\n", i, limit);
+		else
+			fprintf(config, "user%u\t%uh %umin\n", i, 1 + i % 8,
+			        i % 60);
+	}
+	return fclose(config);
+}
+
+
+/* a format 1 file, so that the module converts it on first use rather
+   than this having to know the current format */
+static int write_state(const char *path, unsigned int users)
+{
+	char record[NAME_MAX+1 + sizeof(time_t) + sizeof(usec_t)];
+	time_t now = time(NULL);
+	usec_t used;
+	uint32_t version = 1;
+	unsigned int i;
+	FILE *state;
+
+	state = fopen(path, "w");
+	if (!state)
+		return -1;
+
+	fwrite("Format: ", 1, 8, state);
+	fwrite(&version, sizeof(version), 1, state);
+	for (i = 0; i < users; i++) {
+		memset(record, '\0', sizeof(record));
+		snprintf(record, NAME_MAX+1, "user%u", i);
+		used = (i % 30) * USEC_PER_MINUTE;
+		memcpy(record + NAME_MAX+1, &now, sizeof(time_t));
+		memcpy(record + NAME_MAX+1 + sizeof(time_t), &used,
+		       sizeof(usec_t));
+		fwrite(record, sizeof(record), 1, state);
+	}
+	return fclose(state);
+}
+
+
+/* The session arguments come first, so that acct_mgmt can be given the
+   whole list and the session functions the start of it.  Returns the
+   length of the whole list, and the session part in session_argc. */
+static int build_args(const struct bench_options *opts, const char *path_arg,
+                      const char *state_arg, const char **args,
+                      int *session_argc)
+{
+	int argc = 0, i;
+
+	args[argc++] = state_arg;
+	for (i = 0; i < opts->argc; i++)
+		args[argc++] = opts->args[i];
+	*session_argc = argc;
+	args[argc++] = path_arg;
+	for (i = 0; i < opts->acct_argc; i++)
+		args[argc++] = opts->acct_args[i];
+	return argc;
+}
+
+
+static void run_module(const struct bench_options *opts, const char *config,
+                       const char *state, unsigned int state_users,
+                       unsigned int config_entries, unsigned int lookups)
+{
+	const char *args[2 * MAX_MODULE_ARGS + 2];
+	struct counters before, after;
+	char username[32], path_arg[PATH_MAX + 8], state_arg[PATH_MAX + 16];
+	pam_handle_t pamh;
+	double *samples, start;
+	unsigned int i;
+	int argc, session_argc;
+
+	samples = calloc(opts->iterations, sizeof(*samples));
+	if (!samples) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	snprintf(path_arg, sizeof(path_arg), "path=%s", config);
+	snprintf(state_arg, sizeof(state_arg), "statepath=%s", state);
+	argc = build_args(opts, path_arg, state_arg, args, &session_argc);
+
+	memset(&pamh, '\0', sizeof(pamh));
+
+	/* once to convert the state file and fill any caches */
+	pamh.username = "user0";
+	acct_mgmt(&pamh, 0, argc, args);
+	reset_handle(&pamh);
+
+	srandom(1);
+	read_counters(&before);
+	for (i = 0; i < opts->iterations; i++) {
+		snprintf(username, sizeof(username), "user%ld",
+		         random() % lookups);
+		pamh.username = username;
+		start = now_usec();
+		acct_mgmt(&pamh, 0, argc, args);
+		samples[i] = now_usec() - start;
+		reset_handle(&pamh);
+	}
+	read_counters(&after);
+	report("acct_mgmt", state_users, config_entries, samples,
+	       opts->iterations, &before, &after);
+
+	read_counters(&before);
+	for (i = 0; i < opts->iterations; i++) {
+		time_t *start_time = malloc(sizeof(time_t));
+		usec_t *remaining = malloc(sizeof(usec_t));
+
+		if (!start_time || !remaining) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		*start_time = time(NULL) - 60;
+		*remaining = USEC_PER_HOUR;
+		pam_set_data(&pamh, "timelimit.session_start", start_time,
+		             free_data);
+		pam_set_data(&pamh, "timelimit.remaining_usec", remaining,
+		             free_data);
+
+		snprintf(username, sizeof(username), "user%ld",
+		         random() % lookups);
+		pamh.username = username;
+		start = now_usec();
+		close_session(&pamh, 0, session_argc, args);
+		samples[i] = now_usec() - start;
+		reset_handle(&pamh);
+	}
+	read_counters(&after);
+	report("close_session", state_users, config_entries, samples,
+	       opts->iterations, &before, &after);
+
+	free(samples);
+}
+
+
+static void bench_state(const struct bench_options *opts, unsigned int users)
+{
+	char config[PATH_MAX], state[PATH_MAX];
+
+	bench_path(config, sizeof(config), opts, "bench.conf");
+	bench_path(state, sizeof(state), opts, "bench.state");
+
+	if (write_config(config, STATE_CONFIG_ENTRIES, NULL) < 0
+	    || write_state(state, users) < 0)
+	{
+		fprintf(stderr, "could not write to %s: %s\n", opts->dir,
+		        strerror(errno));
+		exit(1);
+	}
+
+	run_module(opts, config, state, users, STATE_CONFIG_ENTRIES,
+	           users < STATE_CONFIG_ENTRIES ? users : STATE_CONFIG_ENTRIES);
+
+	unlink(config);
+	unlink(state);
+}
+
+
+static void bench_config(const struct bench_options *opts,
+                         unsigned int entries)
+{
+	char config[PATH_MAX], cache[PATH_MAX], state[PATH_MAX];
+
+	bench_path(config, sizeof(config), opts, "bench.conf");
+	bench_path(cache, sizeof(cache), opts, "bench.conf.cache");
+	bench_path(state, sizeof(state), opts, "bench.state");
+
+	unlink(state);
+	if (write_config(config, entries, NULL) < 0) {
+		fprintf(stderr, "could not write to %s: %s\n", opts->dir,
+		        strerror(errno));
+		exit(1);
+	}
+
+	run_module(opts, config, state, 0, entries, entries);
+
+	unlink(config);
+	unlink(cache);
+	unlink(state);
+}
+
+
+static void run_worker(const struct bench_options *opts, const char **args,
+                       int session_argc, unsigned int worker,
+                       double *samples, struct worker_result *result)
+{
+	char username[32];
+	pam_handle_t pamh;
+	unsigned int i;
+
+	memset(&pamh, '\0', sizeof(pamh));
+	lock_wait_usec = 0;
+	lock_calls = 0;
+
+	for (i = 0; i < opts->iterations; i++) {
+		usec_t *remaining = malloc(sizeof(usec_t));
+		time_t *start_time, before, after;
+		double start;
+		int retval;
+
+		if (!remaining) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		*remaining = USEC_PER_HOUR;
+
+		snprintf(username, sizeof(username), "user%u",
+		         (worker + i) % opts->users);
+		pamh.username = username;
+
+		start = now_usec();
+		retval = open_session(&pamh, 0, session_argc, args);
+		samples[i] = now_usec() - start;
+		if (retval != PAM_SUCCESS
+		    || pam_get_data(&pamh, "timelimit.session_start",
+		                    (const void **)&start_time) != PAM_SUCCESS)
+		{
+			result->failures++;
+			free(remaining);
+			reset_handle(&pamh);
+			continue;
+		}
+
+		/* each session lasts a minute, as far as the module knows */
+		*start_time -= 60;
+		pam_set_data(&pamh, "timelimit.remaining_usec", remaining,
+		             free_data);
+
+		before = time(NULL);
+		start = now_usec();
+		retval = close_session(&pamh, 0, session_argc, args);
+		samples[i] += now_usec() - start;
+		after = time(NULL);
+
+		if (retval == PAM_SUCCESS) {
+			result->expected_min += (before - *start_time)
+			                        * USEC_PER_SEC;
+			result->expected_max += (after - *start_time)
+			                        * USEC_PER_SEC;
+		} else
+			result->failures++;
+		reset_handle(&pamh);
+	}
+
+	result->lock_wait_usec = lock_wait_usec;
+	result->lock_calls = lock_calls;
+}
+
+
+/* the used time recorded for all the users, worked back from what is left
+   of their limit */
+static usec_t recorded_time(const struct bench_options *opts,
+                            const char **args, int argc, usec_t limit)
+{
+	const usec_t *remaining;
+	char username[32];
+	pam_handle_t pamh;
+	usec_t total = 0;
+	unsigned int i;
+
+	memset(&pamh, '\0', sizeof(pamh));
+	for (i = 0; i < opts->users; i++) {
+		snprintf(username, sizeof(username), "user%u", i);
+		pamh.username = username;
+		if (acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS
+		    && pam_get_data(&pamh, "timelimit.remaining_usec",
+		                    (const void **)&remaining) == PAM_SUCCESS)
+			total += limit - *remaining;
+		else
+			total += limit;
+		reset_handle(&pamh);
+	}
+	return total;
+}
+
+
+static void bench_contention(const struct bench_options *opts,
+                             unsigned int workers)
+{
+	const char *args[2 * MAX_MODULE_ARGS + 2];
+	char config[PATH_MAX], state[PATH_MAX];
+	char path_arg[PATH_MAX + 8], state_arg[PATH_MAX + 16];
+	struct worker_result *results, total = { 0 };
+	size_t sessions = (size_t)workers * opts->iterations;
+	size_t shared_size;
+	double *samples, start, elapsed, lock_max = 0;
+	unsigned int i;
+	usec_t recorded;
+	int argc, session_argc;
+	void *shared;
+
+	bench_path(config, sizeof(config), opts, "bench.conf");
+	bench_path(state, sizeof(state), opts, "bench.state");
+	snprintf(path_arg, sizeof(path_arg), "path=%s", config);
+	snprintf(state_arg, sizeof(state_arg), "statepath=%s", state);
+	argc = build_args(opts, path_arg, state_arg, args, &session_argc);
+
+	unlink(state);
+	if (write_config(config, opts->users, "10000h") < 0) {
+		fprintf(stderr, "could not write to %s: %s\n", opts->dir,
+		        strerror(errno));
+		exit(1);
+	}
+
+	/* the workers' results and latencies, visible to the parent */
+	shared_size = workers * sizeof(*results) + sessions * sizeof(*samples);
+	shared = mmap(NULL, shared_size, PROT_READ|PROT_WRITE,
+	              MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	results = shared;
+	samples = (double *)(results + workers);
+
+	start = now_usec();
+	for (i = 0; i < workers; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			fprintf(stderr, "fork failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (pid == 0) {
+			run_worker(opts, args, session_argc, i,
+			           samples + (size_t)i * opts->iterations,
+			           &results[i]);
+			_exit(0);
+		}
+	}
+	while (wait(NULL) > 0)
+		;
+	elapsed = now_usec() - start;
+
+	for (i = 0; i < workers; i++) {
+		double lock_avg = results[i].lock_calls
+		                  ? results[i].lock_wait_usec
+		                    / results[i].lock_calls : 0;
+
+		total.lock_wait_usec += results[i].lock_wait_usec;
+		total.lock_calls += results[i].lock_calls;
+		total.failures += results[i].failures;
+		total.expected_min += results[i].expected_min;
+		total.expected_max += results[i].expected_max;
+		if (lock_avg > lock_max)
+			lock_max = lock_avg;
+	}
+
+	recorded = recorded_time(opts, args, argc, 10000 * USEC_PER_HOUR);
+
+	qsort(samples, sessions, sizeof(*samples), compare_doubles);
+	printf("contention    workers=%-4u users=%-6u sessions=%zu "
+	       "throughput=%.0f/s session p50=%.1fus p99=%.1fus "
+	       "lock wait avg=%.1fus worst worker avg=%.1fus\n",
+	       workers, opts->users, sessions, sessions / (elapsed / 1e6),
+	       samples[sessions / 2], samples[sessions * 99 / 100],
+	       total.lock_calls ? total.lock_wait_usec / total.lock_calls : 0,
+	       lock_max);
+	printf("              recorded=%.0fs expected=%.0fs-%.0fs "
+	       "lost=%.0fs failed calls=%lu\n",
+	       (double)recorded / USEC_PER_SEC,
+	       (double)total.expected_min / USEC_PER_SEC,
+	       (double)total.expected_max / USEC_PER_SEC,
+	       recorded < total.expected_min
+	       ? (double)(total.expected_min - recorded) / USEC_PER_SEC : 0,
+	       total.failures);
+
+	munmap(shared, shared_size);
+	unlink(config);
+	unlink(state);
+}
+
+
+static void bench_parse_time(const struct bench_options *opts)
+{
+	static const char *specs[] = {
+		"5h", "5h 12m", "90min", "1 hour 30 minutes", "2d 3h 4m 5s",
+		"250ms", "1.5 weeks", "infinity",
+	};
+	/* enough calls per sample to dwarf the clock overhead */
+	const unsigned int batch = 1000;
+	double *samples, start;
+	unsigned int i, j, k;
+	usec_t usec;
+
+	samples = calloc(opts->iterations, sizeof(*samples));
+	if (!samples) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {
+		for (j = 0; j < opts->iterations; j++) {
+			start = now_usec();
+			for (k = 0; k < batch; k++)
+				parse_time_fn(specs[i], &usec, USEC_PER_SEC);
+			samples[j] = (now_usec() - start) * 1000 / batch;
+		}
+		qsort(samples, opts->iterations, sizeof(*samples),
+		      compare_doubles);
+		printf("parse_time    %-20s p50=%7.1fns p99=%7.1fns\n",
+		       specs[i], samples[opts->iterations / 2],
+		       samples[opts->iterations * 99 / 100]);
+	}
+
+	free(samples);
+}
+
+
+/* parses a comma-separated list of sizes into sizes, returning the count */
+static int parse_sizes(const char *arg, unsigned int *sizes, int max)
+{
+	char *end;
+	int count = 0;
+
+	while (*arg && count < max) {
+		unsigned long size = strtoul(arg, &end, 10);
+
+		if (end == arg || size == 0 || size > UINT32_MAX / 2
+		    || (*end && *end != ','))
+			return -1;
+		sizes[count++] = size;
+		arg = *end ? end + 1 : end;
+	}
+	return count;
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+	        "Usage: %s [-n ITERATIONS] [-s USERS,...] [-c ENTRIES,...]\n"
+	        "          [-d DIR] [-a MODULE_ARG]... [-A MODULE_ARG]...\n"
+	        "       %s -w WORKERS,... [-n ITERATIONS] [-u USERS]\n"
+	        "          [-d DIR] [-a MODULE_ARG]... [-A MODULE_ARG]...\n"
+	        "       %s -P [-n ITERATIONS]\n"
+	        "\n"
+	        "  -n  calls of each entry point per run, or sessions per\n"
+	        "      worker (default 1000)\n"
+	        "  -s  state file sizes in users (default 1000,10000,100000)\n"
+	        "  -c  config sizes in entries (default 1000,10000,100000)\n"
+	        "  -w  numbers of concurrent workers to run the contention\n"
+	        "      benchmark with, instead of the scaling benchmarks\n"
+	        "  -u  users the workers open sessions for (default 1)\n"
+	        "  -P  time parse_time() instead, in batches of 1000 calls\n"
+	        "  -d  directory for the generated files (default .)\n"
+	        "  -a  extra module argument, such as statemmap\n"
+	        "  -A  extra module argument for acct_mgmt only, such as\n"
+	        "      configcache\n",
+	        name, name, name);
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned int state_sizes[16] = { 1000, 10000, 100000 };
+	unsigned int config_sizes[16] = { 1000, 10000, 100000 };
+	unsigned int worker_counts[16];
+	int state_count = 3, config_count = 3, worker_count = 0;
+	bool parse_only = false;
+	struct bench_options opts = { .dir = ".", .iterations = 1000,
+	                              .users = 1 };
+	void *handle;
+	int i, c;
+
+	while ((c = getopt(argc, argv, "n:s:c:w:u:Pd:a:A:h")) != -1) {
+		switch (c) {
+		case 'n':
+			opts.iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			state_count = parse_sizes(optarg, state_sizes, 16);
+			break;
+		case 'c':
+			config_count = parse_sizes(optarg, config_sizes, 16);
+			break;
+		case 'w':
+			worker_count = parse_sizes(optarg, worker_counts, 16);
+			break;
+		case 'u':
+			opts.users = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			parse_only = true;
+			break;
+		case 'd':
+			opts.dir = optarg;
+			break;
+		case 'a':
+			if (opts.argc == MAX_MODULE_ARGS) {
+				usage(argv[0]);
+				return 1;
+			}
+			opts.args[opts.argc++] = optarg;
+			break;
+		case 'A':
+			if (opts.acct_argc == MAX_MODULE_ARGS) {
+				usage(argv[0]);
+				return 1;
+			}
+			opts.acct_args[opts.acct_argc++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+	if (optind != argc || opts.iterations == 0 || opts.users == 0
+	    || state_count < 0 || config_count < 0 || worker_count < 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	handle = dlopen("../.libs/pam_session_timelimit.so", RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "Failed to load PAM module: %s\n", dlerror());
+		return 1;
+	}
+
+	acct_mgmt = (pam_module_fn) dlsym(handle, "pam_sm_acct_mgmt");
+	open_session = (pam_module_fn) dlsym(handle, "pam_sm_open_session");
+	close_session = (pam_module_fn) dlsym(handle, "pam_sm_close_session");
+	parse_time_fn = dlsym(handle, "parse_time");
+	if (!acct_mgmt || !open_session || !close_session || !parse_time_fn) {
+		fprintf(stderr, "Failed to resolve PAM symbol: %s\n",
+		        dlerror());
+		return 1;
+	}
+
+	if (parse_only)
+		bench_parse_time(&opts);
+	else if (worker_count) {
+		for (i = 0; i < worker_count; i++)
+			bench_contention(&opts, worker_counts[i]);
+	} else {
+		for (i = 0; i < state_count; i++)
+			bench_state(&opts, state_sizes[i]);
+		for (i = 0; i < config_count; i++)
+			bench_config(&opts, config_sizes[i]);
+	}
+
+	dlclose(handle);
+	return 0;
+}
@@ -0,0 +1,591 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Feeds inputs to parse_time(), parse_config_line() and
+ * parse_config_file(), checking that each agrees with the reference
+ * parsers in reference.c and that what they return holds together: a
+ * parsed timespan formats and parses back to itself, and a window is no
+ * longer than the state keeps.  Any disagreement prints the input and
+ * aborts.
+ *
+ *   fuzz [-n COUNT] [-s SEED]          each target, on COUNT random inputs
+ *   fuzz [-n COUNT] [-s SEED] TARGET   the one target, likewise
+ *   fuzz TARGET FILE...                the target, on each file once
+ *
+ * "make check" runs the first, and "make fuzz-run" passes it FUZZ_ARGS.
+ * The last is for afl-fuzz, as "afl-fuzz -i seeds -o out -- ./fuzz time
+ * @@" with the tree built by afl-cc, and for replaying what it finds.
+ * Built with -DLIBFUZZER and -fsanitize=fuzzer, main() is left to
+ * libFuzzer instead, with the target named by FUZZ_TARGET; configure
+ * the tree with -fsanitize=fuzzer-no-link in CFLAGS so that the parsers
+ * themselves are instrumented.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_ext.h>
+
+#include "config-file.h"
+#include "reference.h"
+#include "time-util.h"
+
+#define DEFAULT_COUNT 20000
+/* parse_config_file() turns away lines longer than this */
+#define MAX_LINE_LENGTH 1023
+/* big enough for a few lines longer than that */
+#define MAX_INPUT 4096
+
+struct fuzz_target {
+	const char *name;
+	void (*run)(const uint8_t *data, size_t size);
+	size_t (*generate)(char *buf, size_t size, unsigned int *seed);
+};
+
+/* the input being run, for mismatch() to show */
+static const uint8_t *current_data;
+static size_t current_size;
+static const char *current_target;
+
+/* the config file target's input, written to a memfd */
+static int config_fd = -1;
+static char config_path[64];
+
+
+/* the parsers report errors with pam_syslog(), which may as well go */
+void pam_syslog(const pam_handle_t *pamh __attribute__((unused)),
+                int priority __attribute__((unused)),
+                const char *fmt __attribute__((unused)), ...)
+{
+}
+
+
+static void mismatch(const char *fmt, ...)
+{
+	va_list args;
+	size_t i;
+
+	fprintf(stderr, "%s: ", current_target);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputs("\ninput: \"", stderr);
+	for (i = 0; i < current_size; i++) {
+		uint8_t c = current_data[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(stderr, "\\%c", c);
+		else if (c >= ' ' && c < 0x7f)
+			fputc(c, stderr);
+		else
+			fprintf(stderr, "\\x%02x", c);
+	}
+	fputs("\"\n", stderr);
+	abort();
+}
+
+
+/* the input as a string, which ends at its first NUL if it has one */
+static char *input_string(const uint8_t *data, size_t size)
+{
+	char *s = malloc(size + 1);
+
+	if (!s)
+		return NULL;
+	memcpy(s, data, size);
+	s[size] = '\0';
+	return s;
+}
+
+
+static void run_time(const uint8_t *data, size_t size)
+{
+	char *spec = input_string(data, size);
+	char formatted[FORMAT_TIMESPAN_MAX];
+	usec_t usec = 0, expected = 0, again = 0;
+	int ret, expected_ret;
+
+	if (!spec)
+		return;
+
+	ret = parse_time(spec, &usec, USEC_PER_SEC);
+	expected_ret = reference_parse_time(spec, &expected, USEC_PER_SEC);
+	free(spec);
+
+	if (ret != expected_ret)
+		mismatch("parse_time() returned %d, the reference %d",
+		         ret, expected_ret);
+	if (ret < 0)
+		return;
+	if (usec != expected)
+		mismatch("parse_time() gave %llu, the reference %llu",
+		         (unsigned long long) usec,
+		         (unsigned long long) expected);
+
+	/* near the top of the range, format_timespan() can write more
+	   years than parse_time() takes in a single number */
+	if (usec >= USEC_INFINITY / 2 && usec != USEC_INFINITY)
+		return;
+	if (!format_timespan(formatted, sizeof(formatted), usec, 1))
+		mismatch("%llu doesn't format", (unsigned long long) usec);
+	if (parse_time(formatted, &again, USEC_PER_SEC) < 0 || again != usec)
+		mismatch("%llu formats as \"%s\", which doesn't parse back",
+		         (unsigned long long) usec, formatted);
+}
+
+
+static size_t newline_or_nul(const uint8_t *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] == '\n' || data[i] == '\0')
+			break;
+	}
+	return i;
+}
+
+
+static bool same_string(const char *a, const char *b)
+{
+	return (!a && !b) || (a && b && !strcmp(a, b));
+}
+
+
+/* Runs the first line of the input, as parse_config_file() would hand it
+   over: without its newline, and no longer than it lets through. */
+static void run_config_line(const uint8_t *data, size_t size)
+{
+	char line[MAX_LINE_LENGTH + 1], reference_line[MAX_LINE_LENGTH + 2];
+	char *user, *limit, *expected_user, *expected_limit;
+	size_t length = newline_or_nul(data, size);
+	int ret, expected_ret;
+
+	if (length >= MAX_LINE_LENGTH)
+		length = MAX_LINE_LENGTH - 1;
+	memcpy(line, data, length);
+	line[length] = '\0';
+	memcpy(reference_line, data, length);
+	reference_line[length] = '\n';
+	reference_line[length + 1] = '\0';
+
+	ret = parse_config_line(line, length, &user, &limit);
+	expected_ret = reference_parse_config_line(reference_line,
+	                                           &expected_user,
+	                                           &expected_limit);
+	if (ret != expected_ret)
+		mismatch("parse_config_line() returned %d, the reference %d",
+		         ret, expected_ret);
+	if (ret == PAM_SUCCESS && (!same_string(user, expected_user)
+	                           || !same_string(limit, expected_limit)))
+		mismatch("parse_config_line() gave \"%s\" \"%s\", "
+		         "the reference \"%s\" \"%s\"",
+		         user ? user : "(null)", limit ? limit : "(null)",
+		         expected_user ? expected_user : "(null)",
+		         expected_limit ? expected_limit : "(null)");
+	free(expected_user);
+	free(expected_limit);
+}
+
+
+static bool same_limits(const struct config_limits *a,
+                        const struct config_limits *b)
+{
+	return a->day == b->day && a->week == b->week
+	       && a->window == b->window && a->window_days == b->window_days;
+}
+
+
+static void run_config_file(const uint8_t *data, size_t size)
+{
+	struct config_entry *table, *expected;
+	int ret, expected_ret;
+	size_t i;
+
+	if (config_fd < 0) {
+		config_fd = memfd_create("fuzz-config", 0);
+		if (config_fd < 0) {
+			perror("memfd_create");
+			exit(1);
+		}
+		snprintf(config_path, sizeof(config_path), "/proc/self/fd/%d",
+		         config_fd);
+	}
+	if (ftruncate(config_fd, 0) < 0
+	    || pwrite(config_fd, data, size, 0) != (ssize_t) size) {
+		perror("writing config");
+		exit(1);
+	}
+
+	ret = parse_config_file(NULL, config_path, &table);
+	expected_ret = reference_parse_config_file(config_path,
+	                                           parse_config_limits,
+	                                           &expected);
+	if (ret != expected_ret)
+		mismatch("parse_config_file() returned %d, the reference %d",
+		         ret, expected_ret);
+	if (ret != PAM_SUCCESS)
+		return;
+
+	for (i = 0; table[i].user && expected[i].user; i++) {
+		const struct config_limits *limits = &table[i].limits;
+
+		if (strcmp(table[i].user, expected[i].user))
+			mismatch("entry %zu is for \"%s\", the reference's "
+			         "for \"%s\"", i, table[i].user,
+			         expected[i].user);
+		if (!same_limits(limits, &expected[i].limits))
+			mismatch("entry %zu's limits differ from the "
+			         "reference's", i);
+		if (limits->window_days > CONFIG_MAX_WINDOW_DAYS
+		    || (!limits->window_days
+		        && limits->window != USEC_INFINITY))
+			mismatch("entry %zu has a window of %llu over %u days",
+			         i, (unsigned long long) limits->window,
+			         limits->window_days);
+	}
+	if (table[i].user || expected[i].user)
+		mismatch("%s entries than the reference",
+		         table[i].user ? "more" : "fewer");
+
+	free_config_file(table);
+	reference_free_config_file(expected);
+}
+
+
+static unsigned int pick(unsigned int n, unsigned int *seed)
+{
+	return rand_r(seed) % n;
+}
+
+
+/* appends s if it fits, returning the new length */
+static size_t append(char *buf, size_t size, size_t len, const char *s)
+{
+	size_t n = strlen(s);
+
+	if (len + n >= size)
+		return len;
+	memcpy(buf + len, s, n + 1);
+	return len + n;
+}
+
+
+static size_t append_time_spec(char *buf, size_t size, size_t len,
+                               unsigned int *seed)
+{
+	static const char *numbers[] = {
+		"0", "1", "5", "12", "90", "007", "1.5", "0.25", "3.14159",
+		".5", "1.", "-1", "-0", "+1", "30000000", "9223372036854775807",
+		"18446744073709551615", "99999999999999999999",
+	};
+	static const char *units[] = {
+		"", "", "s", "sec", "second", "seconds", "m", "min", "minute",
+		"minutes", "h", "hr", "hour", "hours", "d", "day", "days", "w",
+		"week", "weeks", "M", "month", "months", "y", "year", "years",
+		"ms", "msec", "us", "usec", "\xc2\xb5s", "\xc2", "mo", "hoge",
+		"S", "H",
+	};
+	static const char *spaces[] = {
+		"", "", "", " ", " ", "\t", "  ", "\r", "\f",
+	};
+	unsigned int tokens = 1 + pick(4, seed), i;
+
+	switch (pick(16, seed)) {
+	case 0:
+		return append(buf, size, len, "infinity");
+	case 1:
+		return append(buf, size, len, spaces[pick(9, seed)]);
+	case 2: {
+		/* anything at all */
+		char junk[2] = { 1 + pick(255, seed), '\0' };
+
+		len = append(buf, size, len, junk);
+		break;
+	}
+	}
+
+	for (i = 0; i < tokens; i++) {
+		len = append(buf, size, len, spaces[pick(9, seed)]);
+		len = append(buf, size, len, numbers[pick(18, seed)]);
+		len = append(buf, size, len, spaces[pick(9, seed)]);
+		len = append(buf, size, len, units[pick(36, seed)]);
+	}
+	return len;
+}
+
+
+static size_t random_time_spec(char *buf, size_t size, unsigned int *seed)
+{
+	buf[0] = '\0';
+	return append_time_spec(buf, size, 0, seed);
+}
+
+
+static size_t append_limit(char *buf, size_t size, size_t len,
+                           unsigned int *seed)
+{
+	static const char *periods[] = {
+		"day", "week", "1days", "3days", "7days", "8days", "0days",
+		"days", "3day", "", "month",
+	};
+	unsigned int count, i;
+
+	if (pick(2, seed))
+		return append_time_spec(buf, size, len, seed);
+
+	count = 1 + pick(3, seed);
+	for (i = 0; i < count; i++) {
+		if (i)
+			len = append(buf, size, len, pick(4, seed) ? " " : "");
+		len = append_time_spec(buf, size, len, seed);
+		len = append(buf, size, len, "/");
+		len = append(buf, size, len, periods[pick(11, seed)]);
+	}
+	return len;
+}
+
+
+static size_t random_config_file(char *buf, size_t size, unsigned int *seed)
+{
+	static const char *users[] = {
+		"ted", "tina", "*", "@", "@staff", "a@b", "root", "x",
+	};
+	static const char *separators[] = {
+		" ", "\t", "  \t", "\t\t", "\v", "",
+	};
+	unsigned int lines = pick(8, seed), i;
+	size_t len = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < lines; i++) {
+		switch (pick(20, seed)) {
+		case 0:
+			len = append(buf, size, len, "# just a comment");
+			break;
+		case 1:
+			len = append(buf, size, len, " \t");
+			break;
+		case 2:
+			/* around the longest line there can be */
+			while (len < size - 1 && pick(1100, seed))
+				buf[len++] = 'a' + pick(26, seed);
+			buf[len] = '\0';
+			break;
+		case 3:
+			/* a NUL at the start of a line */
+			if (len < size - 1)
+				buf[len++] = '\0';
+			break;
+		default:
+			if (!pick(10, seed))
+				len = append(buf, size, len, " ");
+			len = append(buf, size, len, users[pick(8, seed)]);
+			len = append(buf, size, len, separators[pick(6, seed)]);
+			len = append_limit(buf, size, len, seed);
+			if (!pick(5, seed))
+				len = append(buf, size, len, " # comment");
+			if (!pick(16, seed) && len < size - 2) {
+				/* a NUL partway through */
+				buf[len++] = '\0';
+				buf[len++] = 'x';
+				buf[len] = '\0';
+			}
+			if (!pick(8, seed))
+				len = append(buf, size, len, "\r");
+			break;
+		}
+		/* the last line without its newline, sometimes */
+		if (i < lines - 1 || pick(8, seed))
+			len = append(buf, size, len, "\n");
+	}
+	return len;
+}
+
+
+static const struct fuzz_target targets[] = {
+	{ "time", run_time, random_time_spec },
+	{ "config-line", run_config_line, random_config_file },
+	{ "config-file", run_config_file, random_config_file },
+};
+
+#define TARGET_COUNT (sizeof(targets) / sizeof(targets[0]))
+
+
+static const struct fuzz_target *find_target(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < TARGET_COUNT; i++) {
+		if (!strcmp(targets[i].name, name))
+			return &targets[i];
+	}
+	return NULL;
+}
+
+
+static void run_one(const struct fuzz_target *target, const uint8_t *data,
+                    size_t size)
+{
+	current_target = target->name;
+	current_data = data;
+	current_size = size;
+	target->run(data, size);
+}
+
+
+#ifdef LIBFUZZER
+
+static const struct fuzz_target *libfuzzer_target;
+
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	const char *name = getenv("FUZZ_TARGET");
+
+	libfuzzer_target = name ? find_target(name) : NULL;
+	if (!libfuzzer_target) {
+		fprintf(stderr, "Set FUZZ_TARGET to time, config-line or "
+		        "config-file\n");
+		exit(1);
+	}
+	return 0;
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	run_one(libfuzzer_target, data, size);
+	return 0;
+}
+
+#else
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void run_random(const struct fuzz_target *target, unsigned long count,
+                       unsigned int seed)
+{
+	static char buf[MAX_INPUT];
+	unsigned long i;
+	double start, elapsed;
+
+	start = now_sec();
+	for (i = 0; i < count; i++) {
+		size_t size = target->generate(buf, sizeof(buf), &seed);
+
+		run_one(target, (const uint8_t *)buf, size);
+	}
+	elapsed = now_sec() - start;
+	printf("%-12s %lu inputs in %.3fs, %.0f inputs/s\n", target->name,
+	       count, elapsed, elapsed > 0 ? count / elapsed : 0);
+	/* before a later target can abort */
+	fflush(stdout);
+}
+
+
+static int run_file(const struct fuzz_target *target, const char *path)
+{
+	static uint8_t buf[1 << 20];
+	size_t size;
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	size = fread(buf, 1, sizeof(buf), f);
+	if (ferror(f)) {
+		fprintf(stderr, "%s: read error\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	run_one(target, buf, size);
+	return 0;
+}
+
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "usage: %s [-n COUNT] [-s SEED] [TARGET [FILE...]]\n"
+	        "targets: time, config-line, config-file\n", program);
+	exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+	const struct fuzz_target *target;
+	unsigned long count = DEFAULT_COUNT;
+	unsigned int seed = 1;
+	int opt, i, failed = 0;
+	size_t t;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc) {
+		for (t = 0; t < TARGET_COUNT; t++)
+			run_random(&targets[t], count, seed);
+		return 0;
+	}
+
+	target = find_target(argv[optind]);
+	if (!target)
+		usage(argv[0]);
+	if (optind + 1 == argc) {
+		run_random(target, count, seed);
+		return 0;
+	}
+	for (i = optind + 1; i < argc; i++) {
+		if (run_file(target, argv[i]) < 0)
+			failed = 1;
+	}
+	return failed;
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <stddef.h>
+
+#include "config-file.h"
+#include "time-util.h"
+
+/* The parsers as they were before they were made faster, kept as the
+   reference that the module's own must agree with.  They are only
+   changed where the module's behaviour is changed on purpose, never to
+   make them faster. */
+
+/* parse_time() with a linear search of the suffix table */
+int reference_parse_time(const char *t, usec_t *usec, usec_t default_unit);
+
+/* Parses a line as read by fgets(), newline and all.  On success *user
+   and *limit are copies, which the caller must free, or both NULL for a
+   blank or comment-only line. */
+int reference_parse_config_line(char *line, char **user, char **limit);
+
+/* Parses the file a line at a time with fgets(), into a table like
+   parse_config_file()'s.  The reference predates periods, so limits with
+   a "/" in them are handed to parse_periods. */
+int reference_parse_config_file(const char *path,
+                                int (*parse_periods)(char *limit,
+                                                     struct config_limits *),
+                                struct config_entry **user_table);
+void reference_free_config_file(struct config_entry *user_table);
+
+#endif
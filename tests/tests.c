@@ -18,16 +18,26 @@
 
 #include "config.h"
 
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
 #include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <dirent.h>
 #include <dlfcn.h>
 
 #include <security/_pam_types.h>
@@ -39,11 +49,13 @@
 typedef struct pam_handle {
 	char *username;
 	char *limit;
+	usec_t *remaining;
 	time_t *start_time;
 	unsigned int get_item_calls;
 	unsigned int get_data_calls;
 	unsigned int set_data_calls;
 	unsigned int syslog_calls;
+	char last_message[512];
 } pam_handle_t;
 
 typedef int (*pam_module_fn)(pam_handle_t *handle,
@@ -51,6 +63,8 @@ typedef int (*pam_module_fn)(pam_handle_t *handle,
                              int argc, const char **argv);
 
 static pam_module_fn acct_mgmt, open_session, close_session;
+/* not a PAM entry point, but exported all the same */
+static int (*parse_time_fn)(const char *t, usec_t *usec, usec_t default_unit);
 static pam_handle_t pamh;
 
 
@@ -63,6 +77,10 @@ int pam_set_data(pam_handle_t *pamh, const char *module_data_name,
 	if (!strcmp(module_data_name,"systemd.runtime_max_sec")) {
 		pamh->limit = data;
 		return PAM_SUCCESS;
+	} else if (!strcmp(module_data_name,"timelimit.remaining_usec")) {
+		free(pamh->remaining);
+		pamh->remaining = data;
+		return PAM_SUCCESS;
 	} else if (!strcmp(module_data_name,"timelimit.session_start")) {
 		pamh->start_time = data;
 		return PAM_SUCCESS;
@@ -79,6 +97,9 @@ int pam_get_data(pam_handle_t *pamh, const char *module_data_name,
 	if (!strcmp(module_data_name,"systemd.runtime_max_sec")) {
 		*data = pamh->limit;
 		return PAM_SUCCESS;
+	} else if (!strcmp(module_data_name,"timelimit.remaining_usec")) {
+		*data = pamh->remaining;
+		return PAM_SUCCESS;
 	} else if (!strcmp(module_data_name,"timelimit.session_start")) {
 		*data = pamh->start_time;
 		return PAM_SUCCESS;
@@ -114,6 +135,11 @@ void pam_syslog(pam_handle_t *pamh, int priority,
 	va_end(argp);
 	printf("\n");
 */
+	va_list argp;
+
+	va_start(argp, fmt);
+	vsnprintf(pamh->last_message, sizeof(pamh->last_message), fmt, argp);
+	va_end(argp);
 
 	pamh->syslog_calls++;
 }
@@ -124,13 +150,55 @@ static void setup_pam_state(void) {
 }
 
 
+/* returns the number of files removed from data/statedir */
+static int remove_state_dir(void) {
+	struct dirent *entry;
+	char path[PATH_MAX];
+	int removed = 0;
+	DIR *dir;
+
+	dir = opendir("data/statedir");
+	if (!dir)
+		return 0;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "data/statedir/%s", entry->d_name);
+		if (unlink(path) == 0)
+			removed++;
+	}
+	closedir(dir);
+	rmdir("data/statedir");
+	return removed;
+}
+
+
 static void cleanup_pam_state(void) {
+	remove_state_dir();
 	unlink("data/state");
+	/* left for the next test to replace, so that its config file can't
+	   be given the inode of this one at the same size and timestamps,
+	   and be taken for it */
+	unlink("data/generated.cache");
+	unlink("data/daemon.socket");
+	unlink("data/state.journal");
+	unlink("data/state.sessions");
 	free(pamh.limit);
+	free(pamh.remaining);
 	free(pamh.start_time);
 }
 
 
+/* forget the limit set by a previous acct_mgmt(), as a new PAM
+   transaction would */
+static void clear_limit(void) {
+	free(pamh.limit);
+	free(pamh.remaining);
+	pamh.limit = NULL;
+	pamh.remaining = NULL;
+}
+
+
 static int initialize_state_file(char *username, time_t base_time,
                                  usec_t timeval)
 {
@@ -169,6 +237,78 @@ static int initialize_state_file(char *username, time_t base_time,
 }
 
 
+/* add another record to a state file made by initialize_state_file() */
+static int append_state_record(const char *username, time_t base_time,
+                               usec_t timeval)
+{
+	char buf[NAME_MAX+1+sizeof(time_t)+sizeof(usec_t)];
+	ssize_t bytes;
+	int fd;
+
+	fd = open("data/state", O_WRONLY | O_APPEND);
+	if (fd < 0)
+		return -1;
+
+	memset(buf, '\0', sizeof(buf));
+	strncpy(buf, username, NAME_MAX+1);
+	*((time_t *)(buf+NAME_MAX+1)) = base_time;
+	*((usec_t *)(buf+NAME_MAX+1+sizeof(time_t))) = timeval;
+	bytes = write(fd, buf, sizeof(buf));
+	close(fd);
+
+	return bytes == sizeof(buf) ? 0 : -1;
+}
+
+
+static off_t state_file_size(void)
+{
+	struct stat statbuf;
+
+	if (stat("data/state", &statbuf) < 0)
+		return -1;
+	return statbuf.st_size;
+}
+
+
+/* replaces the file rather than rewriting it, as the module keeps the
+   parsed contents for as long as the file's inode, size and timestamps
+   stay the same, and a rewrite can keep all of those */
+static int write_config_file(const char *contents)
+{
+	FILE *config_file = fopen("data/generated.new", "w");
+
+	if (!config_file)
+		return -1;
+	fputs(contents, config_file);
+	if (fclose(config_file))
+		return -1;
+	return rename("data/generated.new", "data/generated");
+}
+
+
+/* returns the format version of the state file, or 0 on failure */
+static uint32_t state_file_format(void)
+{
+	char buf[12];
+	uint32_t version;
+	ssize_t bytes;
+	int fd;
+
+	fd = open("data/state", O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	bytes = read(fd, buf, 12);
+	close(fd);
+
+	if (bytes != 12 || strncmp(buf, "Format: ", 8))
+		return 0;
+
+	memcpy(&version, buf+8, sizeof(uint32_t));
+	return version;
+}
+
+
 static void invalid_module_argument(void)
 {
 	const char *arg = "something_broken";
@@ -239,6 +379,37 @@ static void config_missing_limit(void)
 }
 
 
+static void config_line_too_long(void)
+{
+	const char *args[] = {
+		"path=data/generated",
+		"statepath=data/state"
+	};
+	char contents[2048];
+
+	pamh.username = "ted";
+
+	// the longest line that fits, then one that doesn't
+	memset(contents, ' ', sizeof(contents));
+	memcpy(contents, "ted\t1h", strlen("ted\t1h"));
+	contents[1022] = '\n';
+	contents[1023] = '\0';
+	CU_ASSERT_FATAL(write_config_file(contents) == 0);
+	CU_ASSERT(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "1h"));
+
+	clear_limit();
+	pamh.syslog_calls = 0;
+	memset(contents, ' ', sizeof(contents));
+	memcpy(contents, "ted\t1h", strlen("ted\t1h"));
+	contents[1023] = '\n';
+	contents[1024] = '\0';
+	CU_ASSERT_FATAL(write_config_file(contents) == 0);
+	CU_ASSERT(acct_mgmt(&pamh, 0, 2, args) == PAM_PERM_DENIED);
+	CU_ASSERT(pamh.syslog_calls == 1);
+}
+
+
 static void config_commented_limit(void)
 {
 	const char *arg = "path=data/commented_limit";
@@ -262,7 +433,7 @@ static void config_comment_after_entry(void)
 
 	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
 	CU_ASSERT(pamh.get_item_calls == 1);
-	CU_ASSERT(pamh.set_data_calls == 1);
+	CU_ASSERT(pamh.set_data_calls == 2);
 	CU_ASSERT(!strncmp(pamh.limit, "5h", 3));
 }
 
@@ -278,8 +449,9 @@ static void match_last_entry(void)
 
 	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
 	CU_ASSERT(pamh.get_item_calls == 1);
-	CU_ASSERT(pamh.set_data_calls == 1);
-	CU_ASSERT(pamh.syslog_calls == 3);
+	CU_ASSERT(pamh.set_data_calls == 2);
+	// only the entry that wins is logged
+	CU_ASSERT(pamh.syslog_calls == 1);
 	CU_ASSERT(!strcmp(pamh.limit, "12h"));
 }
 
@@ -295,214 +467,1352 @@ static void limit_with_spaces(void)
 
 	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
 	CU_ASSERT(pamh.get_item_calls == 1);
-	CU_ASSERT(pamh.set_data_calls == 1);
+	CU_ASSERT(pamh.set_data_calls == 2);
 	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+	// looking up a user does not create the state file
+	CU_ASSERT(access("data/state", F_OK) == -1);
 }
 
 
-static void invalid_time_spec(void)
+static void remaining_time_passed_natively(void)
 {
-	const char *arg = "path=data/invalid_time_spec";
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
 
 	pamh.username = "ted";
 
-	CU_ASSERT(acct_mgmt(&pamh, 0, 1, &arg) == PAM_PERM_DENIED);
-	CU_ASSERT(pamh.get_item_calls == 1);
-	CU_ASSERT(pamh.set_data_calls == 0);
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.set_data_calls == 2);
+	CU_ASSERT_FATAL(pamh.remaining != NULL);
+	CU_ASSERT(*pamh.remaining == 5*USEC_PER_HOUR + 12*USEC_PER_MINUTE);
+
+	// a second, stricter stage tightens both forms of the limit
+	args[0] = "path=data/comment_after_entry";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.set_data_calls == 4);
+	CU_ASSERT(*pamh.remaining == 5*USEC_PER_HOUR);
+	CU_ASSERT(!strcmp(pamh.limit, "5h"));
+
+	// and a more lenient one leaves them alone
+	args[0] = "path=data/match_last_entry";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.set_data_calls == 4);
+	CU_ASSERT(*pamh.remaining == 5*USEC_PER_HOUR);
 }
 
 
-static void state_file_exists_no_match(void)
+static void parse_time_suffixes(void)
 {
-	int retval;
-	const char *args[] = {
-		"path=data/limit_with_spaces",
-		"statepath=data/state"
+	static const struct {
+		const char *spec;
+		usec_t usec;
+	} cases[] = {
+		{ "1seconds", USEC_PER_SEC },
+		{ "1second", USEC_PER_SEC },
+		{ "1sec", USEC_PER_SEC },
+		{ "1s", USEC_PER_SEC },
+		{ "1minutes", USEC_PER_MINUTE },
+		{ "1minute", USEC_PER_MINUTE },
+		{ "1min", USEC_PER_MINUTE },
+		{ "1m", USEC_PER_MINUTE },
+		{ "1months", USEC_PER_MONTH },
+		{ "1month", USEC_PER_MONTH },
+		{ "1M", USEC_PER_MONTH },
+		{ "1msec", USEC_PER_MSEC },
+		{ "1ms", USEC_PER_MSEC },
+		{ "1hours", USEC_PER_HOUR },
+		{ "1hour", USEC_PER_HOUR },
+		{ "1hr", USEC_PER_HOUR },
+		{ "1h", USEC_PER_HOUR },
+		{ "1days", USEC_PER_DAY },
+		{ "1day", USEC_PER_DAY },
+		{ "1d", USEC_PER_DAY },
+		{ "1weeks", USEC_PER_WEEK },
+		{ "1week", USEC_PER_WEEK },
+		{ "1w", USEC_PER_WEEK },
+		{ "1years", USEC_PER_YEAR },
+		{ "1year", USEC_PER_YEAR },
+		{ "1y", USEC_PER_YEAR },
+		{ "1usec", 1 },
+		{ "1us", 1 },
+		{ "1\xc2\xb5s", 1 },
+		{ "1", USEC_PER_SEC },
+		{ "5h 12m", 5*USEC_PER_HOUR + 12*USEC_PER_MINUTE },
+		{ "1.5h", 90*USEC_PER_MINUTE },
+		{ "2 min 3s", 2*USEC_PER_MINUTE + 3*USEC_PER_SEC },
+		{ "1m30s", USEC_PER_MINUTE + 30*USEC_PER_SEC },
 	};
+	static const char *invalid[] = {
+		"1mo", "1hoge", "1 sec hr", "1\xc2s", "s", "",
+	};
+	unsigned int i;
+	usec_t usec;
 
-	pamh.username = "ted";
-
-	retval = initialize_state_file("bob", time(NULL), 5*USEC_PER_HOUR);
-	CU_ASSERT_FATAL(retval == 0);
+	CU_ASSERT_FATAL(parse_time_fn != NULL);
 
-	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
-	CU_ASSERT(pamh.get_item_calls == 1);
-	CU_ASSERT(pamh.set_data_calls == 1);
-	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		usec = 0;
+		CU_ASSERT(parse_time_fn(cases[i].spec, &usec, USEC_PER_SEC) == 0);
+		CU_ASSERT(usec == cases[i].usec);
+	}
+	for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+		CU_ASSERT(parse_time_fn(invalid[i], &usec, USEC_PER_SEC)
+		          == -EINVAL);
 }
 
 
-static void state_file_exists_with_match(void)
+static void debug_timing_logged(void)
 {
-	int retval;
 	const char *args[] = {
 		"path=data/limit_with_spaces",
-		"statepath=data/state"
+		"statepath=data/state",
+		"debug_timing"
 	};
 
 	pamh.username = "ted";
 
-	retval = initialize_state_file(pamh.username, time(NULL),
-	                               5*USEC_PER_HOUR);
-	CU_ASSERT_FATAL(retval == 0);
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+	// one line for the limit, one for the timing
+	CU_ASSERT(pamh.syslog_calls == 2);
+	CU_ASSERT(!strncmp(pamh.last_message,
+	                   "timing call=acct_mgmt user=ted result=0 ",
+	                   strlen("timing call=acct_mgmt user=ted result=0 ")));
+	CU_ASSERT(strstr(pamh.last_message, " config_usec=") != NULL);
+
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.start_time != NULL);
+	*pamh.start_time = time(NULL) - 60;
+
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 2, args + 1) == PAM_SUCCESS);
+	CU_ASSERT(pamh.syslog_calls == 3);
+	CU_ASSERT(!strncmp(pamh.last_message, "timing call=close_session ",
+	                   strlen("timing call=close_session ")));
+	CU_ASSERT(strstr(pamh.last_message, " writeback_usec=") != NULL);
+}
 
-	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+
+static void invalid_time_spec(void)
+{
+	const char *arg = "path=data/invalid_time_spec";
+
+	pamh.username = "ted";
+
+	CU_ASSERT(acct_mgmt(&pamh, 0, 1, &arg) == PAM_PERM_DENIED);
 	CU_ASSERT(pamh.get_item_calls == 1);
-	CU_ASSERT(pamh.set_data_calls == 1);
-	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+	CU_ASSERT(pamh.set_data_calls == 0);
 }
 
 
-static void state_file_ignore_stale_entry(void)
+static void config_cache_matches_last_entry(void)
 {
-	int retval;
 	const char *args[] = {
-		"path=data/limit_with_spaces",
-		"statepath=data/state"
+		"path=data/match_last_entry",
+		"statepath=data/state",
+		"configcache=data/generated.cache"
 	};
+	struct stat statbuf;
 
 	pamh.username = "ted";
 
-	retval = initialize_state_file(pamh.username, 0,
-	                               5*USEC_PER_HOUR);
-	CU_ASSERT_FATAL(retval == 0);
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.set_data_calls == 2);
+	CU_ASSERT(!strcmp(pamh.limit, "12h"));
+	CU_ASSERT(stat("data/generated.cache", &statbuf) == 0);
 
-	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
-	CU_ASSERT(pamh.get_item_calls == 1);
-	CU_ASSERT(pamh.set_data_calls == 1);
-	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+	// answered from the cache this time
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12h"));
+
+	pamh.username = "bob";
+	CU_ASSERT(acct_mgmt(&pamh, 0, 3, args) == PAM_IGNORE);
 }
 
 
-static void state_file_no_crash_on_truncation(void)
+static void config_cache_rebuilt_on_change(void)
 {
-	int retval;
 	const char *args[] = {
-		"path=data/limit_with_spaces",
-		"statepath=data/state"
+		"path=data/generated",
+		"statepath=data/state",
+		"configcache"
 	};
+	struct stat statbuf;
 
 	pamh.username = "ted";
 
-	retval = initialize_state_file(pamh.username, time(NULL),
-	                               5*USEC_PER_HOUR);
-	CU_ASSERT_FATAL(retval == 0);
+	CU_ASSERT_FATAL(write_config_file("ted\t5h\n") == 0);
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "5h"));
+	CU_ASSERT(stat("data/generated.cache", &statbuf) == 0);
 
-	CU_ASSERT_FATAL(truncate("data/state", 50) == 0);
+	clear_limit();
+	CU_ASSERT_FATAL(write_config_file("ted\t5h\nted\t30min\n") == 0);
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "30min"));
 
-	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
-	CU_ASSERT(pamh.get_item_calls == 1);
-	CU_ASSERT(pamh.set_data_calls == 1);
-	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+	CU_ASSERT_FATAL(write_config_file("  ted\t5h\n") == 0);
+	CU_ASSERT(acct_mgmt(&pamh, 0, 3, args) == PAM_PERM_DENIED);
 }
 
 
-static void state_file_no_crash_on_missing_NUL(void)
+/* the same lookups, with or without the config cache */
+static void group_and_wildcard_entries(const char **args, int argc)
+{
+	struct passwd *pw = getpwuid(getuid());
+	struct group *gr = getgrgid(getgid());
+	char contents[1024];
+
+	CU_ASSERT_FATAL(pw != NULL && gr != NULL);
+
+	CU_ASSERT_FATAL(write_config_file("*\t1h\nted\t2h\n") == 0);
+	pamh.username = "ted";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "2h"));
+	clear_limit();
+	pamh.username = "bob";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "1h"));
+
+	// the last match wins, even over the user's own entry
+	clear_limit();
+	CU_ASSERT_FATAL(write_config_file("ted\t2h\n*\t30min\n") == 0);
+	pamh.username = "ted";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "30min"));
+	clear_limit();
+	CU_ASSERT_FATAL(write_config_file("ted\t2h\n*\t30min\nbob\t1h\n"
+	                                  "ted\t3h\nted\t4h\n") == 0);
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "4h"));
+	clear_limit();
+	pamh.username = "alice";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "30min"));
+
+	// the test runner's own primary group
+	clear_limit();
+	snprintf(contents, sizeof(contents),
+	         "*\t1h\n@%s\t3h\n@no-such-group\t4h\n", gr->gr_name);
+	CU_ASSERT_FATAL(write_config_file(contents) == 0);
+	pamh.username = pw->pw_name;
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "3h"));
+	clear_limit();
+	pamh.username = "no-such-user";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "1h"));
+
+	clear_limit();
+	snprintf(contents, sizeof(contents), "@%s\t3h\n%s\t45min\n",
+	         gr->gr_name, pw->pw_name);
+	CU_ASSERT_FATAL(write_config_file(contents) == 0);
+	pamh.username = pw->pw_name;
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "45min"));
+	clear_limit();
+	pamh.username = "no-such-user";
+	CU_ASSERT(acct_mgmt(&pamh, 0, argc, args) == PAM_IGNORE);
+
+	// a group needs a name
+	CU_ASSERT_FATAL(write_config_file("@\t1h\n") == 0);
+	CU_ASSERT(acct_mgmt(&pamh, 0, argc, args) == PAM_PERM_DENIED);
+}
+
+
+static void group_and_wildcard_match(void)
 {
-	int retval;
 	const char *args[] = {
-		"path=data/limit_with_spaces",
+		"path=data/generated",
 		"statepath=data/state"
 	};
-	char username[NAME_MAX+2];
 
-	pamh.username = "ted";
+	group_and_wildcard_entries(args, 2);
+}
 
-	memset(username, 'A', NAME_MAX+1);
-	username[NAME_MAX+1] = '\0';
 
-	retval = initialize_state_file(username, time(NULL), 5*USEC_PER_HOUR);
-	CU_ASSERT_FATAL(retval == 0);
+static void config_cache_group_and_wildcard_match(void)
+{
+	const char *args[] = {
+		"path=data/generated",
+		"statepath=data/state",
+		"configcache"
+	};
 
-	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
-	CU_ASSERT(pamh.get_item_calls == 1);
-	CU_ASSERT(pamh.set_data_calls == 1);
-	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+	group_and_wildcard_entries(args, 3);
 }
 
 
-static void open_session_sets_time() {
-	CU_ASSERT_FATAL(open_session(&pamh, 0, 0, NULL) == PAM_SUCCESS);
-	CU_ASSERT(pamh.set_data_calls == 1);
+static void infinite_limit_skips_state_file(void)
+{
+	const char *args[] = {
+		"path=data/generated",
+		"statepath=data/state"
+	};
 
-	CU_ASSERT(pamh.start_time != NULL);
-	CU_ASSERT(*pamh.start_time <= time(NULL));
-	// If this takes longer than a minute, something has gone wrong...
-	CU_ASSERT(*pamh.start_time >= time(NULL)-60);
+	pamh.username = "ted";
+
+	// the state file isn't even looked at, so it being unreadable
+	// doesn't lock out a user without a limit
+	CU_ASSERT_FATAL(write_config_file("ted\tinfinity\n") == 0);
+	CU_ASSERT_FATAL(mkdir("data/state", 0700) == 0);
+	CU_ASSERT(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	// with nothing logged but the limit
+	CU_ASSERT(pamh.syslog_calls == 1);
+	rmdir("data/state");
+
+	// while the same file denies everyone else
+	CU_ASSERT_FATAL(write_config_file("ted\t5h\n") == 0);
+	CU_ASSERT_FATAL(mkdir("data/state", 0700) == 0);
+	clear_limit();
+	CU_ASSERT(acct_mgmt(&pamh, 0, 2, args) == PAM_PERM_DENIED);
+	rmdir("data/state");
 }
 
 
-static void close_session_updates_state() {
-	const char *arg = "statepath=data/state";
+static void config_change_picked_up(void)
+{
 	const char *args[] = {
-		"path=data/limit_with_spaces",
+		"path=data/generated",
 		"statepath=data/state"
 	};
-	struct stat statbuf;
 
 	pamh.username = "ted";
 
+	// the same size as each other, so only the inode tells them apart
+	CU_ASSERT_FATAL(write_config_file("ted\t5h\n") == 0);
 	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
-	CU_ASSERT(pamh.set_data_calls == 1);
-
-	// remove the state file created in the accounting phase
-	unlink("data/state");
-
-	CU_ASSERT_FATAL(open_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
-	CU_ASSERT(pamh.set_data_calls == 2);
+	CU_ASSERT(!strcmp(pamh.limit, "5h"));
 
-	// let's try to avoid a 0-length session, even though we're using
-	// microseconds...
-	sleep(5);
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "5h"));
 
-	CU_ASSERT(pamh.start_time != NULL);
-	CU_ASSERT(*pamh.start_time <= time(NULL));
-	CU_ASSERT(*pamh.start_time >= time(NULL)-60);
+	clear_limit();
+	CU_ASSERT_FATAL(write_config_file("ted\t2h\n") == 0);
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "2h"));
 
-	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
-	CU_ASSERT(pamh.get_data_calls == 4);
-	CU_ASSERT(stat("data/state", &statbuf) == 0);
+	// and a config file that goes away is noticed too
+	clear_limit();
+	unlink("data/generated");
+	CU_ASSERT(acct_mgmt(&pamh, 0, 2, args) == PAM_IGNORE);
+	CU_ASSERT(pamh.limit == NULL);
 }
 
 
-static void close_session_updates_existing_record() {
-	const char *arg = "statepath=data/state";
-	struct stat statbuf;
-	off_t filesize;
-	int retval;
+#define CONFIG_THREADS 8
+#define CONFIG_THREAD_CALLS 200
 
-	pamh.username = "ted";
+static void *check_config_repeatedly(void *arg)
+{
+	const char *args[] = {
+		"path=data/generated",
+		"statepath=data/state"
+	};
+	pam_handle_t handle;
+	unsigned int *failures = arg;
+	int i;
+
+	for (i = 0; i < CONFIG_THREAD_CALLS; i++) {
+		memset(&handle, '\0', sizeof(handle));
+		handle.username = "ted";
+		if (acct_mgmt(&handle, 0, 2, args) != PAM_SUCCESS
+		    || !handle.limit
+		    || (strcmp(handle.limit, "5h") && strcmp(handle.limit, "2h")))
+			(*failures)++;
+		free(handle.limit);
+		free(handle.remaining);
+	}
+	return NULL;
+}
 
-	retval = initialize_state_file("ted", time(NULL), 5*USEC_PER_HOUR);
-	CU_ASSERT_FATAL(retval == 0);
 
-	CU_ASSERT(stat("data/state", &statbuf) == 0);
-	filesize = statbuf.st_size;
+static void config_shared_between_threads(void)
+{
+	pthread_t threads[CONFIG_THREADS];
+	unsigned int failures[CONFIG_THREADS] = { 0 };
+	int i;
 
-	CU_ASSERT_FATAL(open_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
-	CU_ASSERT(pamh.set_data_calls == 1);
+	CU_ASSERT_FATAL(write_config_file("ted\t5h\n") == 0);
 
-	// let's try to avoid a 0-length session, even though we're using
-	// microseconds...
-	sleep(5);
+	for (i = 0; i < CONFIG_THREADS; i++)
+		CU_ASSERT_FATAL(pthread_create(&threads[i], NULL,
+		                               check_config_repeatedly,
+		                               &failures[i]) == 0);
 
-	CU_ASSERT(pamh.start_time != NULL);
-	CU_ASSERT(*pamh.start_time <= time(NULL));
-	CU_ASSERT(*pamh.start_time >= time(NULL)-60);
-	CU_ASSERT(stat("data/state", &statbuf) == 0);
-	CU_ASSERT(statbuf.st_size == filesize);
+	// swap versions of the file in underneath the lookups
+	for (i = 0; i < 50; i++)
+		CU_ASSERT(write_config_file(i % 2 ? "ted\t5h\n"
+		                                  : "ted\t2h\n") == 0);
+
+	for (i = 0; i < CONFIG_THREADS; i++) {
+		CU_ASSERT(pthread_join(threads[i], NULL) == 0);
+		CU_ASSERT(failures[i] == 0);
+	}
 }
 
 
-static void close_session_no_write_for_unlimited() {
-	const char *arg = "statepath=data/state";
+static void weekly_limit_counts_today(void)
+{
 	const char *args[] = {
-		"path=data/limit_with_spaces",
+		"path=data/generated",
 		"statepath=data/state"
 	};
-	struct stat statbuf;
 
-	pamh.username = "bob";
+	pamh.username = "ted";
+
+	// the tighter of the two applies
+	CU_ASSERT_FATAL(write_config_file("ted\t8h/day 6h/week\n") == 0);
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "1h"));
+	unlink("data/state");
+
+	// and time from over a week ago counts towards neither
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL) - 8*86400,
+	                                      5*USEC_PER_HOUR) == 0);
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "6h"));
+}
+
+
+static void rolling_window_counts_earlier_days(void)
+{
+	const char *args[] = {
+		"path=data/generated",
+		"statepath=data/state"
+	};
+
+	pamh.username = "ted";
+
+	// yesterday's five hours leave only one of the window for today
+	CU_ASSERT_FATAL(write_config_file("ted\t5h/day 6h/3days\n") == 0);
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL) - 86400,
+	                                      5*USEC_PER_HOUR) == 0);
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "1h"));
+
+	// and still count once today's use has moved them into the history
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.start_time != NULL);
+	*pamh.start_time = time(NULL) - 600;
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, args + 1) == PAM_SUCCESS);
+
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "50min"));
+}
+
+
+static void invalid_period_rejected(void)
+{
+	const char *args[] = {
+		"path=data/generated",
+		"statepath=data/state"
+	};
+	const char *configs[] = {
+		"ted\t5h/fortnight\n",
+		"ted\t5h/day 4h/day\n",
+		"ted\tinfinity/day 5h/day\n",
+		"ted\tinfinity/week 5h/week\n",
+		"ted\t5h/8days\n",
+		"ted\t5h/0days\n",
+		"ted\t5h/day 20h\n",
+		"ted\t/week\n",
+	};
+	unsigned int i;
+
+	pamh.username = "ted";
+
+	for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+		CU_ASSERT_FATAL(write_config_file(configs[i]) == 0);
+		CU_ASSERT(acct_mgmt(&pamh, 0, 2, args) == PAM_PERM_DENIED);
+		CU_ASSERT(pamh.limit == NULL);
+	}
+}
+
+
+static void invalid_time_spec_for_other_user(void)
+{
+	const char *arg = "path=data/generated";
+
+	pamh.username = "ted";
+
+	// invalid limits are caught when the config is loaded, not when
+	// the user they apply to logs in
+	CU_ASSERT_FATAL(write_config_file("ted\t5h\ntina\tpurple\n") == 0);
+	CU_ASSERT(acct_mgmt(&pamh, 0, 1, &arg) == PAM_PERM_DENIED);
+	CU_ASSERT(pamh.set_data_calls == 0);
+	CU_ASSERT(pamh.syslog_calls == 1);
+}
+
+
+static void state_file_exists_no_match(void)
+{
+	int retval;
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+
+	pamh.username = "ted";
+
+	retval = initialize_state_file("bob", time(NULL), 5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.get_item_calls == 1);
+	CU_ASSERT(pamh.set_data_calls == 2);
+	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+}
+
+
+static void state_file_exists_with_match(void)
+{
+	int retval;
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+
+	pamh.username = "ted";
+
+	retval = initialize_state_file(pamh.username, time(NULL),
+	                               5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.get_item_calls == 1);
+	CU_ASSERT(pamh.set_data_calls == 2);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+}
+
+
+static void state_file_exists_with_match_mmap(void)
+{
+	int retval;
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"statemmap"
+	};
+
+	pamh.username = "ted";
+
+	retval = initialize_state_file(pamh.username, time(NULL),
+	                               5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.set_data_calls == 2);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+}
+
+
+static void state_file_read_under_shared_lock(void)
+{
+	int fd, retval;
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+
+	pamh.username = "ted";
+
+	retval = initialize_state_file(pamh.username, time(NULL),
+	                               5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	// the first lookup converts the file, which needs the lock to itself
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	clear_limit();
+
+	// another reader holding the lock must not hold us up; if it does,
+	// the alarm fails the test instead of hanging
+	fd = open("data/state", O_RDONLY);
+	CU_ASSERT_FATAL(fd >= 0);
+	CU_ASSERT_FATAL(flock(fd, LOCK_SH) == 0);
+
+	alarm(10);
+	retval = acct_mgmt(&pamh, 0, 2, args);
+	alarm(0);
+	close(fd);
+
+	CU_ASSERT_FATAL(retval == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+}
+
+
+static void state_file_ignore_stale_entry(void)
+{
+	int retval;
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+
+	pamh.username = "ted";
+
+	retval = initialize_state_file(pamh.username, 0,
+	                               5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.get_item_calls == 1);
+	CU_ASSERT(pamh.set_data_calls == 2);
+	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+}
+
+
+static void state_file_no_crash_on_truncation(void)
+{
+	int retval;
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+
+	pamh.username = "ted";
+
+	retval = initialize_state_file(pamh.username, time(NULL),
+	                               5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	CU_ASSERT_FATAL(truncate("data/state", 50) == 0);
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.get_item_calls == 1);
+	CU_ASSERT(pamh.set_data_calls == 2);
+	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+}
+
+
+static void state_file_no_crash_on_missing_NUL(void)
+{
+	int retval;
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+	char username[NAME_MAX+2];
+
+	pamh.username = "ted";
+
+	memset(username, 'A', NAME_MAX+1);
+	username[NAME_MAX+1] = '\0';
+
+	retval = initialize_state_file(username, time(NULL), 5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.get_item_calls == 1);
+	CU_ASSERT(pamh.set_data_calls == 2);
+	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+}
+
+
+static void state_file_migrated_from_format_1(void)
+{
+	int retval;
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+
+	pamh.username = "ted";
+
+	retval = initialize_state_file(pamh.username, time(NULL),
+	                               5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+	CU_ASSERT_FATAL(state_file_format() == 1);
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+	CU_ASSERT(state_file_format() == 4);
+
+	// and the migrated record is still found afterwards
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+}
+
+
+/* writes a format 2 state file holding the one record, in the slot that
+   its FNV-1a hash picks */
+static int initialize_format_2_state_file(const char *username,
+                                          time_t base_time, usec_t timeval)
+{
+	const size_t record_size = NAME_MAX+1 + sizeof(time_t) + sizeof(usec_t);
+	const uint32_t version = 2, slots = 64, used = 1;
+	char header[24] = "Format: ", *table, *record;
+	uint32_t hash = 2166136261U;
+	const char *p;
+	ssize_t bytes = -1;
+	int fd;
+
+	for (p = username; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 16777619U;
+	}
+
+	table = calloc(slots, record_size);
+	if (!table)
+		return -1;
+	memcpy(header+8, &version, sizeof(uint32_t));
+	memcpy(header+12, &slots, sizeof(uint32_t));
+	memcpy(header+16, &used, sizeof(uint32_t));
+
+	record = table + (hash & (slots - 1)) * record_size;
+	strncpy(record, username, NAME_MAX+1);
+	memcpy(record+NAME_MAX+1, &base_time, sizeof(time_t));
+	memcpy(record+NAME_MAX+1+sizeof(time_t), &timeval, sizeof(usec_t));
+
+	fd = open("data/state", O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd >= 0) {
+		if (write(fd, header, sizeof(header)) == sizeof(header))
+			bytes = write(fd, table, slots * record_size);
+		close(fd);
+	}
+	free(table);
+
+	return bytes == slots * record_size ? 0 : -1;
+}
+
+
+static void state_file_migrated_from_format_2(void)
+{
+	int retval, fd;
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+	unsigned char header[32];
+
+	pamh.username = "ted";
+
+	retval = initialize_format_2_state_file(pamh.username, time(NULL),
+	                                        5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+	CU_ASSERT_FATAL(state_file_format() == 2);
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+	CU_ASSERT(state_file_format() == 4);
+	CU_ASSERT(state_file_size() == 32 + 64 * 48 + 1 + 4);
+
+	// the header is little-endian whatever the host: version 4, 64
+	// slots, one of them used, and 5 bytes of name pool
+	fd = open("data/state", O_RDONLY);
+	CU_ASSERT_FATAL(fd >= 0);
+	CU_ASSERT_FATAL(read(fd, header, sizeof(header)) == sizeof(header));
+	close(fd);
+	CU_ASSERT(header[8] == 4 && !header[9] && !header[10] && !header[11]);
+	CU_ASSERT(header[12] == 64 && !header[13]);
+	CU_ASSERT(header[16] == 1 && !header[17]);
+	CU_ASSERT(header[24] == 5 && !header[25]);
+
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+}
+
+
+/* writes a format 3 state file holding the one record, in the slot that
+   its 64-bit FNV-1a hash picks */
+static int initialize_format_3_state_file(const char *username,
+                                          time_t base_time, usec_t timeval)
+{
+	const uint32_t slots = 64, slot_size = 24;
+	size_t len = strlen(username);
+	uint64_t hash = 14695981039346656037ULL, pool_size = len + 2;
+	uint32_t day = htole32(base_time / 86400), name = htole32(1);
+	uint64_t le_hash, le_used = htole64(timeval);
+	char header[32] = "Format: ", *image, *slot;
+	size_t size = sizeof(header) + slots * slot_size + pool_size;
+	ssize_t bytes = -1;
+	const char *p;
+	int fd;
+
+	for (p = username; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 1099511628211ULL;
+	}
+	le_hash = htole64(hash);
+
+	image = calloc(1, size);
+	if (!image)
+		return -1;
+	header[8] = 3;
+	header[12] = slots;
+	header[16] = 1;
+	header[24] = pool_size;
+	memcpy(image, header, sizeof(header));
+
+	slot = image + sizeof(header) + (hash & (slots - 1)) * slot_size;
+	memcpy(slot, &le_hash, sizeof(le_hash));
+	memcpy(slot+8, &day, sizeof(day));
+	memcpy(slot+12, &name, sizeof(name));
+	memcpy(slot+16, &le_used, sizeof(le_used));
+	memcpy(image + sizeof(header) + slots * slot_size + 1, username, len);
+
+	fd = open("data/state", O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd >= 0) {
+		bytes = write(fd, image, size);
+		close(fd);
+	}
+	free(image);
+
+	return bytes == size ? 0 : -1;
+}
+
+
+static void state_file_migrated_from_format_3(void)
+{
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_format_3_state_file(pamh.username,
+	                                               time(NULL),
+	                                               5*USEC_PER_HOUR) == 0);
+	CU_ASSERT_FATAL(state_file_format() == 3);
+
+	// the slots grow to make room for the history
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+	CU_ASSERT(state_file_format() == 4);
+	CU_ASSERT(state_file_size() == 32 + 64 * 48 + 1 + 4);
+
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+}
+
+
+/* the time used by ted as of the last acct_mgmt(), against the 5h12min
+   that data/limit_with_spaces allows */
+static usec_t time_used_by_ted(void)
+{
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+
+	clear_limit();
+	if (acct_mgmt(&pamh, 0, 2, args) != PAM_SUCCESS || !pamh.remaining)
+		return USEC_INFINITY;
+	return 5*USEC_PER_HOUR + 12*USEC_PER_MINUTE - *pamh.remaining;
+}
+
+
+static void checkpoint_accounts_open_session(void)
+{
+	const char *args[] = {
+		"statepath=data/state",
+		"checkpoint"
+	};
+	time_t start, before, after;
+	usec_t used;
+	int retval;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL), 0) == 0);
+	pamh.limit = strdup("5h 12min");
+	CU_ASSERT_FATAL(pamh.limit != NULL);
+	CU_ASSERT_FATAL(open_session(&pamh, 0, 2, args) == PAM_SUCCESS);
+	start = *pamh.start_time;
+
+	sleep(2);
+	before = time(NULL);
+	retval = system("../session-timelimit-ctl --statepath=data/state "
+	                "checkpoint >/dev/null");
+	after = time(NULL);
+	CU_ASSERT_FATAL(WIFEXITED(retval) && WEXITSTATUS(retval) == 0);
+
+	// the time so far is counted while the session is still open
+	used = time_used_by_ted();
+	CU_ASSERT(used >= (before - start) * USEC_PER_SEC);
+	CU_ASSERT(used <= (after - start) * USEC_PER_SEC);
+
+	// and closing it only adds the rest
+	sleep(1);
+	pamh.limit = strdup("5h 12min");
+	CU_ASSERT_FATAL(pamh.limit != NULL);
+	before = time(NULL);
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 2, args) == PAM_SUCCESS);
+	after = time(NULL);
+	used = time_used_by_ted();
+	CU_ASSERT(used >= (before - start) * USEC_PER_SEC);
+	CU_ASSERT(used <= (after - start) * USEC_PER_SEC);
+}
+
+
+static void acct_mgmt_counts_open_sessions(void)
+{
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"checkpoint"
+	};
+	time_t start, now;
+	usec_t remaining;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+	pamh.limit = strdup("12min");
+	CU_ASSERT_FATAL(pamh.limit != NULL);
+	CU_ASSERT_FATAL(open_session(&pamh, 0, 2, args + 1) == PAM_SUCCESS);
+	start = *pamh.start_time;
+	sleep(2);
+
+	// a second login while the first session is open gets what the
+	// first hasn't used up yet
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	now = time(NULL);
+	CU_ASSERT_FATAL(pamh.remaining != NULL);
+	remaining = *pamh.remaining;
+	CU_ASSERT(remaining <= 12*USEC_PER_MINUTE - 2*USEC_PER_SEC);
+	CU_ASSERT(remaining >= 12*USEC_PER_MINUTE
+	                       - (now - start) * USEC_PER_SEC);
+
+	// which only sessions listed by the checkpoint option count for
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+
+	// and once the session is closed its time is in the state instead
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 2, args + 1) == PAM_SUCCESS);
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	CU_ASSERT(*pamh.remaining <= remaining);
+	CU_ASSERT(*pamh.remaining >= 12*USEC_PER_MINUTE
+	                             - (time(NULL) - start) * USEC_PER_SEC);
+}
+
+
+static void failed_checkpoint_loses_no_time(void)
+{
+	const char *args[] = {
+		"statepath=data/state",
+		"checkpoint"
+	};
+	time_t start, before;
+	FILE *state;
+	int retval;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL), 0) == 0);
+	pamh.limit = strdup("5h 12min");
+	CU_ASSERT_FATAL(pamh.limit != NULL);
+	CU_ASSERT_FATAL(open_session(&pamh, 0, 2, args) == PAM_SUCCESS);
+	start = *pamh.start_time;
+	sleep(2);
+
+	// a checkpoint that can't add the time to the state
+	state = fopen("data/state", "w");
+	CU_ASSERT_FATAL(state != NULL);
+	fputs("not a state file", state);
+	CU_ASSERT_FATAL(fclose(state) == 0);
+	retval = system("../session-timelimit-ctl --statepath=data/state "
+	                "checkpoint >/dev/null 2>&1");
+	CU_ASSERT(WIFEXITED(retval) && WEXITSTATUS(retval) != 0);
+
+	// leaves the session's time for its close to count
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL), 0) == 0);
+	before = time(NULL);
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(time_used_by_ted() >= (before - start) * USEC_PER_SEC);
+}
+
+
+static void checkpoint_drops_abandoned_session(void)
+{
+	const char *args[] = {
+		"statepath=data/state",
+		"checkpoint"
+	};
+	char line[128] = "";
+	FILE *output;
+	pid_t pid;
+	int status;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL), 0) == 0);
+
+	// a session whose process goes away without closing it
+	pid = fork();
+	CU_ASSERT_FATAL(pid >= 0);
+	if (pid == 0) {
+		pamh.limit = strdup("5h 12min");
+		_exit(open_session(&pamh, 0, 2, args) == PAM_SUCCESS ? 0 : 1);
+	}
+	CU_ASSERT_FATAL(waitpid(pid, &status, 0) == pid);
+	CU_ASSERT_FATAL(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	sleep(1);
+	output = popen("../session-timelimit-ctl --statepath=data/state "
+	               "checkpoint", "r");
+	CU_ASSERT_FATAL(output != NULL);
+	CU_ASSERT(fgets(line, sizeof(line), output) != NULL);
+	CU_ASSERT(pclose(output) == 0);
+	CU_ASSERT(!strcmp(line, "0 sessions checkpointed, "
+	                        "1 abandoned sessions dropped\n"));
+
+	// nothing after its last checkpoint is counted
+	CU_ASSERT(time_used_by_ted() == 0);
+}
+
+
+static void open_session_sets_time() {
+	CU_ASSERT_FATAL(open_session(&pamh, 0, 0, NULL) == PAM_SUCCESS);
+	CU_ASSERT(pamh.set_data_calls == 1);
+
+	CU_ASSERT(pamh.start_time != NULL);
+	CU_ASSERT(*pamh.start_time <= time(NULL));
+	// If this takes longer than a minute, something has gone wrong...
+	CU_ASSERT(*pamh.start_time >= time(NULL)-60);
+}
+
+
+static void close_session_updates_state() {
+	const char *arg = "statepath=data/state";
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+	struct stat statbuf;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(pamh.set_data_calls == 2);
+
+	// remove the state file created in the accounting phase
+	unlink("data/state");
+
+	CU_ASSERT_FATAL(open_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
+	CU_ASSERT(pamh.set_data_calls == 3);
+
+	// let's try to avoid a 0-length session, even though we're using
+	// microseconds...
+	sleep(5);
+
+	CU_ASSERT(pamh.start_time != NULL);
+	CU_ASSERT(*pamh.start_time <= time(NULL));
+	CU_ASSERT(*pamh.start_time >= time(NULL)-60);
+
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
+	CU_ASSERT(pamh.get_data_calls == 4);
+	CU_ASSERT(stat("data/state", &statbuf) == 0);
+}
+
+
+static void close_session_updates_existing_record() {
+	const char *arg = "statepath=data/state";
+	struct stat statbuf;
+	off_t filesize;
+	int retval;
+
+	pamh.username = "ted";
+
+	retval = initialize_state_file("ted", time(NULL), 5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	CU_ASSERT(stat("data/state", &statbuf) == 0);
+	filesize = statbuf.st_size;
+
+	CU_ASSERT_FATAL(open_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
+	CU_ASSERT(pamh.set_data_calls == 1);
+
+	// let's try to avoid a 0-length session, even though we're using
+	// microseconds...
+	sleep(5);
+
+	CU_ASSERT(pamh.start_time != NULL);
+	CU_ASSERT(*pamh.start_time <= time(NULL));
+	CU_ASSERT(*pamh.start_time >= time(NULL)-60);
+	CU_ASSERT(stat("data/state", &statbuf) == 0);
+	CU_ASSERT(statbuf.st_size == filesize);
+}
+
+
+static void close_session_adds_to_existing_record() {
+	const char *arg = "statepath=data/state";
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+	int retval;
+
+	pamh.username = "ted";
+
+	retval = initialize_state_file("ted", time(NULL), 5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+	*pamh.start_time = time(NULL) - 600;
+
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
+
+	clear_limit();
+
+	// 5h + 10min used out of 5h 12min, give or take a clock tick
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "2min")
+	          || !strcmp(pamh.limit, "1min 59s"));
+}
+
+
+/* runs session-timelimitd on data/state, returning once it is listening */
+static pid_t start_daemon(const char *flush_arg)
+{
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid == 0) {
+		execl("../session-timelimitd", "session-timelimitd",
+		      "--statepath=data/state", "--socket=data/daemon.socket",
+		      flush_arg, (char *)NULL);
+		_exit(127);
+	}
+	for (i = 0; pid > 0 && i < 500; i++) {
+		if (access("data/daemon.socket", F_OK) == 0)
+			return pid;
+		usleep(10000);
+	}
+	return -1;
+}
+
+
+/* returns the daemon's exit status */
+static int stop_daemon(pid_t pid)
+{
+	int status;
+
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+
+/* 5h + 10min used out of 5h 12min, give or take a clock tick */
+static void check_ten_minutes_added(const char **args, int argc)
+{
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "2min")
+	          || !strcmp(pamh.limit, "1min 59s"));
+}
+
+
+static void close_session_with_sync(const char *sync_arg, bool journal)
+{
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		sync_arg,
+		"statejournal"
+	};
+	int argc = journal ? 4 : 3;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+	*pamh.start_time = time(NULL) - 600;
+
+	CU_ASSERT_FATAL(close_session(&pamh, 0, argc - 1, args + 1)
+	                == PAM_SUCCESS);
+	check_ten_minutes_added(args, argc);
+}
+
+
+static void sync_policies() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"sync=sometimes"
+	};
+
+	pamh.username = "ted";
+	CU_ASSERT(acct_mgmt(&pamh, 0, 3, args) == PAM_PERM_DENIED);
+
+	close_session_with_sync("sync=always", false);
+	cleanup_pam_state();
+	setup_pam_state();
+	close_session_with_sync("sync=batched", false);
+	cleanup_pam_state();
+	setup_pam_state();
+	close_session_with_sync("sync=always", true);
+	cleanup_pam_state();
+	setup_pam_state();
+	close_session_with_sync("sync=batched", true);
+}
+
+
+static void daemon_accounts_sessions() {
+	const char *arg = "daemon=data/daemon.socket";
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"daemon=data/daemon.socket"
+	};
+	pid_t pid;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+	pid = start_daemon("--flush-interval=3600");
+	CU_ASSERT_FATAL(pid > 0);
+
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+	*pamh.start_time = time(NULL) - 600;
+
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
+	check_ten_minutes_added(args, 3);
+
+	// not yet written back
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+
+	// but it is on the way out
+	CU_ASSERT(stop_daemon(pid) == 0);
+	CU_ASSERT(access("data/daemon.socket", F_OK) == -1);
+	check_ten_minutes_added(args, 2);
+}
+
+
+static void daemon_counts_time_added_directly() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"daemon=data/daemon.socket"
+	};
+	pid_t pid;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+	pid = start_daemon("--flush-interval=1");
+	CU_ASSERT_FATAL(pid > 0);
+
+	// the daemon has read ted's record in
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+
+	// when a session's time goes to the file without it
+	clear_limit();
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+	*pamh.start_time = time(NULL) - 600;
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, args + 1) == PAM_SUCCESS);
+
+	// it reads the record again at its next flush
+	sleep(2);
+	check_ten_minutes_added(args, 3);
+	CU_ASSERT(stop_daemon(pid) == 0);
+	check_ten_minutes_added(args, 2);
+}
+
+
+static void daemon_write_through(const char *sync_arg)
+{
+	const char *arg = "daemon=data/daemon.socket";
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+	pid_t pid;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+	pid = start_daemon(sync_arg);
+	CU_ASSERT_FATAL(pid > 0);
+
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+	*pamh.start_time = time(NULL) - 600;
+
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
+	check_ten_minutes_added(args, 2);
+	CU_ASSERT(stop_daemon(pid) == 0);
+}
+
+
+static void daemon_writes_through() {
+	daemon_write_through(NULL);
+}
+
+
+static void daemon_writes_through_batched() {
+	daemon_write_through("--sync=batched");
+}
+
+
+static void daemon_unreachable_uses_state_file() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"daemon=data/daemon.socket"
+	};
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+	*pamh.start_time = time(NULL) - 600;
+
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 2, args + 1) == PAM_SUCCESS);
+	CU_ASSERT(pamh.syslog_calls == 1);
+	check_ten_minutes_added(args, 3);
+}
+
+
+static void close_session_no_write_for_unlimited() {
+	const char *arg = "statepath=data/state";
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+	struct stat statbuf;
+
+	pamh.username = "bob";
 
 	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_IGNORE);
 	CU_ASSERT(pamh.set_data_calls == 0);
@@ -522,8 +1832,387 @@ static void close_session_no_write_for_unlimited() {
 	CU_ASSERT(*pamh.start_time >= time(NULL)-60);
 
 	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, &arg) == PAM_SUCCESS);
-	CU_ASSERT(pamh.get_data_calls == 1);
+	CU_ASSERT(pamh.get_data_calls == 2);
+	CU_ASSERT(stat("data/state", &statbuf) == -1);
+}
+
+
+static void grow_state_table(const char **args, int argc)
+{
+	char username[16];
+	int i, retval;
+
+	retval = initialize_state_file("ted", time(NULL), 5*USEC_PER_HOUR);
+	CU_ASSERT_FATAL(retval == 0);
+
+	pamh.limit = strdup("1h");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+
+	// enough users to force the table to be resized, more than once
+	for (i = 0; i < 200; i++) {
+		sprintf(username, "user%d", i);
+		pamh.username = username;
+		*pamh.start_time = time(NULL) - 60;
+		// skip the path= argument, which is for acct_mgmt only
+		CU_ASSERT_FATAL(close_session(&pamh, 0, argc - 1, args + 1)
+		                == PAM_SUCCESS);
+	}
+
+	clear_limit();
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, argc, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+	CU_ASSERT(state_file_format() == 4);
+}
+
+
+static void close_session_grows_state_table() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+
+	grow_state_table(args, 2);
+}
+
+
+static void close_session_grows_state_table_mmap() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"statemmap"
+	};
+
+	grow_state_table(args, 3);
+}
+
+
+static void close_session_uses_state_dir() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statedir=data/statedir"
+	};
+	char username[16];
+	struct stat statbuf;
+	int i;
+
+	pamh.limit = strdup("5h 12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+
+	for (i = 0; i < 30; i++) {
+		sprintf(username, "user%d", i);
+		pamh.username = username;
+		*pamh.start_time = time(NULL) - 60;
+		CU_ASSERT_FATAL(close_session(&pamh, 0, 1, args + 1)
+		                == PAM_SUCCESS);
+	}
+
+	pamh.username = "ted";
+	*pamh.start_time = time(NULL) - 5*60*60;
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, args + 1) == PAM_SUCCESS);
+
+	// nothing is written to the single state file
 	CU_ASSERT(stat("data/state", &statbuf) == -1);
+
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min")
+	          || !strcmp(pamh.limit, "11min 59s"));
+
+	// 31 users can't all have landed in the same file
+	CU_ASSERT(remove_state_dir() > 1);
+}
+
+
+/* ted is current, and the stale users are from over a week ago */
+static void make_stale_state_file(int stale_users)
+{
+	char username[16];
+	int i;
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+	for (i = 0; i < stale_users; i++) {
+		sprintf(username, "stale%d", i);
+		CU_ASSERT_FATAL(append_state_record(username,
+		                                    time(NULL) - 8*86400,
+		                                    USEC_PER_HOUR) == 0);
+	}
+}
+
+
+static void close_session_compacts_stale_records() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+	char username[16];
+	off_t migrated_size;
+	int i;
+
+	make_stale_state_file(200);
+
+	// migration keeps every record, stale or not
+	pamh.username = "ted";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(state_file_format() == 4);
+	migrated_size = state_file_size();
+
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.start_time != NULL);
+
+	// enough new users to fill the table, at which point the stale
+	// records are dropped rather than the table being doubled
+	for (i = 0; i < 60; i++) {
+		sprintf(username, "user%d", i);
+		pamh.username = username;
+		*pamh.start_time = time(NULL) - 60;
+		CU_ASSERT_FATAL(close_session(&pamh, 0, 1, args + 1)
+		                == PAM_SUCCESS);
+	}
+
+	CU_ASSERT(state_file_size() < migrated_size);
+
+	clear_limit();
+	pamh.username = "ted";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+}
+
+
+static void ctl_compacts_state_file() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state"
+	};
+	int retval;
+
+	make_stale_state_file(200);
+
+	retval = system("../session-timelimit-ctl --statepath=data/state "
+	                "compact >/dev/null");
+	CU_ASSERT_FATAL(WIFEXITED(retval) && WEXITSTATUS(retval) == 0);
+	CU_ASSERT(state_file_format() == 4);
+	// only ted is left, which fits in the smallest table, and the name
+	// pool holds just the leading empty name and "ted"
+	CU_ASSERT(state_file_size() == 32 + 64 * 48 + 1 + 4);
+
+	pamh.username = "ted";
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+}
+
+
+static void ctl_queries_and_resets_users() {
+	char line[256];
+	FILE *output;
+	time_t now = time(NULL);
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", now, USEC_PER_HOUR) == 0);
+	CU_ASSERT_FATAL(append_state_record("bob", now, 2*USEC_PER_HOUR) == 0);
+
+	output = popen("../session-timelimit-ctl --statepath=data/state "
+	               "--json query ted bob", "r");
+	CU_ASSERT_FATAL(output != NULL);
+	CU_ASSERT(fgets(line, sizeof(line), output) != NULL);
+	CU_ASSERT(!strcmp(line, "[{\"user\":\"ted\",\"days_usec\":"
+	                        "[3600000000,0,0,0,0,0,0]},\n"));
+	CU_ASSERT(fgets(line, sizeof(line), output) != NULL);
+	CU_ASSERT(!strcmp(line, "{\"user\":\"bob\",\"days_usec\":"
+	                        "[7200000000,0,0,0,0,0,0]}\n"));
+	CU_ASSERT(fgets(line, sizeof(line), output) != NULL);
+	CU_ASSERT(!strcmp(line, "]\n"));
+	CU_ASSERT(pclose(output) == 0);
+
+	// the users to reset can come from stdin
+	output = popen("echo ted | ../session-timelimit-ctl "
+	               "--statepath=data/state reset -", "r");
+	CU_ASSERT_FATAL(output != NULL);
+	CU_ASSERT(fgets(line, sizeof(line), output) != NULL);
+	CU_ASSERT(pclose(output) == 0);
+	CU_ASSERT(!strcmp(line, "1 records reset\n"));
+
+	pamh.username = "ted";
+	CU_ASSERT(time_used_by_ted() == 0);
+
+	// leaving only bob
+	output = popen("../session-timelimit-ctl --statepath=data/state "
+	               "dump", "r");
+	CU_ASSERT_FATAL(output != NULL);
+	CU_ASSERT(fgets(line, sizeof(line), output) != NULL);
+	CU_ASSERT(!strncmp(line, "bob\t", 4));
+	CU_ASSERT(!strcmp(strrchr(line, '\t'), "\t2h\n"));
+	CU_ASSERT(fgets(line, sizeof(line), output) == NULL);
+	CU_ASSERT(pclose(output) == 0);
+}
+
+
+static void ctl_resets_through_daemon() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"daemon=data/daemon.socket"
+	};
+	char line[256] = "";
+	FILE *output;
+	pid_t pid;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+	pid = start_daemon("--flush-interval=3600");
+	CU_ASSERT_FATAL(pid > 0);
+
+	// time the daemon holds but has yet to write back
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+	*pamh.start_time = time(NULL) - 600;
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 1, args + 2) == PAM_SUCCESS);
+	check_ten_minutes_added(args, 3);
+
+	output = popen("../session-timelimit-ctl --statepath=data/state "
+	               "--daemon=data/daemon.socket reset ted", "r");
+	CU_ASSERT_FATAL(output != NULL);
+	CU_ASSERT(fgets(line, sizeof(line), output) != NULL);
+	CU_ASSERT(pclose(output) == 0);
+	CU_ASSERT(!strcmp(line, "1 records reset\n"));
+
+	// goes along with the record in the file
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "5h 12min"));
+	CU_ASSERT(stop_daemon(pid) == 0);
+	CU_ASSERT(time_used_by_ted() == 0);
+}
+
+
+static off_t journal_size(void)
+{
+	struct stat statbuf;
+
+	if (stat("data/state.journal", &statbuf) < 0)
+		return -1;
+	return statbuf.st_size;
+}
+
+
+static void close_session_appends_to_journal() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"statejournal"
+	};
+	const size_t record_size = NAME_MAX+1 + sizeof(time_t) + sizeof(usec_t);
+	off_t size;
+	int retval;
+
+	pamh.username = "ted";
+
+	CU_ASSERT_FATAL(initialize_state_file("ted", time(NULL),
+	                                      5*USEC_PER_HOUR) == 0);
+	size = state_file_size();
+
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+	*pamh.start_time = time(NULL) - 600;
+
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 2, args + 1) == PAM_SUCCESS);
+	CU_ASSERT(journal_size() == record_size);
+	CU_ASSERT(state_file_size() == size);
+
+	// the journal is added in by lookups that know about it
+	check_ten_minutes_added(args, 3);
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "12min"));
+
+	// and folded into the state file by compaction
+	retval = system("../session-timelimit-ctl --statepath=data/state "
+	                "compact >/dev/null");
+	CU_ASSERT_FATAL(WIFEXITED(retval) && WEXITSTATUS(retval) == 0);
+	CU_ASSERT(journal_size() == 0);
+	check_ten_minutes_added(args, 2);
+	check_ten_minutes_added(args, 3);
+}
+
+
+static void journal_keeps_long_names_apart() {
+	const char *args[] = {
+		"path=data/generated",
+		"statepath=data/state",
+		"statejournal"
+	};
+	char *usernames[] = {
+		"sixteen_chars_ab",
+		"sixteen_chars_abc",
+		"sixteen_chars_abd",
+		"sixteen_chars_a"
+	};
+	int i;
+
+	CU_ASSERT_FATAL(write_config_file("*\t12min\n") == 0);
+
+	// only the second user closes a session; the others share the
+	// first sixteen bytes of its name, or all but the last of them
+	pamh.username = usernames[1];
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+	*pamh.start_time = time(NULL) - 600;
+	CU_ASSERT_FATAL(close_session(&pamh, 0, 2, args + 1) == PAM_SUCCESS);
+
+	check_ten_minutes_added(args, 3);
+	for (i = 0; i < 4; i++) {
+		if (i == 1)
+			continue;
+		pamh.username = usernames[i];
+		clear_limit();
+		CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 3, args) == PAM_SUCCESS);
+		CU_ASSERT(!strcmp(pamh.limit, "12min"));
+	}
+}
+
+
+static void close_session_folds_large_journal() {
+	const char *args[] = {
+		"path=data/limit_with_spaces",
+		"statepath=data/state",
+		"statejournal"
+	};
+	const size_t record_size = NAME_MAX+1 + sizeof(time_t) + sizeof(usec_t);
+	int i;
+
+	pamh.username = "ted";
+	pamh.limit = strdup("12min");
+	pamh.start_time = malloc(sizeof(time_t));
+	CU_ASSERT_FATAL(pamh.limit && pamh.start_time);
+
+	// 128 sessions of a minute each
+	for (i = 0; i < 128; i++) {
+		*pamh.start_time = time(NULL) - 60;
+		CU_ASSERT_FATAL(close_session(&pamh, 0, 2, args + 1)
+		                == PAM_SUCCESS);
+	}
+	CU_ASSERT(journal_size() == 128 * record_size);
+	CU_ASSERT(access("data/state", F_OK) == -1);
+
+	// enough to be folded by the last one
+	for (i = 0; i < 128; i++) {
+		*pamh.start_time = time(NULL);
+		CU_ASSERT_FATAL(close_session(&pamh, 0, 2, args + 1)
+		                == PAM_SUCCESS);
+	}
+	CU_ASSERT(journal_size() == 0);
+
+	clear_limit();
+	CU_ASSERT_FATAL(acct_mgmt(&pamh, 0, 2, args) == PAM_SUCCESS);
+	CU_ASSERT(!strcmp(pamh.limit, "3h 4min"));
 }
 
 
@@ -540,6 +2229,7 @@ int main(int argc, char **argv)
 		{ "config file has only comments and whitespace",
 		  config_only_comments },
 		{ "config file with missing limit", config_missing_limit },
+		{ "config file with overlong line", config_line_too_long },
 		{ "config file with commented-out limit",
 		  config_commented_limit },
 		{ "config file with in-line comment after entry",
@@ -547,25 +2237,99 @@ int main(int argc, char **argv)
 		{ "limit set to last matching user entry",
 		  match_last_entry },
 		{ "limit can have spaces", limit_with_spaces },
+		{ "group and wildcard entries", group_and_wildcard_match },
+		{ "remaining time passed as usec_t", remaining_time_passed_natively },
+		{ "debug_timing logs a breakdown", debug_timing_logged },
+		{ "time unit suffixes", parse_time_suffixes },
 		{ "invalid time specification", invalid_time_spec },
+		{ "config file changes are picked up",
+		  config_change_picked_up },
+		{ "config file shared between threads",
+		  config_shared_between_threads },
+		{ "invalid time specification for another user",
+		  invalid_time_spec_for_other_user },
+		{ "config cache uses last matching entry",
+		  config_cache_matches_last_entry },
+		{ "config cache rebuilt when config changes",
+		  config_cache_rebuilt_on_change },
+		{ "config cache with group and wildcard entries",
+		  config_cache_group_and_wildcard_match },
+		{ "infinite limit skips the state file",
+		  infinite_limit_skips_state_file },
+		{ "weekly limit counts today's time",
+		  weekly_limit_counts_today },
+		{ "rolling window counts earlier days",
+		  rolling_window_counts_earlier_days },
+		{ "invalid limit periods are rejected",
+		  invalid_period_rejected },
 		{ "state file exists with no matching entry",
 		  state_file_exists_no_match },
 		{ "state file exists with matching entry",
 		  state_file_exists_with_match },
+		{ "state file with matching entry through mmap",
+		  state_file_exists_with_match_mmap },
 		{ "no crash on truncated state file",
 		  state_file_no_crash_on_truncation },
 		{ "no crash on username overflow in state file",
 		  state_file_no_crash_on_missing_NUL },
+		{ "state file read under a shared lock",
+		  state_file_read_under_shared_lock },
 		{ "ignore state file entries with stale timestamp",
 		  state_file_ignore_stale_entry },
+		{ "format 1 state file is migrated",
+		  state_file_migrated_from_format_1 },
+		{ "format 2 state file is migrated",
+		  state_file_migrated_from_format_2 },
+		{ "format 3 state file is migrated",
+		  state_file_migrated_from_format_3 },
+		{ "close_session() appends to the journal",
+		  close_session_appends_to_journal },
+		{ "journal lookups tell apart names with a common prefix",
+		  journal_keeps_long_names_apart },
+		{ "large journal is folded into the state file",
+		  close_session_folds_large_journal },
+		{ "sync policies", sync_policies },
+		{ "daemon accounts sessions in memory", daemon_accounts_sessions },
+		{ "daemon counts time added to the file directly",
+		  daemon_counts_time_added_directly },
+		{ "daemon writes through to the state file",
+		  daemon_writes_through },
+		{ "daemon syncs writes in batches",
+		  daemon_writes_through_batched },
+		{ "unreachable daemon falls back to the state file",
+		  daemon_unreachable_uses_state_file },
 		{ "open_session() sets time",
 		  open_session_sets_time },
 		{ "close_session() updates state",
 		  close_session_updates_state },
 		{ "close_session() updates existing record",
 		  close_session_updates_existing_record },
+		{ "close_session() adds to existing record",
+		  close_session_adds_to_existing_record },
 		{ "close_session() does not write entry for unlimited user",
 		  close_session_no_write_for_unlimited },
+		{ "close_session() grows the state table",
+		  close_session_grows_state_table },
+		{ "close_session() grows the state table through mmap",
+		  close_session_grows_state_table_mmap },
+		{ "close_session() uses a state directory",
+		  close_session_uses_state_dir },
+		{ "checkpoint accounts for an open session",
+		  checkpoint_accounts_open_session },
+		{ "acct_mgmt() counts the time of open sessions",
+		  acct_mgmt_counts_open_sessions },
+		{ "failed checkpoint loses no time",
+		  failed_checkpoint_loses_no_time },
+		{ "checkpoint drops abandoned sessions",
+		  checkpoint_drops_abandoned_session },
+		{ "close_session() compacts stale records",
+		  close_session_compacts_stale_records },
+		{ "session-timelimit-ctl compacts the state file",
+		  ctl_compacts_state_file },
+		{ "session-timelimit-ctl queries and resets users",
+		  ctl_queries_and_resets_users },
+		{ "session-timelimit-ctl resets through the daemon",
+		  ctl_resets_through_daemon },
 		CU_TEST_INFO_NULL,
 	};
 	CU_SuiteInfo suites[] = {
@@ -600,6 +2364,8 @@ int main(int argc, char **argv)
 		        dlerror());
 		exit(1);
 	}
+	/* only needed by the tests that use it */
+	parse_time_fn = dlsym(handle, "parse_time");
 
 
         /* Initialize the CUnit test registry. */
@@ -619,6 +2385,7 @@ int main(int argc, char **argv)
 	failures = CU_get_number_of_tests_failed();
 
 	CU_cleanup_registry();
+	unlink("data/generated");
 
 	exit (CU_get_error() != CUE_SUCCESS || failures != 0);
 }
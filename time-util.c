@@ -55,52 +55,108 @@ static char *startswith(const char *s, const char *prefix) {
 }
 
 
+struct suffix {
+        const char *suffix;
+        size_t len;
+        usec_t usec;
+};
+
+#define SUFFIX(s, u) { s, sizeof(s) - 1, u }
+
+/* Split by first byte, each in the order the suffixes are tried. Where one
+ * suffix is a prefix of another, the longer one comes first, so the first
+ * match is the longest. */
+static const struct suffix suffixes_s[] = {
+        SUFFIX("seconds", USEC_PER_SEC),
+        SUFFIX("second",  USEC_PER_SEC),
+        SUFFIX("sec",     USEC_PER_SEC),
+        SUFFIX("s",       USEC_PER_SEC),
+};
+
+static const struct suffix suffixes_m[] = {
+        SUFFIX("minutes", USEC_PER_MINUTE),
+        SUFFIX("minute",  USEC_PER_MINUTE),
+        SUFFIX("min",     USEC_PER_MINUTE),
+        SUFFIX("months",  USEC_PER_MONTH),
+        SUFFIX("month",   USEC_PER_MONTH),
+        SUFFIX("msec",    USEC_PER_MSEC),
+        SUFFIX("ms",      USEC_PER_MSEC),
+        SUFFIX("m",       USEC_PER_MINUTE),
+};
+
+static const struct suffix suffixes_M[] = {
+        SUFFIX("M",       USEC_PER_MONTH),
+};
+
+static const struct suffix suffixes_h[] = {
+        SUFFIX("hours",   USEC_PER_HOUR),
+        SUFFIX("hour",    USEC_PER_HOUR),
+        SUFFIX("hr",      USEC_PER_HOUR),
+        SUFFIX("h",       USEC_PER_HOUR),
+};
+
+static const struct suffix suffixes_d[] = {
+        SUFFIX("days",    USEC_PER_DAY),
+        SUFFIX("day",     USEC_PER_DAY),
+        SUFFIX("d",       USEC_PER_DAY),
+};
+
+static const struct suffix suffixes_w[] = {
+        SUFFIX("weeks",   USEC_PER_WEEK),
+        SUFFIX("week",    USEC_PER_WEEK),
+        SUFFIX("w",       USEC_PER_WEEK),
+};
+
+static const struct suffix suffixes_y[] = {
+        SUFFIX("years",   USEC_PER_YEAR),
+        SUFFIX("year",    USEC_PER_YEAR),
+        SUFFIX("y",       USEC_PER_YEAR),
+};
+
+static const struct suffix suffixes_u[] = {
+        SUFFIX("usec",    1ULL),
+        SUFFIX("us",      1ULL),
+};
+
+/* "µs", whose UTF-8 encoding starts with 0xc2 */
+static const struct suffix suffixes_micro[] = {
+        SUFFIX("µs",      1ULL),
+};
+
+
 static const char* extract_multiplier(const char *p, usec_t *ret) {
-        static const struct {
-                const char *suffix;
-                usec_t usec;
-        } table[] = {
-                { "seconds", USEC_PER_SEC    },
-                { "second",  USEC_PER_SEC    },
-                { "sec",     USEC_PER_SEC    },
-                { "s",       USEC_PER_SEC    },
-                { "minutes", USEC_PER_MINUTE },
-                { "minute",  USEC_PER_MINUTE },
-                { "min",     USEC_PER_MINUTE },
-                { "months",  USEC_PER_MONTH  },
-                { "month",   USEC_PER_MONTH  },
-                { "M",       USEC_PER_MONTH  },
-                { "msec",    USEC_PER_MSEC   },
-                { "ms",      USEC_PER_MSEC   },
-                { "m",       USEC_PER_MINUTE },
-                { "hours",   USEC_PER_HOUR   },
-                { "hour",    USEC_PER_HOUR   },
-                { "hr",      USEC_PER_HOUR   },
-                { "h",       USEC_PER_HOUR   },
-                { "days",    USEC_PER_DAY    },
-                { "day",     USEC_PER_DAY    },
-                { "d",       USEC_PER_DAY    },
-                { "weeks",   USEC_PER_WEEK   },
-                { "week",    USEC_PER_WEEK   },
-                { "w",       USEC_PER_WEEK   },
-                { "years",   USEC_PER_YEAR   },
-                { "year",    USEC_PER_YEAR   },
-                { "y",       USEC_PER_YEAR   },
-                { "usec",    1ULL            },
-                { "us",      1ULL            },
-                { "µs",      1ULL            },
-        };
+        const struct suffix *table;
+        size_t n;
 
         assert(p);
         assert(ret);
 
-        for (size_t i = 0; i < ELEMENTSOF(table); i++) {
-                char *e;
+#define DISPATCH(c, t)                          \
+        case c:                                 \
+                table = t;                      \
+                n = ELEMENTSOF(t);              \
+                break
+
+        switch ((unsigned char) *p) {
+        DISPATCH('s', suffixes_s);
+        DISPATCH('m', suffixes_m);
+        DISPATCH('M', suffixes_M);
+        DISPATCH('h', suffixes_h);
+        DISPATCH('d', suffixes_d);
+        DISPATCH('w', suffixes_w);
+        DISPATCH('y', suffixes_y);
+        DISPATCH('u', suffixes_u);
+        DISPATCH(0xc2, suffixes_micro);
+        default:
+                return p;
+        }
+
+#undef DISPATCH
 
-                e = startswith(p, table[i].suffix);
-                if (e) {
+        for (size_t i = 0; i < n; i++) {
+                if (strneq(p, table[i].suffix, table[i].len)) {
                         *ret = table[i].usec;
-                        return e;
+                        return p + table[i].len;
                 }
         }
 
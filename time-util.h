@@ -1,3 +1,6 @@
+#ifndef TIME_UTIL_H
+#define TIME_UTIL_H
+
 #include <inttypes.h>
 
 typedef uint64_t usec_t;
@@ -19,6 +22,18 @@ typedef uint64_t usec_t;
 
 #define FORMAT_TIMESPAN_MAX 64U
 
+static inline usec_t usec_add(usec_t a, usec_t b) {
+        /* Adds two time values, and makes sure USEC_INFINITY as input results as USEC_INFINITY in output,
+         * and doesn't overflow. */
+
+        if (a > USEC_INFINITY - b) /* overflow check */
+                return USEC_INFINITY;
+
+        return a + b;
+}
+
 int parse_time(const char *t, usec_t *ret, usec_t default_unit);
 char* format_timespan(char *buf, size_t l, usec_t t, usec_t accuracy)
 	__attribute__((__warn_unused_result__));
+
+#endif
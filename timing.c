@@ -0,0 +1,51 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <syslog.h>
+#include <time.h>
+
+#include <security/pam_ext.h>
+
+#include "timing.h"
+
+
+usec_t timing_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (usec_t)ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+
+/* key=value pairs, so that the lines can be picked out of the log and
+   aggregated by machine */
+void log_call_timing(const pam_handle_t *handle, const char *call,
+                     const char *username, int retval,
+                     const struct call_timing *timing, usec_t start)
+{
+	pam_syslog(handle, LOG_INFO,
+	           "timing call=%s user=%s result=%d total_usec=" USEC_FMT
+	           " config_usec=" USEC_FMT " lock_usec=" USEC_FMT
+	           " lookup_usec=" USEC_FMT " writeback_usec=" USEC_FMT,
+	           call, username ? username : "-", retval,
+	           timing_now() - start, timing->config, timing->lock,
+	           timing->lookup, timing->writeback);
+}
@@ -0,0 +1,47 @@
+/*
+ *
+ * Copyright (c) 2023 Steve Langasek <vorlon@dodds.net>
+ *
+ * pam_session_timelimit is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * pam_session_timelimit is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <security/pam_modules.h>
+
+#include "time-util.h"
+
+/* where the time in a PAM call went, with the debug_timing option */
+struct call_timing {
+	/* reading the config file or its cache */
+	usec_t config;
+	/* waiting for state file locks */
+	usec_t lock;
+	/* finding the user's state record */
+	usec_t lookup;
+	/* updating the state file, including any rebuild */
+	usec_t writeback;
+};
+
+/* the monotonic clock */
+usec_t timing_now(void);
+
+/* logs a single line with the breakdown, for a call that started at
+   start and returned retval */
+void log_call_timing(const pam_handle_t *handle, const char *call,
+                     const char *username, int retval,
+                     const struct call_timing *timing, usec_t start);
+
+#endif